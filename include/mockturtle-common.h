@@ -42,6 +42,62 @@ enum rt_action_standard {
 /**< __MAX_ACTION_SEND coming from GCC on compilation */
 #define MAX_ACTION_SEND (__MAX_ACTION_SEND + __RT_ACTION_SEND_STANDARD_NUMBER)
 
+/* Binary Log Definition */
+
+#define TRTL_LOG_MAGIC 0x4C4F4721 /**< "LOG!" */
+#define TRTL_LOG_MAX_ARGS 5 /**< maximum number of arguments in a record */
+#define TRTL_LOG_MAX_CPU 8 /**< rings in TRTL_LOG_RING_SYMBOL, one per CPU */
+#define TRTL_LOG_RING_SYMBOL "rt_log_ring" /**< rings symbol in the ELF */
+#define TRTL_LOG_FMT_SECTION ".rt_log_fmt" /**< format strings section */
+
+/**
+ * Binary log record. Arguments are stored raw and formatted by the host
+ */
+struct trtl_log_record {
+	uint32_t fmt; /**< format string offset in TRTL_LOG_FMT_SECTION */
+	uint32_t sec; /**< timestamp, seconds */
+	uint32_t cycles; /**< timestamp, cycles */
+	uint32_t args[TRTL_LOG_MAX_ARGS]; /**< format arguments */
+};
+
+/**
+ * Binary log ring in shared memory
+ */
+struct trtl_log_ring {
+	uint32_t magic; /**< TRTL_LOG_MAGIC once initialized */
+	uint32_t size; /**< number of records (power of 2) */
+	uint32_t head; /**< number of records written since start-up */
+	uint32_t unused; /**< not used, future use */
+	struct trtl_log_record rec[]; /**< records */
+};
+
+/* Variable Mirror Definition */
+#define TRTL_VAR_MIRROR_MAGIC 0x4D495252 /**< "MIRR" */
+/**
+ * Shared memory offset of the mirror directory: one word per CPU with the
+ * address of its mirror table, 0 when not available. The RT linker script
+ * keeps the last bytes of the shared memory for it
+ */
+#define TRTL_VAR_MIRROR_DIR_OFFSET 0xFFE0
+#define TRTL_VAR_MIRROR_DIR_SIZE 8 /**< number of directory entries */
+#define TRTL_VAR_MIRROR_HDR_WORDS 5 /**< header size in words */
+/** Number of words in a mirror table for _n variables */
+#define TRTL_VAR_MIRROR_WORDS(_n) ((((_n) + 31) / 32) + (_n))
+
+/**
+ * Table of variable values published in shared memory. The words are
+ * a bitmap of the mirrored variables followed by the value of each variable
+ */
+struct trtl_var_mirror {
+	uint32_t magic; /**< TRTL_VAR_MIRROR_MAGIC once initialized */
+	uint32_t rt_id; /**< RT application identifier */
+	uint32_t seq; /**< sequence number, odd while values are updated */
+	uint32_t n_var; /**< number of variables */
+	uint32_t slot_in; /**< bitmask of the host input slots the application
+			     serves */
+	uint32_t word[]; /**< bitmap and values */
+};
+
 /* Protocol Definition */
 
 #define TRTL_PROTO_FLAG_REMOTE		(1 << 0)
@@ -49,6 +105,10 @@ enum rt_action_standard {
 #define TRTL_PROTO_FLAG_RPC		(1 << 2)
 #define TRTL_PROTO_FLAG_PERIODICAL	(1 << 3)
 
+/* Transaction descriptor: the RT application echoes it in the answer */
+#define TRTL_PROTO_TRANS_RPC		(1 << 7) /**< library RPC session */
+#define TRTL_PROTO_TRANS_SEQ_MASK	0x7F /**< RPC session tag */
+
 /**
  * Protocol header definition
  */
@@ -7,8 +7,6 @@
 #define  __TRTL_USER_H__
 /** @file mock-turtle.h */
 
-#define TRTL_MAX_CARRIER 20 /**< Maximum number of WRNC components on a
-			       single computer*/
 #define TRTL_MAX_CPU 8 /**< Maximum number of CPU core in a WRNC bitstream */
 #define TRTL_MAX_HMQ_SLOT 32 /**< Maximum number of HMQ slots in a
 				WRNC bitstream */
@@ -84,6 +82,93 @@ struct trtl_smem_io {
 	enum trtl_smem_modifier mod;  /**< the kind of operation to do */
 };
 
+#define TRTL_SMEM_IO_BATCH_MAX 1024 /**< maximum number of IO in a batch */
+
+/**
+ * Descriptor of a sequence of IO operations on Shared Memory
+ */
+struct trtl_smem_io_batch {
+	uint32_t n_io; /**< number of operations */
+	uint32_t unused; /**< not used, future use */
+	uint64_t io; /**< operations (struct trtl_smem_io *), executed
+			in order */
+};
+
+#define TRTL_SAMPLER_MAX_RANGE 8 /**< maximum number of sampled ranges */
+#define TRTL_SAMPLER_MAX_WORDS 256 /**< maximum number of sampled words */
+#define TRTL_SAMPLER_MAX_SAMPLES (1 << 16) /**< maximum ring size in
+					      samples */
+#define TRTL_SAMPLER_CHANGE_ONLY (1 << 0) /**< store a sample only when
+					     at least a word changed */
+/**
+ * mmap() offset of the sampler ring on the device, it follows the
+ * shared memory windows
+ */
+#define TRTL_SAMPLER_MMAP_OFFSET 0x60000
+
+/**
+ * Shared memory range to sample
+ */
+struct trtl_smem_range {
+	uint32_t addr; /**< shared memory address */
+	uint32_t count; /**< number of words */
+};
+
+/**
+ * Shared memory sampler configuration
+ */
+struct trtl_sampler_cfg {
+	uint32_t period_us; /**< sampling period in micro-seconds, at least
+			       10us for each sampled word */
+	uint32_t flags; /**< TRTL_SAMPLER_* flags */
+	uint32_t n_sample; /**< ring size in samples (power of 2, up to
+			      TRTL_SAMPLER_MAX_SAMPLES) */
+	uint32_t n_range; /**< number of valid ranges */
+	struct trtl_smem_range range[TRTL_SAMPLER_MAX_RANGE]; /**< ranges */
+};
+
+/**
+ * Header of the sampler ring. Samples follow it, 'sample_size' apart
+ */
+struct trtl_sampler_ring {
+	uint32_t head; /**< number of samples stored since start */
+	uint32_t n_sample; /**< ring size in samples */
+	uint32_t sample_size; /**< size of a sample in byte */
+	uint32_t n_word; /**< number of words in a sample */
+};
+
+/**
+ * A shared memory sample. Words are in the order of the ranges
+ */
+struct trtl_sample {
+	uint64_t ts; /**< host time in nano-seconds */
+	uint32_t seq; /**< sample sequence number, ~0 while written */
+	uint32_t unused; /**< not used, future use */
+	uint32_t word[]; /**< sampled words */
+};
+
+/**
+ * Descriptor of a CPU application for the gang load
+ */
+struct trtl_gang_image {
+	uint32_t index; /**< CPU index */
+	uint32_t size; /**< application size in byte. When 0 the CPU is
+			  only restarted */
+	uint64_t code; /**< application code (flat binary) user address */
+};
+
+#define TRTL_GANG_START (1 << 0) /**< start all the CPUs after the load */
+
+/**
+ * Descriptor of the load of a set of CPUs
+ */
+struct trtl_gang_load {
+	uint32_t n_image; /**< number of images */
+	uint32_t flags; /**< TRTL_GANG_* flags */
+	uint64_t image; /**< images to load (struct trtl_gang_image *),
+			   one per CPU */
+};
+
 /**
  * @enum trtl_ioctl_commands
  * Available ioctl() messages
@@ -93,6 +178,12 @@ enum trtl_ioctl_commands {
 	TRTL_SMEM_IO, /**< access to shared memory */
 	TRTL_MSG_FILTER_ADD, /**< add a message filter */
 	TRTL_MSG_FILTER_CLEAN, /**< remove all filters */
+	TRTL_GANG_LOAD, /**< load and start a set of CPUs */
+	TRTL_SMEM_IO_BATCH, /**< access to shared memory, many words */
+	TRTL_SAMPLER_START, /**< start the shared memory sampler */
+	TRTL_SAMPLER_STOP, /**< stop the shared memory sampler */
+	TRTL_CPU_CLEAN, /**< clean, or not, the CPU memory on the writes
+			   of a CPU file */
 };
 
 
@@ -108,4 +199,13 @@ enum trtl_ioctl_commands {
 #define TRTL_IOCTL_MSG_FILTER_CLEAN _IOW(TRTL_IOCTL_MAGIC,		\
 					 TRTL_MSG_FILTER_CLEAN,		\
 					 struct trtl_msg_filter)
+#define TRTL_IOCTL_GANG_LOAD _IOW(TRTL_IOCTL_MAGIC, TRTL_GANG_LOAD, \
+				  struct trtl_gang_load)
+#define TRTL_IOCTL_SMEM_IO_BATCH _IOW(TRTL_IOCTL_MAGIC, TRTL_SMEM_IO_BATCH, \
+				      struct trtl_smem_io_batch)
+#define TRTL_IOCTL_SAMPLER_START _IOW(TRTL_IOCTL_MAGIC, TRTL_SAMPLER_START, \
+				      struct trtl_sampler_cfg)
+#define TRTL_IOCTL_SAMPLER_STOP _IO(TRTL_IOCTL_MAGIC, TRTL_SAMPLER_STOP)
+/* CPU device: the argument is 1 to clean the memory, 0 to keep it */
+#define TRTL_IOCTL_CPU_CLEAN _IO(TRTL_IOCTL_MAGIC, TRTL_CPU_CLEAN)
 #endif
@@ -15,12 +15,16 @@
 #include <linux/debugfs.h>
 #include <linux/fs.h>
 #include <linux/cdev.h>
+#include <linux/idr.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
 #include <linux/wait.h>
 #include <linux/poll.h>
 #include <linux/sched.h>
 #include <linux/delay.h>
+#include <linux/mm.h>
+#include <linux/pci.h>
+#include <linux/compat.h>
 
 #include <linux/fmc.h>
 #include <linux/fmc-sdb.h>
@@ -50,45 +54,37 @@ static struct class trtl_cdev_class = {
 };
 
 static dev_t basedev;
-static struct cdev cdev_dev;
-static struct cdev cdev_cpu;
-static struct cdev cdev_hmq;
+static struct cdev cdev_trtl;
 
-struct device *minors[TRTL_MAX_MINORS];
+static DEFINE_IDR(trtl_minors);
+static DEFINE_SPINLOCK(trtl_minors_lock);
+
+static const struct device_type trtl_types[] = {
+	[TRTL_DEV] = { .name = "trtl-dev" },
+	[TRTL_CPU] = { .name = "trtl-cpu" },
+	[TRTL_HMQ] = { .name = "trtl-hmq" },
+};
 
 
 /**
- * It return the first available char device minor for a given type.
+ * It allocates a char device minor for a given device
  */
 static int trtl_minor_get(struct device *dev, enum trtl_dev_type type)
 {
-	int i, start, end;
+	int m;
 
-	switch (type) {
-	case TRTL_DEV:
-		start = 0;
-		end = start + TRTL_MAX_CARRIER;
-		break;
-	case TRTL_CPU:
-		start = TRTL_MAX_CARRIER;
-		end = start + TRTL_MAX_CPU_MINORS;
-		break;
-	case TRTL_HMQ:
-		start = TRTL_MAX_CARRIER + TRTL_MAX_CPU_MINORS;
-		end = start + TRTL_MAX_HMQ_MINORS;
-		break;
-	default:
-		return -1;
-	}
+	idr_preload(GFP_KERNEL);
+	spin_lock(&trtl_minors_lock);
+	m = idr_alloc(&trtl_minors, dev, 0, TRTL_MAX_MINORS, GFP_NOWAIT);
+	spin_unlock(&trtl_minors_lock);
+	idr_preload_end();
+	if (m < 0)
+		return m;
 
-	for (i = start; i < end; ++i) {
-		if (minors[i] == NULL) {
-			minors[i] = dev;
-			dev->devt = basedev + i;
-			return 0;
-		}
-	}
-	return -1;
+	dev->devt = MKDEV(MAJOR(basedev), m);
+	dev->type = &trtl_types[type];
+
+	return 0;
 }
 
 
@@ -97,14 +93,24 @@ static int trtl_minor_get(struct device *dev, enum trtl_dev_type type)
  */
 static void trtl_minor_put(struct device *dev)
 {
-	int i;
+	spin_lock(&trtl_minors_lock);
+	idr_remove(&trtl_minors, MINOR(dev->devt));
+	spin_unlock(&trtl_minors_lock);
+}
 
-	for (i = 0; i < TRTL_MAX_CPU_MINORS + TRTL_MAX_HMQ_MINORS; ++i) {
-		if (minors[i] == dev) {
-			minors[i] = NULL;
-			break;
-		}
-	}
+
+/**
+ * It returns the device that owns a char device minor
+ */
+struct device *trtl_minor_dev(unsigned int minor)
+{
+	struct device *dev;
+
+	spin_lock(&trtl_minors_lock);
+	dev = idr_find(&trtl_minors, minor);
+	spin_unlock(&trtl_minors_lock);
+
+	return dev;
 }
 
 
@@ -200,12 +206,15 @@ static ssize_t trtl_store_reset_mask(struct device *dev,
 {
 	struct trtl_dev *trtl = to_trtl_dev(dev);
 	struct fmc_device *fmc = to_fmc_dev(trtl);
+	uint32_t reg_val;
 	long val;
 
 	if (kstrtol(buf, 16, &val))
 		return -EINVAL;
 
+	reg_val = fmc_readl(fmc, trtl->base_csr + WRN_CPU_CSR_REG_RESET);
 	fmc_writel(fmc, val, trtl->base_csr + WRN_CPU_CSR_REG_RESET);
+	trtl_cpu_fw_taint(trtl, reg_val & ~val);
 
 	return count;
 }
@@ -279,11 +288,13 @@ static const struct attribute_group *trtl_dev_groups[] = {
  */
 static void trtl_dev_release(struct device *dev)
 {
-
+	trtl_minor_put(dev);
 }
 
 /**
- * ioctl command to read/write shared memory
+ * ioctl command to read/write shared memory. Atomic operations are done
+ * through their own window, as the user space mappings do, so the
+ * operation register always stays on direct access
  */
 static long trtl_ioctl_io(struct trtl_dev *trtl, void __user *uarg)
 {
@@ -296,23 +307,71 @@ static long trtl_ioctl_io(struct trtl_dev *trtl, void __user *uarg)
 	err = copy_from_user(&io, uarg, sizeof(struct trtl_smem_io));
 	if (err)
 		return err;
+	if (io.addr % 4 || io.addr >= TRTL_SMEM_MAX_SIZE ||
+	    io.mod < TRTL_SMEM_DIRECT || io.mod > TRTL_SMEM_XOR)
+		return -EINVAL;
 
-	if (io.is_input) {
-		/* read */
-		addr = trtl->base_smem + io.addr;
-	} else {
-		fmc_writel(fmc, io.mod, trtl->base_csr + WRN_CPU_CSR_REG_SMEM_OP);
-		/* write */
-		addr = trtl->base_smem + io.addr;
-		fmc_writel(fmc, io.value, addr);
-	}
-
+	addr = trtl->base_smem + io.addr;
+	if (!io.is_input)
+		fmc_writel(fmc, io.value, addr + io.mod * TRTL_SMEM_MAX_SIZE);
 	/* read value from SMEM */
 	io.value = fmc_readl(fmc, addr);
 
 	return copy_to_user(uarg, &io, sizeof(struct trtl_smem_io));
 }
 
+/**
+ * ioctl command to execute a sequence of read/write on the shared memory.
+ * Like trtl_ioctl_io(), atomic operations go through their own window, so
+ * there is no shared state to lock and the sequence can be preempted
+ */
+static long trtl_ioctl_io_batch(struct trtl_dev *trtl, void __user *uarg)
+{
+	struct fmc_device *fmc = to_fmc_dev(trtl);
+	struct trtl_smem_io_batch batch;
+	struct trtl_smem_io *io;
+	uint32_t addr;
+	int err = 0, i;
+
+	if (copy_from_user(&batch, uarg, sizeof(struct trtl_smem_io_batch)))
+		return -EFAULT;
+	if (!batch.n_io || batch.n_io > TRTL_SMEM_IO_BATCH_MAX)
+		return -EINVAL;
+
+	io = kmalloc_array(batch.n_io, sizeof(struct trtl_smem_io), GFP_KERNEL);
+	if (!io)
+		return -ENOMEM;
+	if (copy_from_user(io, u64_to_user_ptr(batch.io),
+			   batch.n_io * sizeof(struct trtl_smem_io))) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < batch.n_io; ++i) {
+		if (io[i].addr % 4 || io[i].addr >= TRTL_SMEM_MAX_SIZE ||
+		    io[i].mod < TRTL_SMEM_DIRECT || io[i].mod > TRTL_SMEM_XOR) {
+			err = -EINVAL;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < batch.n_io; ++i) {
+		addr = trtl->base_smem + io[i].addr;
+		if (!io[i].is_input)
+			fmc_writel(fmc, io[i].value,
+				   addr + io[i].mod * TRTL_SMEM_MAX_SIZE);
+		io[i].value = fmc_readl(fmc, addr);
+		cond_resched();
+	}
+
+	if (copy_to_user(u64_to_user_ptr(batch.io), io,
+			 batch.n_io * sizeof(struct trtl_smem_io)))
+		err = -EFAULT;
+out:
+	kfree(io);
+	return err;
+}
+
 static long trtl_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 {
 	struct trtl_dev *trtl = f->private_data;
@@ -336,6 +395,18 @@ static long trtl_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 	case TRTL_IOCTL_SMEM_IO:
 		err = trtl_ioctl_io(trtl, uarg);
 		break;
+	case TRTL_IOCTL_SMEM_IO_BATCH:
+		err = trtl_ioctl_io_batch(trtl, uarg);
+		break;
+	case TRTL_IOCTL_GANG_LOAD:
+		err = trtl_cpu_gang_load(trtl, uarg);
+		break;
+	case TRTL_IOCTL_SAMPLER_START:
+		err = trtl_sampler_start(trtl, uarg);
+		break;
+	case TRTL_IOCTL_SAMPLER_STOP:
+		err = trtl_sampler_stop(trtl);
+		break;
 	default:
 		pr_warn("ual: invalid ioctl command %d\n", cmd);
 		return -EINVAL;
@@ -344,6 +415,18 @@ static long trtl_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 	return err;
 }
 
+#ifdef CONFIG_COMPAT
+/**
+ * ioctl commands from 32bit processes. The device commands have the same
+ * layout on any architecture
+ */
+static long trtl_compat_ioctl(struct file *f, unsigned int cmd,
+			      unsigned long arg)
+{
+	return trtl_ioctl(f, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
 /**
  * It writes on the shared memory
  */
@@ -412,6 +495,48 @@ static ssize_t trtl_read(struct file *f, char __user *buf,
 }
 
 
+/**
+ * It maps the shared memory windows in user space. The direct access window
+ * is followed by one window for each atomic operation, in the order of
+ * enum trtl_smem_modifier. It is available only when the carrier exposes
+ * the FPGA as a PCI BAR. The sampler ring follows the windows
+ */
+static int trtl_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	struct trtl_dev *trtl = f->private_data;
+	struct fmc_device *fmc = to_fmc_dev(trtl);
+	unsigned long off = vma->vm_pgoff << PAGE_SHIFT;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct pci_dev *pdev;
+	phys_addr_t phys;
+
+	if (off >= TRTL_SAMPLER_MMAP_OFFSET)
+		return trtl_sampler_mmap(trtl, vma);
+
+	if (!fmc->hwdev || !dev_is_pci(fmc->hwdev))
+		return -ENODEV;
+	/* Private copies of device memory make no sense */
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+	pdev = to_pci_dev(fmc->hwdev);
+	if (off + size > TRTL_SMEM_MAX_SIZE * TRTL_SMEM_N_WINDOW ||
+	    trtl->base_smem > pci_resource_len(pdev, 0) ||
+	    off + size > pci_resource_len(pdev, 0) - trtl->base_smem)
+		return -EINVAL;
+
+	phys = pci_resource_start(pdev, 0) + trtl->base_smem;
+	if (phys & ~PAGE_MASK)
+		return -ENODEV;
+
+	vma->vm_flags |= VM_IO | VM_DONTEXPAND | VM_DONTDUMP;
+	vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+
+	return io_remap_pfn_range(vma, vma->vm_start,
+				  (phys + off) >> PAGE_SHIFT, size,
+				  vma->vm_page_prot);
+}
+
+
 /**
  * Open the char device on the top of the hierarchy
  */
@@ -419,7 +544,7 @@ static int trtl_dev_simple_open(struct inode *inode, struct file *file)
 {
 	int m = iminor(inode);
 
-	file->private_data = to_trtl_dev(minors[m]);
+	file->private_data = to_trtl_dev(trtl_minor_dev(m));
 
 	return 0;
 }
@@ -431,6 +556,41 @@ static const struct file_operations trtl_dev_fops = {
 	.write = trtl_write,
 	.llseek = generic_file_llseek,
 	.unlocked_ioctl = trtl_ioctl,
+#ifdef CONFIG_COMPAT
+	.compat_ioctl = trtl_compat_ioctl,
+#endif
+	.mmap = trtl_mmap,
+};
+
+
+/**
+ * Open any char device of the driver. It selects the file operations of
+ * the device that owns the minor
+ */
+static int trtl_open(struct inode *inode, struct file *file)
+{
+	struct device *dev = trtl_minor_dev(iminor(inode));
+	const struct file_operations *fops;
+
+	if (!dev)
+		return -ENODEV;
+
+	if (dev->type == &trtl_types[TRTL_CPU])
+		fops = &trtl_cpu_fops;
+	else if (dev->type == &trtl_types[TRTL_HMQ])
+		fops = &trtl_hmq_fops;
+	else
+		fops = &trtl_dev_fops;
+
+	replace_fops(file, fops);
+
+	return file->f_op->open(inode, file);
+}
+
+static const struct file_operations trtl_fops = {
+	.owner = THIS_MODULE,
+	.open  = trtl_open,
+	.llseek = noop_llseek,
 };
 
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -442,7 +602,7 @@ static const struct file_operations trtl_dev_fops = {
  */
 static void trtl_cpu_release(struct device *dev)
 {
-	/*trtl_minor_put(dev);*/
+	trtl_minor_put(dev);
 }
 
 /**
@@ -451,8 +611,10 @@ static void trtl_cpu_release(struct device *dev)
 static void trtl_hmq_release(struct device *dev)
 {
 	struct trtl_hmq *hmq = to_trtl_hmq(dev);
-	/*trtl_minor_put(dev);*/
+
+	trtl_minor_put(dev);
 	kfree(hmq->buf.mem);
+	kfree(hmq->sync_answer);
 }
 
 #define TRTL_SLOT_CFG(_name, _val)                          \
@@ -488,10 +650,17 @@ static int trtl_probe_hmq(struct trtl_dev *trtl, unsigned int slot,
 	hmq->stats.count = 0;
 	hmq->buf.ptr_w = 0;
 	hmq->buf.ptr_r = 0;
+	/* The buffer is allocated on first use */
 	hmq->buf.size = hmq_default_buf_size;
-	hmq->buf.mem = kzalloc(hmq->buf.size, GFP_KERNEL);
-	if (!hmq->buf.mem)
-		return -ENOMEM;
+	hmq->buf.mem = NULL;
+	hmq->buf_ref = 0;
+	INIT_DELAYED_WORK(&hmq->buf_idle, trtl_hmq_buf_idle_work);
+	/* Synchronous answers come only from the CPU output slots */
+	if (!is_input) {
+		hmq->sync_answer = kzalloc(sizeof(struct trtl_msg), GFP_KERNEL);
+		if (!hmq->sync_answer)
+			return -ENOMEM;
+	}
 
 	init_waitqueue_head(&hmq->q_msg);
 	hmq->dev.class = &trtl_cdev_class;
@@ -500,7 +669,7 @@ static int trtl_probe_hmq(struct trtl_dev *trtl, unsigned int slot,
 	hmq->dev.release = trtl_hmq_release;
 	err = device_register(&hmq->dev);
 	if (err) {
-		kfree(hmq->buf.mem);
+		kfree(hmq->sync_answer);
 		return err;
 	}
 
@@ -583,6 +752,10 @@ int trtl_probe(struct fmc_device *fmc)
 	}
 
 
+	mutex_init(&trtl->sampler_mtx);
+	mutex_init(&trtl->core_sel_mtx);
+	fmc_writel(fmc, TRTL_SMEM_DIRECT, trtl->base_csr + WRN_CPU_CSR_REG_SMEM_OP);
+
 	/* Get the Application ID */
 	trtl->app_id = fmc_readl(fmc, trtl->base_csr + WRN_CPU_CSR_REG_APP_ID);
 	dev_info(&fmc->dev, "Application ID: 0x%08x\n", trtl->app_id);
@@ -596,6 +769,12 @@ int trtl_probe(struct fmc_device *fmc)
 		goto out_n_cpu;
 	}
 	dev_info(&fmc->dev, "Detected %d CPUs\n", trtl->n_cpu);
+	trtl->cpu = devm_kcalloc(&fmc->dev, trtl->n_cpu,
+				 sizeof(struct trtl_cpu), GFP_KERNEL);
+	if (!trtl->cpu) {
+		err = -ENOMEM;
+		goto out_n_cpu;
+	}
 
 	/* Pause all CPUs */
 	trtl_cpu_enable_set(trtl, (1 << trtl->n_cpu) - 1);
@@ -619,6 +798,9 @@ int trtl_probe(struct fmc_device *fmc)
 		trtl->cpu[i].dev.groups = trtl_cpu_groups;
 		trtl->cpu[i].dev.release = trtl_cpu_release;
 		err = device_register(&trtl->cpu[i].dev);
+		if (err)
+			goto out_cpu;
+		err = trtl_dbg_init(&trtl->cpu[i]);
 		if (err)
 			goto out_cpu;
 		snprintf(tmp_name, 128, "%s-dbg", dev_name(&trtl->cpu[i].dev));
@@ -643,6 +825,15 @@ int trtl_probe(struct fmc_device *fmc)
 	}
 	dev_info(&fmc->dev, "Detected slots: %d input, %d output\n",
 		trtl->n_hmq_in, trtl->n_hmq_out);
+	trtl->hmq_in = devm_kcalloc(&fmc->dev, trtl->n_hmq_in,
+				    sizeof(struct trtl_hmq), GFP_KERNEL);
+	trtl->hmq_out = devm_kcalloc(&fmc->dev, trtl->n_hmq_out,
+				     sizeof(struct trtl_hmq), GFP_KERNEL);
+	if ((trtl->n_hmq_in && !trtl->hmq_in) ||
+	    (trtl->n_hmq_out && !trtl->hmq_out)) {
+		err = -ENOMEM;
+		goto out_n_slot;
+	}
 
 	/* Configure slots */
 	for (i = 0; i < trtl->n_hmq_in; ++i) {
@@ -681,11 +872,12 @@ int trtl_probe(struct fmc_device *fmc)
 
 	/* Enable debug interrupts */
 	fmc->irq = trtl->base_core + 1;
+	INIT_WORK(&trtl->dbg_work, trtl_dbg_work);
 
 	/* Enable debug interface interrupts only when we have space
 	   to store it */
 	err = fmc_irq_request(fmc,  trtl_irq_handler_debug,
-			      (char *)dev_name(&trtl->cpu[i].dev),
+			      (char *)dev_name(&trtl->dev),
 			      0 /*VIC is used */);
 	if (err) {
 		dev_err(&trtl->dev,
@@ -693,7 +885,7 @@ int trtl_probe(struct fmc_device *fmc)
 			fmc->irq);
 	}
 
-	if (dbg_max_msg > 0) {
+	if (dbg_n_line > 0) {
 		/* Enable interrupts only when we have a buffere where
 		   store messages */
 		fmc_writel(fmc, 0xFFFFFFFF/*(trtl->n_cpu - 1)*/,
@@ -740,17 +932,25 @@ int trtl_remove(struct fmc_device *fmc)
 	fmc_writel(fmc, 0x0, trtl->base_csr + WRN_CPU_CSR_REG_DBG_IMSK);
 	fmc->irq = trtl->base_core + 1;
 	fmc_irq_free(fmc);
+	cancel_work_sync(&trtl->dbg_work);
+	fmc_writel(fmc, 0x0, trtl->base_csr + WRN_CPU_CSR_REG_DBG_IMSK);
+
+	trtl_sampler_stop(trtl);
 
 	debugfs_remove_recursive(trtl->dbg_dir);
 
 	for (i = 0; i < trtl->n_cpu; ++i)
 		device_unregister(&trtl->cpu[i].dev);
 
-	for (i = 0; i < trtl->n_hmq_in; ++i)
+	for (i = 0; i < trtl->n_hmq_in; ++i) {
+		cancel_delayed_work_sync(&trtl->hmq_in[i].buf_idle);
 		device_unregister(&trtl->hmq_in[i].dev);
+	}
 
-	for (i = 0; i < trtl->n_hmq_out; ++i)
+	for (i = 0; i < trtl->n_hmq_out; ++i) {
+		cancel_delayed_work_sync(&trtl->hmq_out[i].buf_idle);
 		device_unregister(&trtl->hmq_out[i].dev);
+	}
 
 	/* FIXME cannot explain why, but without sleep the _kernel_ crash */
 	msleep(50);
@@ -789,10 +989,7 @@ static struct fmc_driver trtl_dev_drv = {
  */
 static int trtl_init(void)
 {
-	int err, i;
-
-	for (i = 0; i < TRTL_MAX_CPU_MINORS; ++i)
-		minors[i] = NULL;
+	int err;
 
 	err = class_register(&trtl_cdev_class);
 	if (err) {
@@ -800,35 +997,22 @@ static int trtl_init(void)
 		return err;
 	}
 
-	/* Allocate a char device region for devices, CPUs and slots */
+	/*
+	 * Allocate a char device region for devices, CPUs and slots. Minors
+	 * are assigned on probe, one char device serves all of them
+	 */
 	err = alloc_chrdev_region(&basedev, 0, TRTL_MAX_MINORS, "trtl");
 	if (err) {
 		pr_err("%s: unable to allocate region for %i minors\n",
-		       __func__, TRTL_MAX_CPU_MINORS);
+		       __func__, TRTL_MAX_MINORS);
 		goto out_all;
 	}
 
-	/* Register the device char-device */
-	cdev_init(&cdev_dev, &trtl_dev_fops);
-	cdev_dev.owner = THIS_MODULE;
-	err = cdev_add(&cdev_dev, basedev, TRTL_MAX_CARRIER);
+	cdev_init(&cdev_trtl, &trtl_fops);
+	cdev_trtl.owner = THIS_MODULE;
+	err = cdev_add(&cdev_trtl, basedev, TRTL_MAX_MINORS);
 	if (err)
-		goto out_cdev_dev;
-	/* Register the cpu char-device */
-	cdev_init(&cdev_cpu, &trtl_cpu_fops);
-	cdev_cpu.owner = THIS_MODULE;
-	err = cdev_add(&cdev_cpu, basedev + TRTL_MAX_CARRIER,
-		       TRTL_MAX_CPU_MINORS);
-	if (err)
-		goto out_cdev_cpu;
-	/* Register the hmq char-device */
-	cdev_init(&cdev_hmq, &trtl_hmq_fops);
-	cdev_cpu.owner = THIS_MODULE;
-	err = cdev_add(&cdev_hmq,
-		       basedev + TRTL_MAX_CARRIER + TRTL_MAX_CPU_MINORS,
-		       TRTL_MAX_HMQ_MINORS);
-	if (err)
-		goto out_cdev_hmq;
+		goto out_cdev;
 
 	/* Register the FMC driver */
 	err = fmc_driver_register(&trtl_dev_drv);
@@ -838,12 +1022,8 @@ static int trtl_init(void)
 	return 0;
 
 out_reg:
-	cdev_del(&cdev_hmq);
-out_cdev_hmq:
-	cdev_del(&cdev_cpu);
-out_cdev_cpu:
-	cdev_del(&cdev_dev);
-out_cdev_dev:
+	cdev_del(&cdev_trtl);
+out_cdev:
 	unregister_chrdev_region(basedev, TRTL_MAX_MINORS);
 out_all:
 	class_unregister(&trtl_cdev_class);
@@ -857,10 +1037,10 @@ out_all:
 static void trtl_exit(void)
 {
 	fmc_driver_unregister(&trtl_dev_drv);
-	cdev_del(&cdev_cpu);
-	unregister_chrdev_region(basedev,
-				 TRTL_MAX_CPU_MINORS + TRTL_MAX_HMQ_MINORS);
+	cdev_del(&cdev_trtl);
+	unregister_chrdev_region(basedev, TRTL_MAX_MINORS);
 	class_unregister(&trtl_cdev_class);
+	idr_destroy(&trtl_minors);
 }
 
 module_init(trtl_init);
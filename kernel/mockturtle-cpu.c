@@ -6,15 +6,37 @@
 
 #include <linux/kernel.h>
 #include <linux/module.h>
+#include <linux/moduleparam.h>
 #include <linux/fs.h>
 #include <linux/delay.h>
 #include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/crc32.h>
 
 #include <linux/fmc.h>
 #include <hw/mockturtle_cpu_csr.h>
 
 #include "mockturtle-drv.h"
 
+static int fw_fast_load = 1;
+module_param_named(fw_fast_load, fw_fast_load, int, 0644);
+MODULE_PARM_DESC(fw_fast_load, "Load firmware without per-word delays and verify it with a single checksum pass. Default 1");
+
+static int fw_diff_load = 1;
+module_param_named(fw_diff_load, fw_diff_load, int, 0644);
+MODULE_PARM_DESC(fw_diff_load, "Skip, or rewrite only the changed words, when loading the firmware already in memory. Default 1");
+
+static int fw_clean = 1;
+module_param_named(fw_clean, fw_clean, int, 0644);
+MODULE_PARM_DESC(fw_clean, "Clean the CPU memory past the written firmware on each write, unless the file asks otherwise. Default 1");
+
+/**
+ * An open CPU file
+ */
+struct trtl_cpu_file {
+	struct trtl_cpu *cpu;
+	int clean; /**< clean the memory on each write */
+};
 
 /**
  * Set the reset bit of the CPUs according to the mask
@@ -40,6 +62,22 @@ static void trtl_cpu_reset_clr(struct trtl_dev *trtl, uint8_t mask)
 	reg_val = fmc_readl(fmc, trtl->base_csr + WRN_CPU_CSR_REG_RESET);
 	reg_val &= (~mask & 0xFF);
 	fmc_writel(fmc, reg_val, trtl->base_csr + WRN_CPU_CSR_REG_RESET);
+
+	trtl_cpu_fw_taint(trtl, mask);
+}
+
+/**
+ * It marks the CPU memory as modified for all the CPUs in the mask.
+ * It must be called each time a CPU leaves the reset state, because
+ * from that moment the running application can change its own memory
+ */
+void trtl_cpu_fw_taint(struct trtl_dev *trtl, uint32_t mask)
+{
+	int i;
+
+	for (i = 0; i < trtl->n_cpu; ++i)
+		if (mask & (1 << i))
+			trtl->cpu[i].fw_intact = 0;
 }
 
 /**
@@ -150,13 +188,27 @@ static ssize_t trtl_store_enable(struct device *dev,
 	return count;
 }
 
+/**
+ * It returns the hash of the last firmware loaded, 0 when unknown
+ */
+static ssize_t trtl_show_firmware_hash(struct device *dev,
+				       struct device_attribute *attr,
+				       char *buf)
+{
+	struct trtl_cpu *cpu = to_trtl_cpu(dev);
+
+	return sprintf(buf, "0x%08x\n", cpu->fw_size ? cpu->fw_hash : 0);
+}
+
 
 DEVICE_ATTR(enable, (S_IRUGO | S_IWUSR), trtl_show_enable, trtl_store_enable);
 DEVICE_ATTR(reset, (S_IRUGO | S_IWUSR), trtl_show_reset, trtl_store_reset);
+DEVICE_ATTR(firmware_hash, S_IRUGO, trtl_show_firmware_hash, NULL);
 
 static struct attribute *trtl_cpu_attr[] = {
 	&dev_attr_enable.attr,
 	&dev_attr_reset.attr,
+	&dev_attr_firmware_hash.attr,
 	NULL,
 };
 
@@ -171,15 +223,168 @@ const struct attribute_group *trtl_cpu_groups[] = {
 
 
 /**
- * It loads a given application into the CPU memory
+ * It writes a word in the memory of the selected CPU
+ * @param[in] trtl device token
+ * @param[in] val value to write
+ * @param[in] addr word address in the CPU memory
+ * @param[in] wait microseconds to wait after each register access
  */
-static int trtl_cpu_firmware_load(struct trtl_cpu *cpu, void *fw_buf,
-				  size_t count, loff_t off)
+static inline void trtl_cpu_mem_writel(struct trtl_dev *trtl, uint32_t val,
+				       unsigned int addr, unsigned int wait)
+{
+	struct fmc_device *fmc = to_fmc_dev(trtl);
+
+	fmc_writel(fmc, addr, trtl->base_csr + WRN_CPU_CSR_REG_UADDR);
+	if (wait)
+		udelay(wait);
+	fmc_writel(fmc, val, trtl->base_csr + WRN_CPU_CSR_REG_UDATA);
+	if (wait)
+		udelay(wait);
+}
+
+/**
+ * It reads a word from the memory of the selected CPU
+ * @param[in] trtl device token
+ * @param[in] addr word address in the CPU memory
+ * @param[in] wait microseconds to wait after each register access
+ * @return the word value
+ */
+static inline uint32_t trtl_cpu_mem_readl(struct trtl_dev *trtl,
+					  unsigned int addr, unsigned int wait)
+{
+	struct fmc_device *fmc = to_fmc_dev(trtl);
+	uint32_t val;
+
+	fmc_writel(fmc, addr, trtl->base_csr + WRN_CPU_CSR_REG_UADDR);
+	if (wait)
+		udelay(wait);
+	val = fmc_readl(fmc, trtl->base_csr + WRN_CPU_CSR_REG_UDATA);
+	if (wait)
+		udelay(wait);
+
+	return val;
+}
+
+
+/**
+ * It loads the firmware word by word. Each word is read back and
+ * verified before writing the next one.
+ */
+static int trtl_cpu_firmware_load_slow(struct trtl_cpu *cpu, uint32_t *fw,
+				       int size, int offset, int clean_end)
 {
 	struct trtl_dev *trtl = to_trtl_dev(cpu->dev.parent);
 	struct fmc_device *fmc = to_fmc_dev(trtl);
-	uint32_t *fw = fw_buf, word, word_rb;
-	int size, offset, i, cpu_memsize;
+	uint32_t word, word_rb;
+	int i;
+
+	/* Clean CPU memory */
+	for (i = offset; i < clean_end; ++i)
+		trtl_cpu_mem_writel(trtl, 0, i, 1);
+
+	/* Load the firmware */
+	for (i = 0; i < size; ++i) {
+		word = cpu_to_be32(fw[i]);
+		trtl_cpu_mem_writel(trtl, word, i + offset, 1);
+		word_rb = fmc_readl(fmc,
+				    trtl->base_csr + WRN_CPU_CSR_REG_UDATA);
+		udelay(1);
+		if (word != word_rb) {
+			dev_err(&cpu->dev,
+				"failed to load firmware (byte %d | 0x%x != 0x%x)\n",
+				i, word, word_rb);
+			return -EFAULT;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * It loads the firmware by streaming all the words without delays. The
+ * upload is verified at the end with a single checksum pass over
+ * the memory content.
+ */
+static int trtl_cpu_firmware_load_fast(struct trtl_cpu *cpu, uint32_t *fw,
+				       int size, int offset, int clean_end)
+{
+	struct trtl_dev *trtl = to_trtl_dev(cpu->dev.parent);
+	uint32_t word, crc_w = 0, crc_r = 0;
+	int i;
+
+	/* Clean CPU memory */
+	for (i = offset; i < clean_end; ++i)
+		trtl_cpu_mem_writel(trtl, 0, i, 0);
+
+	/* Load the firmware */
+	for (i = 0; i < size; ++i) {
+		word = cpu_to_be32(fw[i]);
+		trtl_cpu_mem_writel(trtl, word, i + offset, 0);
+		crc_w = crc32_le(crc_w, (unsigned char *)&word, sizeof(word));
+	}
+
+	/* Verify the firmware */
+	for (i = 0; i < size; ++i) {
+		word = trtl_cpu_mem_readl(trtl, i + offset, 0);
+		crc_r = crc32_le(crc_r, (unsigned char *)&word, sizeof(word));
+	}
+
+	if (crc_w != crc_r) {
+		dev_warn(&cpu->dev,
+			 "firmware checksum mismatch (0x%08x != 0x%08x)\n",
+			 crc_w, crc_r);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+
+/**
+ * It loads the firmware by rewriting only the words that differ from
+ * the current memory content. Memory beyond the firmware, up to
+ * 'clean_end', is expected to be zero.
+ * @return the number of rewritten words, or a negative error code
+ */
+static int trtl_cpu_firmware_load_diff(struct trtl_cpu *cpu, uint32_t *fw,
+				       int size, int offset, int clean_end)
+{
+	struct trtl_dev *trtl = to_trtl_dev(cpu->dev.parent);
+	uint32_t word, word_rb;
+	int i, end, n = 0;
+
+	end = max(offset + size, clean_end);
+	for (i = offset; i < end; ++i) {
+		word = (i - offset < size) ? cpu_to_be32(fw[i - offset]) : 0;
+		if (trtl_cpu_mem_readl(trtl, i, 0) == word)
+			continue;
+
+		trtl_cpu_mem_writel(trtl, word, i, 0);
+		word_rb = trtl_cpu_mem_readl(trtl, i, 0);
+		if (word != word_rb) {
+			dev_err(&cpu->dev,
+				"failed to load firmware (word %d | 0x%x != 0x%x)\n",
+				i, word, word_rb);
+			return -EFAULT;
+		}
+		n++;
+	}
+
+	return n;
+}
+
+
+/**
+ * trtl_cpu_firmware_load() with the CPU selection already locked
+ */
+static int __trtl_cpu_firmware_load(struct trtl_cpu *cpu, void *fw_buf,
+				    size_t count, loff_t off, int clean)
+{
+	struct trtl_dev *trtl = to_trtl_dev(cpu->dev.parent);
+	struct fmc_device *fmc = to_fmc_dev(trtl);
+	uint32_t *fw = fw_buf, hash = 0, app_id = 0;
+	int size, offset, cpu_memsize, clean_end, err;
 
 	/* Select the CPU memory to write */
 	fmc_writel(fmc, cpu->index, trtl->base_csr + WRN_CPU_CSR_REG_CORE_SEL);
@@ -195,38 +400,80 @@ static int trtl_cpu_firmware_load(struct trtl_cpu *cpu, void *fw_buf,
 	/* Calculate code size in 32bit word*/
 	size = (count + 3) / 4;
 	offset = off / 4;
+	clean_end = clean ? cpu_memsize / 1024 : 0;
 
 	/* Reset the CPU before overwrite its memory */
 	trtl_cpu_reset_set(trtl, (1 << cpu->index));
 
-	/* Clean CPU memory */
-	for (i = offset; i < cpu_memsize / 1024; ++i) {
-		fmc_writel(fmc, i, trtl->base_csr + WRN_CPU_CSR_REG_UADDR);
-		udelay(1);
-		fmc_writel(fmc, 0, trtl->base_csr + WRN_CPU_CSR_REG_UDATA);
-		udelay(1);
+	/*
+	 * The hash identifies only complete images, so partial loads
+	 * forget about the previous firmware.
+	 */
+	if (off) {
+		cpu->fw_size = 0;
+		goto load;
 	}
 
-	/* Load the firmware */
-	for (i = 0; i < size; ++i) {
-		word = cpu_to_be32(fw[i]);
-		fmc_writel(fmc, i + offset,
-			   trtl->base_csr + WRN_CPU_CSR_REG_UADDR);
-		udelay(1);
-		fmc_writel(fmc, word, trtl->base_csr + WRN_CPU_CSR_REG_UDATA);
-		udelay(1);
-		word_rb = fmc_readl(fmc,
-				    trtl->base_csr + WRN_CPU_CSR_REG_UDATA);
-		udelay(1);
-		if (word != word_rb) {
-			dev_err(&cpu->dev,
-				"failed to load firmware (byte %d | 0x%x != 0x%x)\n",
-				i, word, word_rb);
-			return -EFAULT;
+	hash = crc32_le(0, fw_buf, count);
+	app_id = fmc_readl(fmc, trtl->base_csr + WRN_CPU_CSR_REG_APP_ID);
+	if (fw_diff_load && cpu->fw_size == count && cpu->fw_hash == hash &&
+	    cpu->fw_app_id == app_id) {
+		if (cpu->fw_intact) {
+			dev_dbg(&cpu->dev, "firmware 0x%08x already loaded\n",
+				hash);
+			return 0;
+		}
+
+		err = trtl_cpu_firmware_load_diff(cpu, fw, size, offset,
+						  clean_end);
+		if (err >= 0) {
+			dev_dbg(&cpu->dev,
+				"firmware 0x%08x reloaded, %d words changed\n",
+				hash, err);
+			err = 0;
+			goto out;
 		}
 	}
 
-	return 0;
+	cpu->fw_size = 0;
+load:
+	err = -EFAULT;
+	if (fw_fast_load) {
+		err = trtl_cpu_firmware_load_fast(cpu, fw, size, offset,
+						  clean_end);
+		if (err)
+			dev_warn(&cpu->dev,
+				 "fast load failed, retry word by word\n");
+	}
+	if (err)
+		err = trtl_cpu_firmware_load_slow(cpu, fw, size, offset,
+						  clean_end);
+	if (err || off)
+		return err;
+out:
+	cpu->fw_hash = hash;
+	cpu->fw_size = count;
+	cpu->fw_app_id = app_id;
+	cpu->fw_intact = 1;
+
+	return err;
+}
+
+/**
+ * It loads a given application into the CPU memory. When 'clean' is set
+ * the memory past the given offset is zeroed before the load
+ */
+static int trtl_cpu_firmware_load(struct trtl_cpu *cpu, void *fw_buf,
+				  size_t count, loff_t off, int clean)
+{
+	struct trtl_dev *trtl = to_trtl_dev(cpu->dev.parent);
+	int err;
+
+	mutex_lock(&trtl->core_sel_mtx);
+	err = __trtl_cpu_firmware_load(cpu, fw_buf, count, off, clean);
+	mutex_unlock(&trtl->core_sel_mtx);
+
+	return err;
 }
 
 static int trtl_cpu_firmware_dump(struct trtl_cpu *cpu, void *fw_buf,
@@ -242,12 +489,14 @@ static int trtl_cpu_firmware_dump(struct trtl_cpu *cpu, void *fw_buf,
 	size = (count + 3) / 4;
 	offset = off / 4;
 
+	mutex_lock(&trtl->core_sel_mtx);
 	/* Select the CPU memory to write */
 	fmc_writel(fmc, cpu->index, trtl->base_csr + WRN_CPU_CSR_REG_CORE_SEL);
 
 	cpu_memsize = fmc_readl(fmc, trtl->base_csr + WRN_CPU_CSR_REG_CORE_MEMSIZE );
 
 	if (off + count > cpu_memsize) {
+		mutex_unlock(&trtl->core_sel_mtx);
 		dev_err(&cpu->dev, "Cannot dump firmware: size limit %d byte\n",
 			cpu_memsize);
 		return -ENOMEM;
@@ -255,13 +504,10 @@ static int trtl_cpu_firmware_dump(struct trtl_cpu *cpu, void *fw_buf,
 
 	/* Dump the firmware */
 	for (i = 0; i < size; ++i) {
-		fmc_writel(fmc, i + offset,
-			   trtl->base_csr + WRN_CPU_CSR_REG_UADDR);
-		udelay(1);
-		word = fmc_readl(fmc, trtl->base_csr + WRN_CPU_CSR_REG_UDATA);
-		udelay(1);
+		word = trtl_cpu_mem_readl(trtl, i + offset, fw_fast_load ? 0 : 1);
 		fw[i] = be32_to_cpu(word);
 	}
+	mutex_unlock(&trtl->core_sel_mtx);
 
 	return 0;
 }
@@ -269,20 +515,109 @@ static int trtl_cpu_firmware_dump(struct trtl_cpu *cpu, void *fw_buf,
 
 static int trtl_cpu_simple_open(struct inode *inode, struct file *file)
 {
+	struct trtl_cpu_file *cf;
 	int m = iminor(inode);
 
-	file->private_data = to_trtl_cpu(minors[m]);
+	cf = kzalloc(sizeof(struct trtl_cpu_file), GFP_KERNEL);
+	if (!cf)
+		return -ENOMEM;
+	cf->cpu = to_trtl_cpu(trtl_minor_dev(m));
+	cf->clean = fw_clean;
+	file->private_data = cf;
 
 	return 0;
 }
 
+static int trtl_cpu_release(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+
+	return 0;
+}
+
+/**
+ * It loads a set of applications and then it starts all the CPUs at once.
+ * All the CPUs in the set are paused and kept in reset during the load,
+ * then a single write on the reset register and a single write on the
+ * enable register make them start together.
+ */
+long trtl_cpu_gang_load(struct trtl_dev *trtl, void __user *uarg)
+{
+	struct fmc_device *fmc = to_fmc_dev(trtl);
+	struct trtl_gang_load gang;
+	struct trtl_gang_image *img;
+	uint32_t mask = 0, reg_rst, reg_ena;
+	void *lbuf;
+	int i, err = 0;
+
+	if (copy_from_user(&gang, uarg, sizeof(struct trtl_gang_load)))
+		return -EFAULT;
+	if (!gang.n_image || gang.n_image > trtl->n_cpu)
+		return -EINVAL;
+
+	img = kcalloc(gang.n_image, sizeof(struct trtl_gang_image), GFP_KERNEL);
+	if (!img)
+		return -ENOMEM;
+	if (copy_from_user(img, u64_to_user_ptr(gang.image),
+			   gang.n_image * sizeof(struct trtl_gang_image))) {
+		err = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < gang.n_image; ++i) {
+		if (img[i].index >= trtl->n_cpu || mask & (1 << img[i].index)) {
+			err = -EINVAL;
+			goto out;
+		}
+		mask |= (1 << img[i].index);
+	}
+
+	/* Pause and reset all the CPUs before touching their memory */
+	trtl_cpu_enable_set(trtl, mask);
+	trtl_cpu_reset_set(trtl, mask);
+
+	for (i = 0; i < gang.n_image; ++i) {
+		if (!img[i].size)
+			continue;
+
+		lbuf = vmalloc(img[i].size);
+		if (!lbuf) {
+			err = -ENOMEM;
+			goto out;
+		}
+		if (copy_from_user(lbuf, u64_to_user_ptr(img[i].code),
+				   img[i].size))
+			err = -EFAULT;
+		else
+			err = trtl_cpu_firmware_load(&trtl->cpu[img[i].index],
+						     lbuf, img[i].size, 0, 1);
+		vfree(lbuf);
+		if (err)
+			goto out;
+	}
+
+	if (!(gang.flags & TRTL_GANG_START))
+		goto out;
+
+	/* Release the reset while paused, then run them all together */
+	reg_rst = fmc_readl(fmc, trtl->base_csr + WRN_CPU_CSR_REG_RESET);
+	reg_ena = fmc_readl(fmc, trtl->base_csr + WRN_CPU_CSR_REG_ENABLE);
+	fmc_writel(fmc, reg_rst & ~mask, trtl->base_csr + WRN_CPU_CSR_REG_RESET);
+	trtl_cpu_fw_taint(trtl, mask);
+	fmc_writel(fmc, reg_ena & ~mask, trtl->base_csr + WRN_CPU_CSR_REG_ENABLE);
+
+out:
+	kfree(img);
+	return err;
+}
+
 /**
  * It writes a given firmware into a CPU
  */
 static ssize_t trtl_cpu_write(struct file *f, const char __user *buf,
 			      size_t count, loff_t *offp)
 {
-	struct trtl_cpu *cpu = f->private_data;
+	struct trtl_cpu_file *cf = f->private_data;
 	void *lbuf;
 	int err;
 
@@ -297,7 +632,7 @@ static ssize_t trtl_cpu_write(struct file *f, const char __user *buf,
 		goto out_cpy;
 	}
 
-	err = trtl_cpu_firmware_load(cpu, lbuf, count, *offp);
+	err = trtl_cpu_firmware_load(cf->cpu, lbuf, count, *offp, cf->clean);
 	if (err)
 		goto out_load;
 
@@ -315,7 +650,7 @@ out_cpy:
 static ssize_t trtl_cpu_read(struct file *f, char __user *buf,
 			     size_t count, loff_t *offp)
 {
-	struct trtl_cpu *cpu = f->private_data;
+	struct trtl_cpu_file *cf = f->private_data;
 	void *lbuf;
 	int err;
 
@@ -323,7 +658,7 @@ static ssize_t trtl_cpu_read(struct file *f, char __user *buf,
 	if (!lbuf)
 		return -ENOMEM;
 
-	err = trtl_cpu_firmware_dump(cpu, lbuf, count, *offp);
+	err = trtl_cpu_firmware_dump(cf->cpu, lbuf, count, *offp);
 	if (err)
 		goto out_dmp;
 
@@ -340,10 +675,31 @@ out_dmp:
 	return err ? err : count;
 }
 
+/**
+ * ioctl commands of a CPU file. Arguments are values, not pointers, so
+ * 32bit processes use the same handler
+ */
+static long trtl_cpu_ioctl(struct file *f, unsigned int cmd,
+			   unsigned long arg)
+{
+	struct trtl_cpu_file *cf = f->private_data;
+
+	switch (cmd) {
+	case TRTL_IOCTL_CPU_CLEAN:
+		cf->clean = !!arg;
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
 const struct file_operations trtl_cpu_fops = {
 	.owner = THIS_MODULE,
 	.open  = trtl_cpu_simple_open,
+	.release = trtl_cpu_release,
 	.write  = trtl_cpu_write,
 	.read = trtl_cpu_read,
 	.llseek = generic_file_llseek,
+	.unlocked_ioctl = trtl_cpu_ioctl,
+	.compat_ioctl = trtl_cpu_ioctl,
 };
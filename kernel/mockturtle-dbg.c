@@ -12,96 +12,156 @@
 #include <linux/fs.h>
 #include <linux/poll.h>
 #include <linux/circ_buf.h>
+#include <linux/log2.h>
 
 #include <linux/fmc.h>
 #include <hw/mockturtle_cpu_csr.h>
 
 #include "mockturtle-drv.h"
 
-int dbg_max_msg = 1024; /**< debug messages buffer */
+static int dbg_max_msg = 32768; /**< debug buffer size in byte */
 module_param_named(max_dbg_msg, dbg_max_msg, int, 0444);
-MODULE_PARM_DESC(max_dbg_msg, "Maximum number of debug messages in driver queue.");
+MODULE_PARM_DESC(max_dbg_msg, "Size in byte of the debug buffer of each CPU, it holds lines of 128 characters. Default 32768");
 
+unsigned int dbg_n_line; /**< debug lines in the buffer, power of 2 */
 
-static int trtl_dbg_open(struct inode *inode, struct file *file)
-{
+static int dbg_max_batch = 64;
+module_param_named(dbg_max_batch, dbg_max_batch, int, 0644);
+MODULE_PARM_DESC(dbg_max_batch, "Maximum number of characters read from a CPU debug channel in a single pass. Default 64");
+
+static int dbg_timestamp = 1;
+module_param_named(dbg_timestamp, dbg_timestamp, int, 0644);
+MODULE_PARM_DESC(dbg_timestamp, "Prefix debug lines with the host time of reception. Default 1");
+
+
+/**
+ * It describes a reader of the debug lines of a CPU
+ */
+struct trtl_dbg_reader {
 	struct trtl_cpu *cpu;
+	unsigned long seq; /**< sequence number of the next line to read */
+};
 
-	if (inode->i_private)
-		file->private_data = inode->i_private;
-	cpu = file->private_data;
 
-	cpu->cbuf.buf = kmalloc(dbg_max_msg, GFP_KERNEL);
-	if (!cpu->cbuf.buf)
-		if (dbg_max_msg > 0)
-			return -ENOMEM;
+/**
+ * It allocates the debug line buffer of a CPU. The buffer is shared by
+ * all the readers
+ */
+int trtl_dbg_init(struct trtl_cpu *cpu)
+{
+	struct trtl_dev *trtl = to_trtl_dev(cpu->dev.parent);
+	struct fmc_device *fmc = to_fmc_dev(trtl);
+
+	init_waitqueue_head(&cpu->dbg_wq);
+	cpu->dbg_seq = 0;
 
-	/* when dbg_max_msg is 0 we want to keep the debug interface
-	   available so that programs will not complain */
+	/* when dbg_max_msg cannot hold a line we want to keep the debug
+	   interface available so that programs will not complain */
+	if (dbg_max_msg < TRTL_DBG_LINE_MAX) {
+		dbg_n_line = 0;
+		return 0;
+	}
+	dbg_n_line = rounddown_pow_of_two(dbg_max_msg / TRTL_DBG_LINE_MAX);
 
-	cpu->cbuf.head = 0;
-	cpu->cbuf.tail = 0;
+	cpu->dbg_rec = devm_kcalloc(&fmc->dev, dbg_n_line,
+				    sizeof(struct trtl_dbg_record), GFP_KERNEL);
+	if (!cpu->dbg_rec)
+		return -ENOMEM;
 
 	return 0;
 }
 
-static int trtl_dbg_close(struct inode *inode, struct file *file)
+static int trtl_dbg_open(struct inode *inode, struct file *file)
 {
-	struct trtl_cpu *cpu = file->private_data;
+	struct trtl_dbg_reader *rd;
+	struct trtl_cpu *cpu = inode->i_private;
 
+	rd = kzalloc(sizeof(struct trtl_dbg_reader), GFP_KERNEL);
+	if (!rd)
+		return -ENOMEM;
+
+	/* Point to the current position in buffer */
+	rd->cpu = cpu;
 	spin_lock(&cpu->lock);
-	kfree(cpu->cbuf.buf);
-	cpu->cbuf.buf = NULL;
+	rd->seq = cpu->dbg_seq;
 	spin_unlock(&cpu->lock);
 
+	file->private_data = rd;
+
+	return 0;
+}
+
+static int trtl_dbg_close(struct inode *inode, struct file *file)
+{
+	kfree(file->private_data);
+
 	return 0;
 }
 
+/**
+ * It returns a single debug line for each read. When the user buffer is
+ * too small the line is truncated. When the reader is too slow, the lines
+ * overwritten in the buffer are skipped. When there are no lines, it
+ * sleeps until a new one arrives, or it returns -EAGAIN with O_NONBLOCK
+ */
 static ssize_t trtl_dbg_read(struct file *f, char __user *buf,
 			     size_t count, loff_t *offp)
 {
-	struct trtl_cpu *cpu = f->private_data;
-	size_t lcount;
-	int i;
+	struct trtl_dbg_reader *rd = f->private_data;
+	struct trtl_cpu *cpu = rd->cpu;
+	struct trtl_dbg_record *rec;
+	char lbuf[TRTL_DBG_LINE_MAX + 32];
+	size_t lcount = 0;
+	int err;
 
-	spin_lock(&cpu->lock);
+	/* Without a buffer there will never be lines */
+	if (!cpu->dbg_rec)
+		return 0;
 
-	/* Check if there are char to send */
-	lcount = CIRC_CNT(cpu->cbuf.head, cpu->cbuf.tail, dbg_max_msg);
-	if (!lcount) {
+	spin_lock(&cpu->lock);
+	while (rd->seq == cpu->dbg_seq) {
 		spin_unlock(&cpu->lock);
-		return 0;
+		if (f->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		err = wait_event_interruptible(cpu->dbg_wq,
+					rd->seq != READ_ONCE(cpu->dbg_seq));
+		if (err)
+			return err;
+		spin_lock(&cpu->lock);
 	}
 
-	/* Copy to user the minumum number of char */
-	lcount = min(lcount, count);
-	for (i = 0; i < lcount; i++) {
-		if (cpu->cbuf.buf[cpu->cbuf.tail + i] == '\0') {
-			i++; /* We want to include the terminator */
-			break;
-		}
-	}
+	if (cpu->dbg_seq - rd->seq > dbg_n_line)
+		rd->seq = cpu->dbg_seq - dbg_n_line;
 
-	lcount = i;
-	if (copy_to_user(buf, cpu->cbuf.buf + cpu->cbuf.tail, lcount)) {
-		spin_unlock(&cpu->lock);
-		return -EFAULT;
-	}
+	rec = &cpu->dbg_rec[rd->seq & (dbg_n_line - 1)];
+	if (dbg_timestamp)
+		lcount = snprintf(lbuf, sizeof(lbuf), "[%5lu.%06lu] ",
+				  (unsigned long)rec->ts.tv_sec,
+				  rec->ts.tv_nsec / NSEC_PER_USEC);
+	memcpy(lbuf + lcount, rec->line, rec->len);
+	lcount += rec->len;
 
-	/* Consume char from the tail */
-	cpu->cbuf.tail = (cpu->cbuf.tail + lcount) & (dbg_max_msg - 1);
+	/* Consume the line */
+	rd->seq++;
 	spin_unlock(&cpu->lock);
 
+	lcount = min(lcount, count);
+	if (copy_to_user(buf, lbuf, lcount))
+		return -EFAULT;
+
 	return lcount;
 }
 
 static unsigned int trtl_dbg_poll(struct file *f, struct poll_table_struct *w)
 {
-	struct trtl_cpu *cpu = f->private_data;
+	struct trtl_dbg_reader *rd = f->private_data;
+	struct trtl_cpu *cpu = rd->cpu;
 
-	dev_dbg(&cpu->dev, "%s  head=%d, tail=%d\n", __func__,
-		cpu->cbuf.head, cpu->cbuf.tail);
-	if (CIRC_CNT(cpu->cbuf.head, cpu->cbuf.tail, dbg_max_msg))
+	poll_wait(f, &cpu->dbg_wq, w);
+
+	dev_dbg(&cpu->dev, "%s  seq=%lu, reader=%lu\n", __func__,
+		cpu->dbg_seq, rd->seq);
+	if (rd->seq != cpu->dbg_seq)
 		return POLLIN | POLLRDNORM;
 	return 0;
 }
@@ -114,46 +174,105 @@ const struct file_operations trtl_cpu_dbg_fops = {
 	.poll = trtl_dbg_poll,
 };
 
-irqreturn_t trtl_irq_handler_debug(int irq_core_base, void *arg)
+
+/**
+ * It stores the line under assembly in the circular buffer and it wakes
+ * up the readers. When the buffer is full, the oldest line is overwritten
+ */
+static void trtl_dbg_line_commit(struct trtl_cpu *cpu)
 {
-	struct fmc_device *fmc = arg;
-	struct trtl_dev *trtl = fmc_get_drvdata(fmc);
-	struct circ_buf *cb;
+	struct trtl_dbg_record *cur = &cpu->dbg_cur;
+
+	if (!cpu->dbg_rec) {
+		cur->len = 0;
+		return;
+	}
+
+	spin_lock(&cpu->lock);
+	memcpy(&cpu->dbg_rec[cpu->dbg_seq & (dbg_n_line - 1)], cur,
+	       offsetof(struct trtl_dbg_record, line) + cur->len);
+	cpu->dbg_seq++;
+	spin_unlock(&cpu->lock);
+	cur->len = 0;
+
+	wake_up_interruptible(&cpu->dbg_wq);
+}
+
+/**
+ * It reads at most dbg_max_batch characters from the debug channel of
+ * a CPU and it assembles them in lines
+ * @return 1 if there are still characters to read, 0 otherwise
+ */
+static int trtl_dbg_drain(struct trtl_cpu *cpu)
+{
+	struct trtl_dev *trtl = to_trtl_dev(cpu->dev.parent);
+	struct fmc_device *fmc = to_fmc_dev(trtl);
+	struct trtl_dbg_record *cur = &cpu->dbg_cur;
 	uint32_t status;
+	int n = 0;
 	char c;
-	int i;
 
-	status = fmc_readl(fmc, trtl->base_csr + WRN_CPU_CSR_REG_DBG_POLL);
-do_irq:
-	i = -1;
-	while (status && ++i < trtl->n_cpu) {
-		if (!(status & 0x1)) {
-			status >>= 1;
-			continue;
+	/* Select the CPU to use; the loaders select CPUs too */
+	mutex_lock(&trtl->core_sel_mtx);
+	fmc_writel(fmc, cpu->index, trtl->base_csr + WRN_CPU_CSR_REG_CORE_SEL);
+	do {
+		c = fmc_readl(fmc, trtl->base_csr + WRN_CPU_CSR_REG_DBG_MSG);
+		if (!cur->len) {
+			getnstimeofday(&cur->ts);
+			cur->cpu = cpu->index;
 		}
+		cur->line[cur->len++] = c;
 
-		/* Select the CPU to use */
-		spin_lock(&trtl->cpu[i].lock);
-		fmc_writel(fmc, i, trtl->base_csr + WRN_CPU_CSR_REG_CORE_SEL);
-		c = fmc_readl(fmc,
-				trtl->base_csr + WRN_CPU_CSR_REG_DBG_MSG);
-		cb = &trtl->cpu[i].cbuf;
-		if (cb->buf) {
-			/* We cans store the char */
-			pr_debug("%s:%d %d=%c\n", __func__, __LINE__, i, c);
-			cb->buf[cb->head] = c;
-			cb->head = (cb->head + 1) & (dbg_max_msg - 1);
-			if (cb->head == cb->tail) {
-				cb->tail = (cb->tail + 1) & (dbg_max_msg - 1);
-			}
-		}
-		spin_unlock(&trtl->cpu[i].lock);
-	}
+		/* Split lines too long to fit a record */
+		if (c != '\0' && cur->len == TRTL_DBG_LINE_MAX - 1)
+			cur->line[cur->len++] = '\0';
+		if (cur->line[cur->len - 1] == '\0')
+			trtl_dbg_line_commit(cpu);
+
+		status = fmc_readl(fmc,
+				   trtl->base_csr + WRN_CPU_CSR_REG_DBG_POLL);
+	} while ((status & (1 << cpu->index)) && ++n < dbg_max_batch);
+	mutex_unlock(&trtl->core_sel_mtx);
+
+	return !!(status & (1 << cpu->index));
+}
+
+/**
+ * It drains the debug channels of all the CPUs. Each pass reads a
+ * bounded number of characters per CPU; when there is more to read the
+ * work is re-queued, otherwise the debug interrupts are enabled again
+ */
+void trtl_dbg_work(struct work_struct *work)
+{
+	struct trtl_dev *trtl = container_of(work, struct trtl_dev, dbg_work);
+	struct fmc_device *fmc = to_fmc_dev(trtl);
+	uint32_t status;
+	int i, pending = 0;
 
 	status = fmc_readl(fmc, trtl->base_csr + WRN_CPU_CSR_REG_DBG_POLL);
-	if (status)
-		goto do_irq;
+	for (i = 0; i < trtl->n_cpu; ++i)
+		if (status & (1 << i))
+			pending |= trtl_dbg_drain(&trtl->cpu[i]);
+
+	if (pending) {
+		schedule_work(&trtl->dbg_work);
+		return;
+	}
+
+	fmc_writel(fmc, 0xFFFFFFFF, trtl->base_csr + WRN_CPU_CSR_REG_DBG_IMSK);
+}
+
+/**
+ * It masks the debug interrupts and it delegates the channel
+ * draining to trtl_dbg_work()
+ */
+irqreturn_t trtl_irq_handler_debug(int irq_core_base, void *arg)
+{
+	struct fmc_device *fmc = arg;
+	struct trtl_dev *trtl = fmc_get_drvdata(fmc);
 
+	fmc_writel(fmc, 0x0, trtl->base_csr + WRN_CPU_CSR_REG_DBG_IMSK);
+	schedule_work(&trtl->dbg_work);
 	fmc_irq_ack(fmc);
 
 	return IRQ_HANDLED;
@@ -8,14 +8,20 @@
 #define __TRTL_H__
 
 #include <linux/circ_buf.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/time.h>
+#include <linux/mutex.h>
+#include <linux/kdev_t.h>
+#include <linux/mm_types.h>
 #include "hw/mockturtle_queue.h"
 #include "mockturtle.h"
 
-#define TRTL_MAX_CPU_MINORS (TRTL_MAX_CPU * TRTL_MAX_CARRIER)
-#define TRTL_MAX_HMQ_MINORS (TRTL_MAX_HMQ_SLOT * TRTL_MAX_CARRIER)
-#define TRTL_MAX_MINORS (TRTL_MAX_CARRIER + TRTL_MAX_CPU_MINORS + TRTL_MAX_HMQ_MINORS)
+#define TRTL_MAX_MINORS (1 << MINORBITS) /**< minors for devices, CPUs and
+					      slots of all the carriers */
 
 #define TRTL_SMEM_MAX_SIZE 65536
+#define TRTL_SMEM_N_WINDOW 6 /**< direct access plus atomic operations */
 
 #define to_trtl_cpu(_dev) (container_of(_dev, struct trtl_cpu, dev))
 #define to_trtl_dev(_dev) (container_of(_dev, struct trtl_dev, dev))
@@ -109,12 +115,17 @@ struct trtl_hmq {
 
 
 	unsigned int waiting_seq; /**< sequence number to wait */
-	struct trtl_msg sync_answer; /**< synchronous answer message */
+	struct trtl_msg *sync_answer; /**< synchronous answer message,
+				       output slots only */
 
 	unsigned int max_width; /**< maximum words number per single buffer */
 	unsigned int max_depth; /**< maximum buffer queue length (HW) */
 
-	struct mturtle_hmq_buffer buf; /**< Circular buffer */
+	struct mturtle_hmq_buffer buf; /**< Circular buffer, allocated on
+					  first use */
+	struct delayed_work buf_idle; /**< to release an unused buffer */
+	unsigned int buf_ref; /**< open files, the buffer is released
+				 when 0 */
 
 	struct trtl_hmq_stats stats;
 };
@@ -135,6 +146,18 @@ struct trtl_hmq_user {
 };
 
 
+#define TRTL_DBG_LINE_MAX 128 /**< maximum length of a debug line */
+
+/**
+ * It describes a line received from the CPU debug channel
+ */
+struct trtl_dbg_record {
+	struct timespec ts; /**< host time at the first character */
+	unsigned int cpu; /**< CPU index */
+	unsigned int len; /**< line length, terminator included */
+	char line[TRTL_DBG_LINE_MAX]; /**< NUL terminated line */
+};
+
 /**
  * It describes a single instance of a CPU of the WRNC
  */
@@ -143,12 +166,24 @@ struct trtl_cpu {
 
 	struct device dev; /**< device representing a single CPU */
 	struct dentry *dbg_msg; /**< debug messages interface */
-	struct circ_buf cbuf; /**< debug circular buffer */
+	struct trtl_dbg_record *dbg_rec; /**< debug line circular buffer */
+	unsigned long dbg_seq; /**< sequence number of the next debug line */
+	wait_queue_head_t dbg_wq; /**< debug readers waiting for lines */
+	struct trtl_dbg_record dbg_cur; /**< debug line under assembly */
 	struct spinlock lock;
 	struct trtl_hmq *hmq[TRTL_MAX_HMQ_SLOT]; /**< list of HMQ slots used by
 						    this CPU */
+
+	uint32_t fw_hash; /**< CRC32 of the last complete firmware loaded */
+	size_t fw_size; /**< size of the last firmware loaded, 0 when
+			   unknown */
+	uint32_t fw_app_id; /**< application ID at firmware load time */
+	unsigned int fw_intact; /**< the CPU did not run since the last
+				   firmware load */
 };
 
+struct trtl_sampler;
+
 /**
  * It describes the generic instance of a WRNC
  */
@@ -157,12 +192,12 @@ struct trtl_dev {
 	struct device dev;
 
 	unsigned int n_cpu; /**< number of CPU in the FPGA bitstream */
-	struct trtl_cpu cpu[TRTL_MAX_CPU]; /**< CPU instances */
+	struct trtl_cpu *cpu; /**< CPU instances */
 
 	unsigned int n_hmq_in; /**< number of input slots in the HMQ */
 	unsigned int n_hmq_out; /**< number of output slots in the HMQ */
-	struct trtl_hmq hmq_in[MAX_MQUEUE_SLOTS]; /**< HMQ input instances */
-	struct trtl_hmq hmq_out[MAX_MQUEUE_SLOTS]; /**< HMQ output instances */
+	struct trtl_hmq *hmq_in; /**< HMQ input instances */
+	struct trtl_hmq *hmq_out; /**< HMQ output instances */
 	uint32_t base_core; /**< base address of the WRNC component */
 	uint32_t base_csr; /**< base address of the Shared Control Register */
 	uint32_t base_hmq; /**< base address of the HMQ */
@@ -171,27 +206,41 @@ struct trtl_dev {
 	uint32_t base_smem; /**< base address of the Shared Memory */
 	uint32_t irq_mask; /**< IRQ mask in use */
 
+	struct mutex core_sel_mtx; /**< to protect the CPU selection and the
+				      accesses that depend on it */
 	enum trtl_smem_modifier mod; /**< smem operation modifier */
+	struct trtl_sampler *sampler; /**< running shared memory sampler */
+	struct mutex sampler_mtx; /**< to protect the sampler */
 
 	struct dentry *dbg_dir; /**< root debug directory */
+	struct work_struct dbg_work; /**< debug channel drain */
 
 	uint32_t message_sequence; /**< message sequence number */
 };
 
 /* Global data */
-extern struct device *minors[TRTL_MAX_MINORS];
+extern struct device *trtl_minor_dev(unsigned int minor);
 /* CPU data */
 extern const struct file_operations trtl_cpu_dbg_fops;
 extern const struct file_operations trtl_cpu_fops;
 extern const struct attribute_group *trtl_cpu_groups[];
 extern void trtl_cpu_enable_set(struct trtl_dev *trtl, uint8_t mask);
 extern void trtl_cpu_reset_set(struct trtl_dev *trtl, uint8_t mask);
-extern int dbg_max_msg;
+extern void trtl_cpu_fw_taint(struct trtl_dev *trtl, uint32_t mask);
+extern long trtl_cpu_gang_load(struct trtl_dev *trtl, void __user *uarg);
+extern unsigned int dbg_n_line;
 extern irqreturn_t trtl_irq_handler_debug(int irq_core_base, void *arg);
+extern void trtl_dbg_work(struct work_struct *work);
+extern int trtl_dbg_init(struct trtl_cpu *cpu);
 /* HMQ */
 extern int hmq_default_buf_size;
 extern int hmq_shared;
 extern const struct attribute_group *trtl_hmq_groups[];
 extern const struct file_operations trtl_hmq_fops;
 extern irqreturn_t trtl_irq_handler(int irq_core_base, void *arg);
+extern void trtl_hmq_buf_idle_work(struct work_struct *work);
+/* Sampler */
+extern long trtl_sampler_start(struct trtl_dev *trtl, void __user *uarg);
+extern long trtl_sampler_stop(struct trtl_dev *trtl);
+extern int trtl_sampler_mmap(struct trtl_dev *trtl, struct vm_area_struct *vma);
 #endif
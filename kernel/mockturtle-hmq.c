@@ -17,6 +17,9 @@
 #include <linux/sched.h>
 #include <linux/delay.h>
 #include <linux/circ_buf.h>
+#include <linux/workqueue.h>
+#include <linux/numa.h>
+#include <linux/uio.h>
 
 #include <linux/fmc.h>
 
@@ -49,6 +52,10 @@ static int hmq_in_no_irq_wait = 10;
 module_param_named(hmq_in_no_irq_wait_us, hmq_in_no_irq_wait, int, 0444);
 MODULE_PARM_DESC(hmq_in_no_irq_wait, "Time (us) to wait after sending a message from the host to the core in a no-interrupt context. Default 10us");
 
+static int hmq_buf_idle_ms = 0;
+module_param_named(slot_buffer_idle_ms, hmq_buf_idle_ms, int, 0644);
+MODULE_PARM_DESC(slot_buffer_idle_ms, "Milli-seconds after the last close before releasing a slot buffer. 0 never release it. Default 0");
+
 static int hmq_max_irq_loop = 5;
 module_param_named(max_irq_loop, hmq_max_irq_loop, int, 0644);
 MODULE_PARM_DESC(max_irq_loop, "Maximum number of messages to read per interrupt per hmq");
@@ -150,6 +157,17 @@ static ssize_t trtl_show_count(struct device *dev,
 }
 
 
+/**
+ * It returns the NUMA node of the carrier
+ */
+static int trtl_hmq_node(struct trtl_hmq *hmq)
+{
+	struct fmc_device *fmc = to_fmc_dev(to_trtl_dev(hmq->dev.parent));
+
+	return fmc->hwdev ? dev_to_node(fmc->hwdev) : NUMA_NO_NODE;
+}
+
+
 /**
  * It returns the maximum buffer size
  */
@@ -168,6 +186,7 @@ static ssize_t trtl_store_buffer_size(struct device *dev,
 {
 	struct trtl_hmq *hmq = to_trtl_hmq(dev);
 	struct trtl_hmq_user *usr, *tmp;
+	unsigned long flags;
 	void *newbuf;
 	long val;
 
@@ -189,16 +208,26 @@ static ssize_t trtl_store_buffer_size(struct device *dev,
 		return -EINVAL;
 	}
 
-	newbuf = kzalloc(val, GFP_KERNEL);
+	spin_lock_irqsave(&hmq->lock, flags);
+	if (!hmq->buf.mem) {
+		/* Not in use, it will be allocated with the new size */
+		hmq->buf.size = val;
+		spin_unlock_irqrestore(&hmq->lock, flags);
+		return count;
+	}
+	spin_unlock_irqrestore(&hmq->lock, flags);
+
+	newbuf = kzalloc_node(val, GFP_KERNEL, trtl_hmq_node(hmq));
 	if (!newbuf) {
 		dev_err(dev, "Cannot allocate new buffer (%ld)\n", val);
 		return -ENOMEM;
 	}
 
-	spin_lock(&hmq->lock);
-	kfree(hmq->buf.mem);
-	hmq->buf.mem = newbuf;
+	spin_lock_irqsave(&hmq->lock, flags);
 	hmq->buf.size = val;
+	if (!hmq->buf.mem)
+		goto out; /* released meanwhile */
+	swap(hmq->buf.mem, newbuf);
 	hmq->buf.ptr_w = 0;
 	hmq->buf.ptr_r = 0;
 
@@ -207,7 +236,9 @@ static ssize_t trtl_store_buffer_size(struct device *dev,
 		usr->ptr_r = 0;
 		spin_unlock(&usr->lock);
 	}
-	spin_unlock(&hmq->lock);
+out:
+	spin_unlock_irqrestore(&hmq->lock, flags);
+	kfree(newbuf);
 
 	return count;
 }
@@ -334,6 +365,100 @@ const struct attribute_group *trtl_hmq_groups[] = {
 
 
 
+/**
+ * It takes a reference to the HMQ buffer and, when asked, it allocates it
+ * if it does not exist yet. The buffer is placed on the NUMA node of the
+ * carrier, which is where the IRQ handler fills it
+ */
+static int trtl_hmq_buf_get(struct trtl_hmq *hmq, int alloc)
+{
+	unsigned long flags;
+	unsigned int size;
+	void *mem;
+	int done;
+
+	/* The reference keeps a closing user from re-arming the release */
+	spin_lock_irqsave(&hmq->lock, flags);
+	hmq->buf_ref++;
+	spin_unlock_irqrestore(&hmq->lock, flags);
+	cancel_delayed_work_sync(&hmq->buf_idle);
+	if (!alloc)
+		return 0;
+
+	do {
+		spin_lock_irqsave(&hmq->lock, flags);
+		size = hmq->buf.size;
+		done = !!hmq->buf.mem;
+		spin_unlock_irqrestore(&hmq->lock, flags);
+		if (done)
+			break;
+
+		mem = kzalloc_node(size, GFP_KERNEL, trtl_hmq_node(hmq));
+		if (!mem)
+			return -ENOMEM;
+
+		/* The size may have changed meanwhile: allocate again */
+		spin_lock_irqsave(&hmq->lock, flags);
+		done = hmq->buf.mem || hmq->buf.size == size;
+		if (!hmq->buf.mem && hmq->buf.size == size) {
+			hmq->buf.mem = mem;
+			hmq->buf.ptr_w = 0;
+			hmq->buf.ptr_r = 0;
+			mem = NULL;
+		}
+		spin_unlock_irqrestore(&hmq->lock, flags);
+		kfree(mem);
+	} while (!done);
+
+	return 0;
+}
+
+
+/**
+ * It drops a reference to the HMQ buffer and it schedules its release
+ * when nobody uses it
+ */
+static void trtl_hmq_buf_put(struct trtl_hmq *hmq)
+{
+	unsigned long flags;
+	unsigned int ref;
+
+	spin_lock_irqsave(&hmq->lock, flags);
+	ref = --hmq->buf_ref;
+	spin_unlock_irqrestore(&hmq->lock, flags);
+
+	if (hmq_buf_idle_ms > 0 && !ref)
+		mod_delayed_work(system_wq, &hmq->buf_idle,
+				 msecs_to_jiffies(hmq_buf_idle_ms));
+}
+
+
+/**
+ * It releases the HMQ buffer if it is still unused
+ */
+void trtl_hmq_buf_idle_work(struct work_struct *work)
+{
+	struct trtl_hmq *hmq = container_of(to_delayed_work(work),
+					    struct trtl_hmq, buf_idle);
+	unsigned long flags;
+	void *mem = NULL;
+
+	/* Synchronous messages use the output buffer without opening it */
+	mutex_lock(&hmq->mtx_sync);
+	spin_lock_irqsave(&hmq->lock, flags);
+	if (!hmq->buf_ref) {
+		mem = hmq->buf.mem;
+		hmq->buf.mem = NULL;
+		hmq->buf.ptr_w = 0;
+		hmq->buf.ptr_r = 0;
+	}
+	spin_unlock_irqrestore(&hmq->lock, flags);
+	mutex_unlock(&hmq->mtx_sync);
+
+	kfree(mem);
+}
+
+
 /**
  * It simply opens a HMQ device
  */
@@ -342,14 +467,24 @@ static int trtl_hmq_open(struct inode *inode, struct file *file)
 	struct trtl_hmq_user *user;
 	struct trtl_hmq *hmq;
 	unsigned long flags;
-	int m = iminor(inode);
+	int m = iminor(inode), err;
 
-	hmq = to_trtl_hmq(minors[m]);
+	hmq = to_trtl_hmq(trtl_minor_dev(m));
+
+	/* Input buffers are used only to send messages on interrupt */
+	err = trtl_hmq_buf_get(hmq, !(hmq->flags & TRTL_FLAG_HMQ_DIR) ||
+			       hmq_in_irq);
+	if (err) {
+		trtl_hmq_buf_put(hmq);
+		return err;
+	}
 
 	if (list_empty(&hmq->list_usr) || (hmq->flags & TRTL_FLAG_HMQ_SHR_USR)) {
 		user = kzalloc(sizeof(struct trtl_hmq_user), GFP_KERNEL);
-		if (!user)
+		if (!user) {
+			trtl_hmq_buf_put(hmq);
 			return -ENOMEM;
+		}
 
 		user->hmq = hmq;
 		spin_lock_init(&user->lock);
@@ -409,25 +544,26 @@ static int trtl_hmq_release(struct inode *inode, struct file *f)
 	}
 	spin_unlock_irqrestore(&hmq->lock, flags);
 
+	trtl_hmq_buf_put(hmq);
+
 	return 0;
 }
 
 /**
  * It writes message in the drive message queue. The messages will be sent on
- * IRQ signal
+ * IRQ signal. Vectored writes can gather messages from separate buffers
  * @TODO to be tested! WRTD is using only sync messages
  */
-static ssize_t trtl_hmq_write(struct file *f, const char __user *buf,
-			      size_t count, loff_t *offp)
+static ssize_t trtl_hmq_write_iter(struct kiocb *iocb, struct iov_iter *from)
 {
-	struct trtl_hmq_user *user = f->private_data;
+	struct trtl_hmq_user *user = iocb->ki_filp->private_data;
 	struct trtl_hmq *hmq = user->hmq;
 	struct trtl_dev *trtl = to_trtl_dev(hmq->dev.parent);
 	struct fmc_device *fmc = to_fmc_dev(trtl);
 	struct trtl_msg msg;
 	unsigned long flags;
 	unsigned int i, n;
-	const char __user *curbuf = buf;
+	size_t count = iov_iter_count(from);
 	uint32_t mask, seq;
 	int err = 0;
 
@@ -447,8 +583,9 @@ static ssize_t trtl_hmq_write(struct file *f, const char __user *buf,
 	count = 0;
 	mutex_lock(&hmq->mtx);
 
-	for (i = 0; i < n; i++, curbuf += sizeof(struct trtl_msg)) {
-		if (copy_from_user(&msg, curbuf, sizeof(struct trtl_msg))) {
+	for (i = 0; i < n; i++) {
+		if (copy_from_iter(&msg, sizeof(struct trtl_msg), from) !=
+		    sizeof(struct trtl_msg)) {
 			err = -EFAULT;
 			break;
 		}
@@ -501,7 +638,7 @@ static ssize_t trtl_hmq_write(struct file *f, const char __user *buf,
 
 	/* Update counter */
 	count = i * sizeof(struct trtl_msg);
-	*offp += count;
+	iocb->ki_pos += count;
 
 	/*
 	 * If `count` is not 0, it means that we saved at least one message, even
@@ -602,6 +739,11 @@ static int trtl_ioctl_msg_sync(struct trtl_hmq *hmq, void __user *uarg)
 		return -EINVAL;
 	}
 	hmq_out = &trtl->hmq_out[msg.index_out];
+	err = trtl_hmq_buf_get(hmq_out, 1);
+	if (err) {
+		trtl_hmq_buf_put(hmq_out);
+		return err;
+	}
 
 	/* Use mutex to serialize sync messages. */
 	mutex_lock(&hmq->mtx_sync);
@@ -617,8 +759,15 @@ static int trtl_ioctl_msg_sync(struct trtl_hmq *hmq, void __user *uarg)
 	err = trtl_message_push(hmq, msg_req.data,
 				msg_req.datalen * 4, &hmq_out->waiting_seq);
 	spin_unlock_irqrestore(&hmq->lock, flags);
-	if (err)
+	if (err) {
+		spin_lock_irqsave(&hmq_out->lock, flags);
+		hmq_out->flags &= ~TRTL_FLAG_HMQ_SYNC_WAIT;
+		spin_unlock_irqrestore(&hmq_out->lock, flags);
+		mutex_unlock(&hmq_out->mtx_sync);
+		mutex_unlock(&hmq->mtx_sync);
+		trtl_hmq_buf_put(hmq_out);
 		return err;
+	}
 
 	/*
 	 * Wait our synchronous answer. If after timeout we don't receive
@@ -631,11 +780,12 @@ static int trtl_ioctl_msg_sync(struct trtl_hmq *hmq, void __user *uarg)
 
 	spin_lock_irqsave(&hmq_out->lock, flags);
 	hmq_out->flags &= ~TRTL_FLAG_HMQ_SYNC_READY;
-	msg_ans = hmq_out->sync_answer;
+	msg_ans = *hmq_out->sync_answer;
 	spin_unlock_irqrestore(&hmq_out->lock, flags);
 
 	mutex_unlock(&hmq_out->mtx_sync);
 	mutex_unlock(&hmq->mtx_sync);
+	trtl_hmq_buf_put(hmq_out);
 
 	/* On error, or timeout, clear the message.
 	 * This should not happen, so optimize
@@ -763,15 +913,16 @@ static long trtl_hmq_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 
 
 /**
- * It returns a message to user space messages from an output HMQ
+ * It returns a message to user space messages from an output HMQ.
+ * Vectored reads can scatter messages into separate buffers
  */
-static ssize_t trtl_hmq_read(struct file *f, char __user *buf,
-			     size_t count, loff_t *offp)
+static ssize_t trtl_hmq_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-	struct trtl_hmq_user *user = f->private_data;
+	struct trtl_hmq_user *user = iocb->ki_filp->private_data;
 	struct trtl_hmq *hmq = user->hmq;
 	struct trtl_msg msg;
 	unsigned int i = 0, n;
+	size_t count = iov_iter_count(to);
 	int err = 0;
 
 	if (hmq->flags & TRTL_FLAG_HMQ_DIR) {
@@ -807,15 +958,19 @@ static ssize_t trtl_hmq_read(struct file *f, char __user *buf,
 		   mechanism that I cannot change it now */
 		memcpy(msg.data, hmq->buf.mem + user->ptr_r, hmq->buf.max_msg_size);
 		msg.datalen = hmq->buf.max_msg_size / 4;
-		if (copy_to_user(buf + count, &msg, sizeof(struct trtl_msg))) {
+		spin_unlock(&hmq->lock);
+
+		/* It may fault, so copy without the spinlock */
+		if (copy_to_iter(&msg, sizeof(struct trtl_msg), to) !=
+		    sizeof(struct trtl_msg)) {
 			dev_err(&hmq->dev, "Cannot message transfer to user-space\n");
 			err = -EFAULT;
-			spin_unlock(&hmq->lock);
 			break;
 		}
 
 		count = (++i) * sizeof(struct trtl_msg);
 		/* Point to the next message */
+		spin_lock(&hmq->lock);
 		user->ptr_r += hmq->buf.max_msg_size;
 		if (user->ptr_r >= hmq->buf.size) {
 			user->ptr_r = 0;
@@ -824,7 +979,7 @@ static ssize_t trtl_hmq_read(struct file *f, char __user *buf,
 	}
 	mutex_unlock(&hmq->mtx);
 
-	*offp += count;
+	iocb->ki_pos += count;
 	return count ? count : err;
 }
 
@@ -857,8 +1012,8 @@ const struct file_operations trtl_hmq_fops = {
 	.owner = THIS_MODULE,
 	.open  = trtl_hmq_open,
 	.release = trtl_hmq_release,
-	.write  = trtl_hmq_write,
-	.read = trtl_hmq_read,
+	.write_iter = trtl_hmq_write_iter,
+	.read_iter = trtl_hmq_read_iter,
 	.unlocked_ioctl = trtl_hmq_ioctl,
 	.poll = trtl_hmq_poll,
 };
@@ -926,13 +1081,22 @@ static void trtl_irq_handler_output(struct trtl_hmq *hmq)
 	struct trtl_dev *trtl = to_trtl_dev(hmq->dev.parent);
 	struct fmc_device *fmc = to_fmc_dev(trtl);
 	struct mturtle_hmq_buffer *buf = &hmq->buf;
-	uint32_t status, *buffer = buf->mem + buf->ptr_w;
+	uint32_t status, *buffer;
 	size_t size;
 	int i, left_byte;
 	struct trtl_hmq_user *usr, *tmp;
 	unsigned long flags;
 
 	spin_lock_irqsave(&hmq->lock, flags);
+	/* Nobody uses this slot, drop the message */
+	if (!buf->mem) {
+		fmc_writel(fmc, MQUEUE_CMD_DISCARD,
+			   hmq->base_sr + MQUEUE_SLOT_COMMAND);
+		spin_unlock_irqrestore(&hmq->lock, flags);
+		hmq->stats.count++;
+		return;
+	}
+	buffer = buf->mem + buf->ptr_w;
 	/* Get the message */
 	/* Get information about the incoming slot */
 	status = fmc_readl(fmc, hmq->base_sr + MQUEUE_SLOT_STATUS);
@@ -947,16 +1111,14 @@ static void trtl_irq_handler_output(struct trtl_hmq *hmq)
 	}
 	/* Discard the slot content */
 	fmc_writel(fmc, MQUEUE_CMD_DISCARD, hmq->base_sr + MQUEUE_SLOT_COMMAND);
-	spin_unlock_irqrestore(&hmq->lock, flags);
 
 	hmq->stats.count++;
 
 	/* If we are waiting a synchronous answer on this HMQ check */
 	if ((hmq->flags & TRTL_FLAG_HMQ_SYNC_WAIT) &&
 	    hmq->waiting_seq == buffer[1]) { /* seq number always position 1 */
-		spin_lock_irqsave(&hmq->lock, flags);
-		memcpy(hmq->sync_answer.data, buffer, size * 4);
-		hmq->sync_answer.datalen = size;
+		memcpy(hmq->sync_answer->data, buffer, size * 4);
+		hmq->sync_answer->datalen = size;
 		hmq->flags &= ~TRTL_FLAG_HMQ_SYNC_WAIT;
 		hmq->flags |= TRTL_FLAG_HMQ_SYNC_READY;
 		spin_unlock_irqrestore(&hmq->lock, flags);
@@ -964,6 +1126,7 @@ static void trtl_irq_handler_output(struct trtl_hmq *hmq)
 		/* Do not store synchronous answer */
 		goto out;
 	}
+	spin_unlock_irqrestore(&hmq->lock, flags);
 
 
 	/*
@@ -0,0 +1,307 @@
+/*
+ * Copyright (C) 2016 CERN (www.cern.ch)
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v2
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/kref.h>
+#include <linux/overflow.h>
+#include <linux/uaccess.h>
+
+#include <linux/fmc.h>
+
+#include "mockturtle-drv.h"
+
+#define TRTL_SAMPLER_MIN_PERIOD_US 10
+/*
+ * Words are read in hard interrupt context, each read is a bus access of
+ * about 1us: keep them within a tenth of the period
+ */
+#define TRTL_SAMPLER_US_PER_WORD 10
+
+/**
+ * Sampler ring memory. It is shared with the user space mappings, so it
+ * lives until the last of them goes away
+ */
+struct trtl_sampler_buf {
+	struct kref ref;
+	void *mem; /**< ring header followed by the samples */
+	size_t size; /**< allocated size */
+};
+
+/**
+ * It describes the shared memory sampler of a device. The ring geometry
+ * is kept here: the ring header is mapped in user space and it is only
+ * written by the driver, never trusted
+ */
+struct trtl_sampler {
+	struct trtl_dev *trtl;
+	struct hrtimer timer;
+	ktime_t period;
+	struct trtl_sampler_cfg cfg;
+	struct trtl_sampler_buf *buf;
+	uint32_t *cur; /**< words of the current tick */
+	uint32_t *last; /**< last stored words, for the change-only mode */
+	uint32_t head; /**< number of samples stored since start */
+	uint32_t n_sample; /**< ring size in samples */
+	uint32_t sample_size; /**< size of a sample in byte */
+};
+
+
+static void trtl_sampler_buf_release(struct kref *ref)
+{
+	struct trtl_sampler_buf *buf = container_of(ref,
+						    struct trtl_sampler_buf,
+						    ref);
+
+	vfree(buf->mem);
+	kfree(buf);
+}
+
+static struct trtl_sampler_buf *trtl_sampler_buf_alloc(size_t size)
+{
+	struct trtl_sampler_buf *buf;
+
+	buf = kzalloc(sizeof(struct trtl_sampler_buf), GFP_KERNEL);
+	if (!buf)
+		return NULL;
+
+	buf->size = PAGE_ALIGN(size);
+	buf->mem = vmalloc_user(buf->size);
+	if (!buf->mem) {
+		kfree(buf);
+		return NULL;
+	}
+	kref_init(&buf->ref);
+
+	return buf;
+}
+
+
+/**
+ * It samples all the configured ranges and it stores the sample
+ */
+static enum hrtimer_restart trtl_sampler_fn(struct hrtimer *timer)
+{
+	struct trtl_sampler *smp = container_of(timer, struct trtl_sampler,
+						timer);
+	struct trtl_dev *trtl = smp->trtl;
+	struct fmc_device *fmc = to_fmc_dev(trtl);
+	struct trtl_sampler_ring *ring = smp->buf->mem;
+	struct trtl_sample *sample;
+	struct trtl_smem_range *range;
+	uint32_t head = smp->head;
+	int i, j, n = 0;
+	u64 ts;
+
+	ts = ktime_to_ns(ktime_get_real());
+	for (i = 0; i < smp->cfg.n_range; ++i) {
+		range = &smp->cfg.range[i];
+		for (j = 0; j < range->count; ++j)
+			smp->cur[n++] = fmc_readl(fmc, trtl->base_smem +
+						  range->addr + j * 4);
+	}
+
+	/* Leave the ring untouched when nothing changed */
+	if (smp->cfg.flags & TRTL_SAMPLER_CHANGE_ONLY) {
+		if (head && !memcmp(smp->last, smp->cur, n * 4))
+			goto out;
+		memcpy(smp->last, smp->cur, n * 4);
+	}
+
+	sample = smp->buf->mem + sizeof(struct trtl_sampler_ring) +
+		(size_t)(head & (smp->n_sample - 1)) * smp->sample_size;
+
+	/* Invalidate the slot before overwriting it */
+	sample->seq = ~0;
+	smp_wmb();
+
+	sample->ts = ts;
+	memcpy(sample->word, smp->cur, n * 4);
+	smp_wmb();
+	sample->seq = head;
+	smp_wmb();
+	smp->head = head + 1;
+	ring->head = smp->head;
+
+out:
+	hrtimer_forward_now(timer, smp->period);
+	return HRTIMER_RESTART;
+}
+
+
+/**
+ * It stops the sampler and it releases its resources
+ */
+static void trtl_sampler_free(struct trtl_sampler *smp)
+{
+	hrtimer_cancel(&smp->timer);
+	kref_put(&smp->buf->ref, trtl_sampler_buf_release);
+	kfree(smp->cur);
+	kfree(smp->last);
+	kfree(smp);
+}
+
+
+/**
+ * ioctl command to start the shared memory sampler. A running sampler
+ * is replaced
+ */
+long trtl_sampler_start(struct trtl_dev *trtl, void __user *uarg)
+{
+	struct trtl_sampler *smp;
+	struct trtl_sampler_ring *ring;
+	struct trtl_smem_range *range;
+	unsigned int i, n_word = 0, sample_size;
+	size_t size;
+
+	smp = kzalloc(sizeof(struct trtl_sampler), GFP_KERNEL);
+	if (!smp)
+		return -ENOMEM;
+	if (copy_from_user(&smp->cfg, uarg, sizeof(struct trtl_sampler_cfg))) {
+		kfree(smp);
+		return -EFAULT;
+	}
+
+	if (smp->cfg.period_us < TRTL_SAMPLER_MIN_PERIOD_US ||
+	    !smp->cfg.n_range || smp->cfg.n_range > TRTL_SAMPLER_MAX_RANGE ||
+	    !smp->cfg.n_sample || smp->cfg.n_sample > TRTL_SAMPLER_MAX_SAMPLES ||
+	    smp->cfg.n_sample & (smp->cfg.n_sample - 1))
+		goto err_inval;
+	for (i = 0; i < smp->cfg.n_range; ++i) {
+		range = &smp->cfg.range[i];
+		if (range->addr % 4 || range->addr >= TRTL_SMEM_MAX_SIZE ||
+		    !range->count || range->count > TRTL_SAMPLER_MAX_WORDS ||
+		    range->addr + range->count * 4 > TRTL_SMEM_MAX_SIZE)
+			goto err_inval;
+		n_word += range->count;
+	}
+	if (n_word > TRTL_SAMPLER_MAX_WORDS ||
+	    n_word * TRTL_SAMPLER_US_PER_WORD > smp->cfg.period_us)
+		goto err_inval;
+
+	sample_size = ALIGN(sizeof(struct trtl_sample) + n_word * 4, 8);
+	if (check_mul_overflow((size_t)smp->cfg.n_sample, (size_t)sample_size,
+			       &size) ||
+	    check_add_overflow(size, sizeof(struct trtl_sampler_ring), &size))
+		goto err_inval;
+
+	smp->cur = kcalloc(n_word, sizeof(uint32_t), GFP_KERNEL);
+	smp->last = kcalloc(n_word, sizeof(uint32_t), GFP_KERNEL);
+	smp->buf = trtl_sampler_buf_alloc(size);
+	if (!smp->cur || !smp->last || !smp->buf) {
+		kfree(smp->cur);
+		kfree(smp->last);
+		if (smp->buf)
+			kref_put(&smp->buf->ref, trtl_sampler_buf_release);
+		kfree(smp);
+		return -ENOMEM;
+	}
+
+	smp->n_sample = smp->cfg.n_sample;
+	smp->sample_size = sample_size;
+	ring = smp->buf->mem;
+	ring->n_sample = smp->n_sample;
+	ring->sample_size = smp->sample_size;
+	ring->n_word = n_word;
+
+	smp->trtl = trtl;
+	smp->period = ns_to_ktime((u64)smp->cfg.period_us * NSEC_PER_USEC);
+	hrtimer_init(&smp->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	smp->timer.function = trtl_sampler_fn;
+
+	mutex_lock(&trtl->sampler_mtx);
+	if (trtl->sampler)
+		trtl_sampler_free(trtl->sampler);
+	trtl->sampler = smp;
+	hrtimer_start(&smp->timer, smp->period, HRTIMER_MODE_REL);
+	mutex_unlock(&trtl->sampler_mtx);
+
+	return 0;
+
+err_inval:
+	kfree(smp);
+	return -EINVAL;
+}
+
+
+/**
+ * ioctl command to stop the shared memory sampler. The ring remains
+ * available to the current user space mappings
+ */
+long trtl_sampler_stop(struct trtl_dev *trtl)
+{
+	mutex_lock(&trtl->sampler_mtx);
+	if (trtl->sampler)
+		trtl_sampler_free(trtl->sampler);
+	trtl->sampler = NULL;
+	mutex_unlock(&trtl->sampler_mtx);
+
+	return 0;
+}
+
+
+static void trtl_sampler_vm_open(struct vm_area_struct *vma)
+{
+	struct trtl_sampler_buf *buf = vma->vm_private_data;
+
+	kref_get(&buf->ref);
+}
+
+static void trtl_sampler_vm_close(struct vm_area_struct *vma)
+{
+	struct trtl_sampler_buf *buf = vma->vm_private_data;
+
+	kref_put(&buf->ref, trtl_sampler_buf_release);
+}
+
+static const struct vm_operations_struct trtl_sampler_vm_ops = {
+	.open = trtl_sampler_vm_open,
+	.close = trtl_sampler_vm_close,
+};
+
+
+/**
+ * It maps the ring of the running sampler in user space, read-only
+ */
+int trtl_sampler_mmap(struct trtl_dev *trtl, struct vm_area_struct *vma)
+{
+	struct trtl_sampler_buf *buf;
+	int err;
+
+	if (vma->vm_pgoff != (TRTL_SAMPLER_MMAP_OFFSET >> PAGE_SHIFT))
+		return -EINVAL;
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+	vma->vm_flags &= ~VM_MAYWRITE;
+
+	mutex_lock(&trtl->sampler_mtx);
+	if (!trtl->sampler) {
+		err = -ENODEV;
+		goto out;
+	}
+
+	buf = trtl->sampler->buf;
+	if (vma->vm_end - vma->vm_start > buf->size) {
+		err = -EINVAL;
+		goto out;
+	}
+
+	err = remap_vmalloc_range(vma, buf->mem, 0);
+	if (err)
+		goto out;
+
+	vma->vm_private_data = buf;
+	vma->vm_ops = &trtl_sampler_vm_ops;
+	trtl_sampler_vm_open(vma);
+out:
+	mutex_unlock(&trtl->sampler_mtx);
+	return err;
+}
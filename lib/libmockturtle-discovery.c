@@ -0,0 +1,656 @@
+/*
+ * Copyright (C) 2016 CERN (www.cern.ch)
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ *
+ * Released according to the GNU GPL, version 3
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <glob.h>
+#include <dirent.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+
+#include "libmockturtle-internal.h"
+
+#define TRTL_UEVENT_BUF_LEN 4096
+
+/**
+ * Hotplug subscriber
+ */
+struct trtl_discovery_sub {
+	struct trtl_discovery_sub *next;
+	trtl_discovery_cb_t *cb;
+	void *arg;
+};
+
+static struct trtl_dev_info *trtl_index; /**< known devices */
+static unsigned int trtl_index_n; /**< number of known devices */
+static int trtl_index_valid; /**< the index has been built */
+static struct trtl_discovery_sub *trtl_subs; /**< hotplug subscribers,
+					      used by the dispatching
+					      thread only */
+static int trtl_uevent_fd = -1; /**< kernel uevent socket */
+static pthread_mutex_t trtl_index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+/**
+ * It reads an hexadecimal sysfs attribute of a device
+ */
+static int trtl_discovery_attr(const char *name, const char *attr,
+			       uint32_t *val)
+{
+	char path[TRTL_SYSFS_PATH_LEN];
+	FILE *f;
+	int ret;
+
+	snprintf(path, TRTL_SYSFS_PATH_LEN, "/sys/class/mockturtle/%s/%s",
+		 name, attr);
+	f = fopen(path, "r");
+	if (!f)
+		return -1;
+	ret = fscanf(f, "%x", val);
+	fclose(f);
+	if (ret != 1) {
+		errno = ETRTL_INVAL_PARSE;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * It counts the HMQ slots of a device in a given direction
+ */
+static unsigned int trtl_discovery_slots(const char *name, char dir)
+{
+	char pattern[TRTL_SYSFS_PATH_LEN];
+	unsigned int n = 0;
+	glob_t g;
+
+	snprintf(pattern, TRTL_SYSFS_PATH_LEN,
+		 "/sys/class/mockturtle/%s/%s-hmq-%c-[0-9][0-9]",
+		 name, name, dir);
+	if (!glob(pattern, GLOB_NOSORT, NULL, &g)) {
+		n = g.gl_pathc;
+		globfree(&g);
+	}
+
+	return n;
+}
+
+
+/**
+ * It finds the LUN that points to a device
+ */
+static int trtl_discovery_lun(uint32_t fmc_id)
+{
+	char target[TRTL_SYSFS_PATH_LEN], *base;
+	int i, lun = -1;
+	uint32_t id;
+	ssize_t n;
+	glob_t g;
+
+	if (glob("/dev/trtl.[0-9]*", GLOB_NOSORT, NULL, &g))
+		return -1;
+
+	for (i = 0; i < g.gl_pathc && lun < 0; ++i) {
+		n = readlink(g.gl_pathv[i], target, sizeof(target) - 1);
+		if (n < 0)
+			continue;
+		target[n] = '\0';
+		base = basename(target);
+		if (sscanf(base, "trtl-%4x", &id) != 1 &&
+		    sscanf(base, "%4x", &id) != 1)
+			continue;
+		if (id == fmc_id)
+			sscanf(g.gl_pathv[i], "/dev/trtl.%d", &lun);
+	}
+	globfree(&g);
+
+	return lun;
+}
+
+
+/**
+ * It reads the description of a device from sysfs
+ */
+static int trtl_discovery_probe(uint32_t fmc_id, struct trtl_dev_info *info)
+{
+	memset(info, 0, sizeof(struct trtl_dev_info));
+	snprintf(info->name, TRTL_NAME_LEN, "trtl-%04x", fmc_id);
+	info->fmc_id = fmc_id;
+
+	if (trtl_discovery_attr(info->name, "application_id", &info->app_id))
+		return -1;
+	if (trtl_discovery_attr(info->name, "n_cpu", &info->n_cpu))
+		return -1;
+	info->n_hmq_in = trtl_discovery_slots(info->name, 'i');
+	info->n_hmq_out = trtl_discovery_slots(info->name, 'o');
+	info->lun = trtl_discovery_lun(fmc_id);
+
+	return 0;
+}
+
+
+/**
+ * It returns the index position of a device, -1 if unknown.
+ * The caller must hold the index lock
+ */
+static int trtl_index_find(uint32_t fmc_id)
+{
+	int i;
+
+	for (i = 0; i < trtl_index_n; ++i)
+		if (trtl_index[i].fmc_id == fmc_id)
+			return i;
+	return -1;
+}
+
+
+/**
+ * It stores a device in the index. The caller must hold the index lock
+ * @return 1 when the device is new, 2 when its description changed,
+ *         0 when it is unchanged, -1 on error
+ */
+static int trtl_index_store(struct trtl_dev_info *info)
+{
+	struct trtl_dev_info *tmp;
+	int i;
+
+	i = trtl_index_find(info->fmc_id);
+	if (i >= 0) {
+		if (!memcmp(&trtl_index[i], info, sizeof(*info)))
+			return 0;
+		trtl_index[i] = *info;
+		return 2;
+	}
+
+	tmp = realloc(trtl_index,
+		      sizeof(struct trtl_dev_info) * (trtl_index_n + 1));
+	if (!tmp)
+		return -1;
+	trtl_index = tmp;
+	trtl_index[trtl_index_n++] = *info;
+
+	return 1;
+}
+
+
+/**
+ * It removes a device from the index. The caller must hold the index lock
+ * @return 1 when the device was known, 0 otherwise
+ */
+static int trtl_index_remove(uint32_t fmc_id)
+{
+	int i;
+
+	i = trtl_index_find(fmc_id);
+	if (i < 0)
+		return 0;
+
+	trtl_index[i] = trtl_index[--trtl_index_n];
+
+	return 1;
+}
+
+
+/**
+ * It builds the index of the devices. The caller must hold the index lock
+ */
+static int trtl_index_build(void)
+{
+	struct trtl_dev_info info;
+	struct dirent *d;
+	uint32_t fmc_id;
+	DIR *dir;
+	int n;
+
+	trtl_index_n = 0;
+
+	dir = opendir("/sys/class/mockturtle");
+	if (!dir) {
+		/* No driver, no devices */
+		trtl_index_valid = 1;
+		return 0;
+	}
+
+	while ((d = readdir(dir))) {
+		/* Only the devices, not their CPUs and slots */
+		if (sscanf(d->d_name, "trtl-%4x%n", &fmc_id, &n) != 1 ||
+		    d->d_name[n] != '\0')
+			continue;
+		if (trtl_discovery_probe(fmc_id, &info))
+			continue;
+		if (trtl_index_store(&info) < 0) {
+			closedir(dir);
+			return -1;
+		}
+	}
+	closedir(dir);
+
+	trtl_index_valid = 1;
+
+	return 0;
+}
+
+
+/**
+ * It makes sure that the index is built. The caller must hold the index
+ * lock
+ */
+static int trtl_index_get(void)
+{
+	if (trtl_index_valid)
+		return 0;
+
+	return trtl_index_build();
+}
+
+
+/**
+ * It builds the index of devices and it opens the kernel uevent socket.
+ * Hot-plug notifications are not available when the socket cannot be
+ * opened
+ */
+int trtl_discovery_init(void)
+{
+	struct sockaddr_nl addr;
+	int err;
+
+	pthread_mutex_lock(&trtl_index_lock);
+	err = trtl_index_build();
+	pthread_mutex_unlock(&trtl_index_lock);
+	if (err)
+		return err;
+
+	if (trtl_uevent_fd >= 0)
+		return 0;
+
+	trtl_uevent_fd = socket(AF_NETLINK,
+				SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+				NETLINK_KOBJECT_UEVENT);
+	if (trtl_uevent_fd < 0)
+		return 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1; /* kernel events */
+	if (bind(trtl_uevent_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		close(trtl_uevent_fd);
+		trtl_uevent_fd = -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * It releases the index, the subscribers and the uevent socket
+ */
+void trtl_discovery_exit(void)
+{
+	struct trtl_discovery_sub *sub, *next;
+
+	pthread_mutex_lock(&trtl_index_lock);
+	free(trtl_index);
+	trtl_index = NULL;
+	trtl_index_n = 0;
+	trtl_index_valid = 0;
+	for (sub = trtl_subs; sub; sub = next) {
+		next = sub->next;
+		free(sub);
+	}
+	trtl_subs = NULL;
+	if (trtl_uevent_fd >= 0)
+		close(trtl_uevent_fd);
+	trtl_uevent_fd = -1;
+	pthread_mutex_unlock(&trtl_index_lock);
+}
+
+
+/**
+ * It returns the number of known devices
+ */
+uint32_t trtl_discovery_count(void)
+{
+	uint32_t count = 0;
+
+	pthread_mutex_lock(&trtl_index_lock);
+	if (!trtl_index_get())
+		count = trtl_index_n;
+	pthread_mutex_unlock(&trtl_index_lock);
+
+	return count;
+}
+
+
+/**
+ * It returns a NULL terminated list of the known device names
+ */
+char **trtl_discovery_list(void)
+{
+	char **list = NULL;
+	int i;
+
+	pthread_mutex_lock(&trtl_index_lock);
+	if (trtl_index_get())
+		goto out;
+
+	list = malloc(sizeof(char *) * (trtl_index_n + 1));
+	if (!list)
+		goto out;
+	for (i = 0; i < trtl_index_n; ++i)
+		list[i] = strdup(trtl_index[i].name);
+	list[i] = NULL;
+out:
+	pthread_mutex_unlock(&trtl_index_lock);
+
+	return list;
+}
+
+
+/**
+ * It returns the FMC device id of the device with a given LUN
+ * @return 0 on success, -1 when the LUN is unknown
+ */
+int trtl_discovery_lun_to_fmc(unsigned int lun, uint32_t *fmc_id)
+{
+	int i, ret = -1;
+
+	pthread_mutex_lock(&trtl_index_lock);
+	if (trtl_index_get())
+		goto out;
+	for (i = 0; i < trtl_index_n; ++i) {
+		if (trtl_index[i].lun != lun)
+			continue;
+		*fmc_id = trtl_index[i].fmc_id;
+		ret = 0;
+		break;
+	}
+out:
+	pthread_mutex_unlock(&trtl_index_lock);
+
+	return ret;
+}
+
+
+/**
+ * It returns the description of a device from the index
+ * @param[in] device_id FMC device id of the device
+ * @param[out] info device description
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+int trtl_dev_info_get(uint32_t device_id, struct trtl_dev_info *info)
+{
+	int i, ret = -1;
+
+	pthread_mutex_lock(&trtl_index_lock);
+	if (trtl_index_get())
+		goto out;
+	i = trtl_index_find(device_id);
+	if (i < 0) {
+		errno = ENODEV;
+		goto out;
+	}
+	*info = trtl_index[i];
+	ret = 0;
+out:
+	pthread_mutex_unlock(&trtl_index_lock);
+
+	return ret;
+}
+
+
+/**
+ * It subscribes to the device hot-plug events. Callbacks run from
+ * trtl_discovery_dispatch(), so subscriptions belong to the thread that
+ * dispatches the events. A callback may unsubscribe itself
+ * @param[in] cb callback to run on events
+ * @param[in] arg callback argument
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+int trtl_discovery_subscribe(trtl_discovery_cb_t *cb, void *arg)
+{
+	struct trtl_discovery_sub *sub;
+
+	sub = malloc(sizeof(struct trtl_discovery_sub));
+	if (!sub)
+		return -1;
+	sub->cb = cb;
+	sub->arg = arg;
+
+	sub->next = trtl_subs;
+	trtl_subs = sub;
+
+	return 0;
+}
+
+
+/**
+ * It removes a subscription to the device hot-plug events
+ * @param[in] cb subscribed callback
+ * @param[in] arg subscribed callback argument
+ */
+void trtl_discovery_unsubscribe(trtl_discovery_cb_t *cb, void *arg)
+{
+	struct trtl_discovery_sub **pp, *sub;
+
+	for (pp = &trtl_subs; *pp; pp = &(*pp)->next) {
+		if ((*pp)->cb != cb || (*pp)->arg != arg)
+			continue;
+		sub = *pp;
+		*pp = sub->next;
+		free(sub);
+		break;
+	}
+}
+
+
+/**
+ * It returns the file descriptor to poll (POLLIN) for hot-plug events
+ * @return a file descriptor, -1 when hot-plug events are not available
+ */
+int trtl_discovery_fd(void)
+{
+	return trtl_uevent_fd;
+}
+
+
+/**
+ * It notifies an event to all the subscribers
+ */
+static void trtl_discovery_notify(enum trtl_discovery_event event,
+				  struct trtl_dev_info *info)
+{
+	struct trtl_discovery_sub *sub, *next;
+
+	for (sub = trtl_subs; sub; sub = next) {
+		next = sub->next;
+		sub->cb(event, info, sub->arg);
+	}
+}
+
+
+/**
+ * It handles a single uevent
+ * @return 1 when subscribers have been notified, 0 otherwise
+ */
+static int trtl_discovery_uevent(char *buf, size_t len)
+{
+	char *action = NULL, *devpath = NULL, *subsystem = NULL, *devtype = NULL;
+	struct trtl_dev_info info;
+	uint32_t fmc_id;
+	int is_dev, event = -1;
+	char *p;
+
+	for (p = buf; p < buf + len; p += strlen(p) + 1) {
+		if (!strncmp(p, "ACTION=", 7))
+			action = p + 7;
+		else if (!strncmp(p, "DEVPATH=", 8))
+			devpath = p + 8;
+		else if (!strncmp(p, "SUBSYSTEM=", 10))
+			subsystem = p + 10;
+		else if (!strncmp(p, "DEVTYPE=", 8))
+			devtype = p + 8;
+	}
+	if (!action || !devpath || !subsystem ||
+	    strcmp(subsystem, "mockturtle"))
+		return 0;
+	/* CPUs and slots refer to the device in their name */
+	if (sscanf(basename(devpath), "trtl-%4x", &fmc_id) != 1)
+		return 0;
+	is_dev = devtype && !strcmp(devtype, "trtl-dev");
+
+	pthread_mutex_lock(&trtl_index_lock);
+	if (!strcmp(action, "remove")) {
+		/* CPUs and slots go away before their device */
+		if (is_dev && trtl_index_remove(fmc_id)) {
+			memset(&info, 0, sizeof(info));
+			snprintf(info.name, TRTL_NAME_LEN, "trtl-%04x", fmc_id);
+			info.fmc_id = fmc_id;
+			info.lun = -1;
+			event = TRTL_DISCOVERY_REMOVE;
+		}
+	} else if (!strcmp(action, "add") || !strcmp(action, "change")) {
+		/* Slots appear after their device: refresh on each of them */
+		if (!trtl_discovery_probe(fmc_id, &info)) {
+			switch (trtl_index_store(&info)) {
+			case 1:
+				event = TRTL_DISCOVERY_ADD;
+				break;
+			case 2:
+				event = TRTL_DISCOVERY_CHANGE;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&trtl_index_lock);
+
+	if (event < 0)
+		return 0;
+	trtl_discovery_notify(event, &info);
+
+	return 1;
+}
+
+
+/**
+ * It rebuilds the index of devices after lost uevents and it notifies
+ * the subscribers of the devices that appeared, disappeared or changed
+ * meanwhile
+ * @return the number of notified events, -1 on error
+ */
+static int trtl_discovery_resync(void)
+{
+	struct trtl_dev_info *old, *cur = NULL;
+	unsigned int old_n, cur_n = 0, i, j;
+	int n = 0, err;
+
+	pthread_mutex_lock(&trtl_index_lock);
+	old = trtl_index;
+	old_n = trtl_index_n;
+	trtl_index = NULL;
+	err = trtl_index_build();
+	if (!err && trtl_index_n) {
+		cur = malloc(sizeof(struct trtl_dev_info) * trtl_index_n);
+		if (cur) {
+			memcpy(cur, trtl_index,
+			       sizeof(struct trtl_dev_info) * trtl_index_n);
+			cur_n = trtl_index_n;
+		} else {
+			err = -1;
+		}
+	}
+	if (err) {
+		/* Keep the old index, the next dispatch tries again */
+		free(trtl_index);
+		trtl_index = old;
+		trtl_index_n = old_n;
+		pthread_mutex_unlock(&trtl_index_lock);
+		return -1;
+	}
+	pthread_mutex_unlock(&trtl_index_lock);
+
+	/* Notify without the lock, callbacks may use the index */
+	for (i = 0; i < old_n; ++i) {
+		for (j = 0; j < cur_n; ++j)
+			if (cur[j].fmc_id == old[i].fmc_id)
+				break;
+		if (j < cur_n)
+			continue;
+		old[i].lun = -1;
+		trtl_discovery_notify(TRTL_DISCOVERY_REMOVE, &old[i]);
+		n++;
+	}
+	for (i = 0; i < cur_n; ++i) {
+		for (j = 0; j < old_n; ++j)
+			if (old[j].fmc_id == cur[i].fmc_id)
+				break;
+		if (j < old_n && !memcmp(&old[j], &cur[i], sizeof(cur[i])))
+			continue;
+		trtl_discovery_notify(j < old_n ? TRTL_DISCOVERY_CHANGE :
+				      TRTL_DISCOVERY_ADD, &cur[i]);
+		n++;
+	}
+	free(old);
+	free(cur);
+
+	return n;
+}
+
+
+/**
+ * It reads the pending kernel uevents, it updates the index of devices
+ * and it notifies the subscribers. When the kernel dropped uevents, the
+ * index is rebuilt and the subscribers are notified of the differences.
+ * It does not block
+ * @return the number of notified events, -1 on error and errno is set
+ *         appropriately
+ */
+int trtl_discovery_dispatch(void)
+{
+	char buf[TRTL_UEVENT_BUF_LEN];
+	struct sockaddr_nl addr;
+	socklen_t addr_len;
+	int n = 0, ret;
+	ssize_t len;
+
+	if (trtl_uevent_fd < 0) {
+		errno = ENOTCONN;
+		return -1;
+	}
+
+	for (;;) {
+		addr_len = sizeof(addr);
+		len = recvfrom(trtl_uevent_fd, buf, sizeof(buf) - 1, 0,
+			       (struct sockaddr *)&addr, &addr_len);
+		if (len < 0 && errno == ENOBUFS) {
+			/* The socket overflowed: events are lost */
+			ret = trtl_discovery_resync();
+			if (ret < 0)
+				return -1;
+			n += ret;
+			continue;
+		}
+		if (len < 0)
+			break;
+		/* Only the kernel sends trusted uevents */
+		if (addr_len != sizeof(addr) || addr.nl_pid != 0)
+			continue;
+		buf[len] = '\0';
+		n += trtl_discovery_uevent(buf, len);
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK)
+		return -1;
+
+	return n;
+}
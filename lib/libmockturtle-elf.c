@@ -0,0 +1,359 @@
+/*
+ * Copyright (C) 2016 CERN (www.cern.ch)
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ *
+ * Released according to the GNU GPL, version 3
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <elf.h>
+#include <unistd.h>
+
+#include "libmockturtle-internal.h"
+
+#define TRTL_ELF_MACHINE_LM32 138
+
+
+/**
+ * It returns the ELF program header at the given index
+ */
+static Elf32_Phdr *trtl_elf_phdr(void *code, unsigned int i)
+{
+	Elf32_Ehdr *ehdr = code;
+
+	return code + be32toh(ehdr->e_phoff) + i * be16toh(ehdr->e_phentsize);
+}
+
+
+/**
+ * It returns the ELF section header at the given index
+ */
+static Elf32_Shdr *trtl_elf_shdr(void *code, unsigned int i)
+{
+	Elf32_Ehdr *ehdr = code;
+
+	return code + be32toh(ehdr->e_shoff) + i * be16toh(ehdr->e_shentsize);
+}
+
+
+/**
+ * It checks that all the section headers are within the image
+ */
+static int trtl_elf_shdr_valid(void *code, size_t length)
+{
+	Elf32_Ehdr *ehdr = code;
+	Elf32_Shdr *shdr;
+	unsigned int i;
+
+	if (be16toh(ehdr->e_shentsize) != sizeof(Elf32_Shdr) ||
+	    (uint64_t)be32toh(ehdr->e_shoff) +
+	    be16toh(ehdr->e_shnum) * sizeof(Elf32_Shdr) > length ||
+	    be16toh(ehdr->e_shstrndx) >= be16toh(ehdr->e_shnum))
+		return 0;
+
+	for (i = 0; i < be16toh(ehdr->e_shnum); ++i) {
+		shdr = trtl_elf_shdr(code, i);
+		if (be32toh(shdr->sh_type) == SHT_NOBITS)
+			continue;
+		if ((uint64_t)be32toh(shdr->sh_offset) +
+		    be32toh(shdr->sh_size) > length)
+			return 0;
+	}
+
+	return 1;
+}
+
+
+/**
+ * It looks for a section in an ELF image
+ * @param[in] code buffer containing a valid ELF image
+ * @param[in] length buffer length
+ * @param[in] name section name
+ * @param[out] offset section offset within the image
+ * @param[out] size section size
+ * @return 0 on success, on error -1 and errno is set appropriately
+ */
+int trtl_elf_section_get(void *code, size_t length, const char *name,
+			 uint32_t *offset, uint32_t *size)
+{
+	Elf32_Ehdr *ehdr = code;
+	Elf32_Shdr *shdr, *shstr;
+	char *strtab;
+	uint32_t n;
+	unsigned int i;
+
+	if (!trtl_elf_shdr_valid(code, length)) {
+		errno = ETRTL_INVALID_ELF;
+		return -1;
+	}
+
+	shstr = trtl_elf_shdr(code, be16toh(ehdr->e_shstrndx));
+	strtab = code + be32toh(shstr->sh_offset);
+	for (i = 0; i < be16toh(ehdr->e_shnum); ++i) {
+		shdr = trtl_elf_shdr(code, i);
+		n = be32toh(shdr->sh_name);
+		if (n >= be32toh(shstr->sh_size) ||
+		    strncmp(strtab + n, name, be32toh(shstr->sh_size) - n))
+			continue;
+		*offset = be32toh(shdr->sh_offset);
+		*size = be32toh(shdr->sh_size);
+		return 0;
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+
+/**
+ * It looks for a symbol in an ELF image
+ * @param[in] code buffer containing a valid ELF image
+ * @param[in] length buffer length
+ * @param[in] name symbol name
+ * @param[out] value symbol value (address)
+ * @param[out] size symbol size in byte, it can be NULL
+ * @return 0 on success, on error -1 and errno is set appropriately
+ */
+int trtl_elf_symbol_get(void *code, size_t length, const char *name,
+			uint32_t *value, uint32_t *size)
+{
+	Elf32_Ehdr *ehdr = code;
+	Elf32_Shdr *shdr, *strsh;
+	Elf32_Sym *sym;
+	char *strtab;
+	unsigned int i, j, n;
+
+	if (!trtl_elf_shdr_valid(code, length)) {
+		errno = ETRTL_INVALID_ELF;
+		return -1;
+	}
+
+	for (i = 0; i < be16toh(ehdr->e_shnum); ++i) {
+		shdr = trtl_elf_shdr(code, i);
+		if (be32toh(shdr->sh_type) != SHT_SYMTAB ||
+		    be32toh(shdr->sh_link) >= be16toh(ehdr->e_shnum))
+			continue;
+
+		strsh = trtl_elf_shdr(code, be32toh(shdr->sh_link));
+		strtab = code + be32toh(strsh->sh_offset);
+		sym = code + be32toh(shdr->sh_offset);
+		for (j = 0; j < be32toh(shdr->sh_size) / sizeof(Elf32_Sym); ++j) {
+			n = be32toh(sym[j].st_name);
+			if (n >= be32toh(strsh->sh_size) ||
+			    strncmp(strtab + n, name,
+				    be32toh(strsh->sh_size) - n))
+				continue;
+			*value = be32toh(sym[j].st_value);
+			if (size)
+				*size = be32toh(sym[j].st_size);
+			return 0;
+		}
+	}
+
+	errno = ENOENT;
+	return -1;
+}
+
+
+/**
+ * It checks if the given buffer contains an ELF image that can run
+ * on a Mock Turtle CPU
+ * @param[in] code buffer containing the image
+ * @param[in] length buffer length
+ * @return 1 if it is a valid ELF, 0 otherwise
+ */
+int trtl_elf_is_valid(void *code, size_t length)
+{
+	Elf32_Ehdr *ehdr = code;
+	Elf32_Phdr *phdr;
+	unsigned int i;
+
+	if (length < sizeof(Elf32_Ehdr))
+		return 0;
+	if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) ||
+	    ehdr->e_ident[EI_CLASS] != ELFCLASS32 ||
+	    ehdr->e_ident[EI_DATA] != ELFDATA2MSB)
+		return 0;
+	if (be16toh(ehdr->e_type) != ET_EXEC ||
+	    be16toh(ehdr->e_machine) != TRTL_ELF_MACHINE_LM32)
+		return 0;
+	if (be16toh(ehdr->e_phentsize) != sizeof(Elf32_Phdr) ||
+	    (uint64_t)be32toh(ehdr->e_phoff) +
+	    be16toh(ehdr->e_phnum) * sizeof(Elf32_Phdr) > length)
+		return 0;
+
+	for (i = 0; i < be16toh(ehdr->e_phnum); ++i) {
+		phdr = trtl_elf_phdr(code, i);
+		if (be32toh(phdr->p_type) != PT_LOAD)
+			continue;
+		/* Segments must fit in the image and in the address space */
+		if ((uint64_t)be32toh(phdr->p_offset) +
+		    be32toh(phdr->p_filesz) > length ||
+		    (uint64_t)be32toh(phdr->p_paddr) +
+		    be32toh(phdr->p_filesz) > UINT32_MAX ||
+		    (uint64_t)be32toh(phdr->p_paddr) +
+		    be32toh(phdr->p_memsz) > UINT32_MAX)
+			return 0;
+	}
+
+	return 1;
+}
+
+
+/**
+ * It writes an ELF segment into the shared memory
+ */
+static int trtl_elf_smem_load(struct trtl_dev *trtl, uint32_t addr,
+			      void *data, size_t length)
+{
+	uint32_t *buf;
+	int i, n, err;
+
+	if (addr & 0x3 || addr < TRTL_ELF_SMEM_ORIGIN ||
+	    addr - TRTL_ELF_SMEM_ORIGIN > TRTL_ELF_SMEM_LENGTH ||
+	    length > TRTL_ELF_SMEM_LENGTH - (addr - TRTL_ELF_SMEM_ORIGIN)) {
+		errno = ETRTL_INVALID_ELF;
+		return -1;
+	}
+
+	n = (length + 3) / 4;
+	buf = calloc(n, sizeof(uint32_t));
+	if (!buf)
+		return -1;
+	memcpy(buf, data, length);
+	/* The image has the RT (big endian) byte order */
+	for (i = 0; i < n; ++i)
+		buf[i] = be32toh(buf[i]);
+
+	err = trtl_smem_write(trtl, addr - TRTL_ELF_SMEM_ORIGIN, buf, n,
+			      TRTL_SMEM_DIRECT);
+	free(buf);
+
+	return err;
+}
+
+
+/**
+ * It writes all the ELF segments that belong to the shared memory
+ * @param[in] trtl device token
+ * @param[in] code buffer containing a valid ELF image
+ * @return 0 on success, on error -1 and errno is set appropriately
+ */
+int trtl_elf_smem_load_all(struct trtl_dev *trtl, void *code)
+{
+	Elf32_Ehdr *ehdr = code;
+	Elf32_Phdr *phdr;
+	uint32_t addr, size;
+	unsigned int i;
+
+	for (i = 0; i < be16toh(ehdr->e_phnum); ++i) {
+		phdr = trtl_elf_phdr(code, i);
+		addr = be32toh(phdr->p_paddr);
+		size = be32toh(phdr->p_filesz);
+		if (be32toh(phdr->p_type) != PT_LOAD || !size ||
+		    addr < TRTL_ELF_SMEM_ORIGIN)
+			continue;
+
+		if (trtl_elf_smem_load(trtl, addr,
+				       code + be32toh(phdr->p_offset), size))
+			return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * It checks that the ELF segments outside the shared memory fit in the
+ * CPU memory
+ * @param[in] code buffer containing a valid ELF image
+ * @return 0 on success, on error -1 and errno is set appropriately
+ */
+int trtl_elf_cpu_check(void *code)
+{
+	Elf32_Ehdr *ehdr = code;
+	Elf32_Phdr *phdr;
+	uint32_t addr;
+	unsigned int i;
+
+	for (i = 0; i < be16toh(ehdr->e_phnum); ++i) {
+		phdr = trtl_elf_phdr(code, i);
+		addr = be32toh(phdr->p_paddr);
+		if (be32toh(phdr->p_type) != PT_LOAD ||
+		    addr >= TRTL_ELF_SMEM_ORIGIN)
+			continue;
+		if (addr & 0x3 || addr > TRTL_ELF_CPU_LENGTH ||
+		    be32toh(phdr->p_memsz) > TRTL_ELF_CPU_LENGTH - addr) {
+			errno = ETRTL_INVALID_ELF;
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+
+/**
+ * It writes the ELF segments that belong to the CPU memory, one by one.
+ * The memory in between is not touched: the RT start-up code clears
+ * the .bss
+ * @param[in] wdesc device descriptor
+ * @param[in] index CPU index
+ * @param[in] code buffer containing a valid ELF image
+ * @return 0 on success, on error -1 and errno is set appropriately
+ */
+int trtl_elf_cpu_load(struct trtl_desc *wdesc, unsigned int index, void *code)
+{
+	Elf32_Ehdr *ehdr = code;
+	Elf32_Phdr *phdr;
+	uint32_t addr, size;
+	unsigned int i;
+	int fd, ret = 0;
+
+	if (trtl_elf_cpu_check(code))
+		return -1;
+
+	fd = trtl_cpu_mem_open(wdesc, index, 0);
+	if (fd < 0)
+		return -1;
+	for (i = 0; i < be16toh(ehdr->e_phnum) && ret >= 0; ++i) {
+		phdr = trtl_elf_phdr(code, i);
+		addr = be32toh(phdr->p_paddr);
+		size = be32toh(phdr->p_filesz);
+		if (be32toh(phdr->p_type) != PT_LOAD || !size ||
+		    addr >= TRTL_ELF_SMEM_ORIGIN)
+			continue;
+		ret = trtl_cpu_mem_write_fd(fd, code + be32toh(phdr->p_offset),
+					    size, addr);
+	}
+	close(fd);
+
+	return ret < 0 ? -1 : 0;
+}
+
+
+/**
+ * It loads an ELF image on a CPU. Only the segments in the CPU memory
+ * are written: the shared memory is in use by the other CPUs, its
+ * segments are written only by trtl_cpu_load_application_gang()
+ * @param[in] trtl device token
+ * @param[in] index CPU index
+ * @param[in] code buffer containing the ELF image
+ * @param[in] length buffer length
+ * @return 0 on success, on error -1 and errno is set appropriately
+ */
+int trtl_cpu_load_application_elf(struct trtl_dev *trtl,
+				  unsigned int index,
+				  void *code, size_t length)
+{
+	if (!trtl_elf_is_valid(code, length)) {
+		errno = ETRTL_INVALID_ELF;
+		return -1;
+	}
+
+	return trtl_elf_cpu_load((struct trtl_desc *)trtl, index, code);
+}
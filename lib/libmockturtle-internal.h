@@ -7,8 +7,85 @@
 
 #ifndef __LIBTRTL_INTERNAL_H__
 #define __LIBTRTL_INTERNAL_H__
+#include <pthread.h>
 #include "libmockturtle.h"
 
+/*
+ * Shared memory location as described in rt/mockturtle.ld. The mirror
+ * directory takes the last bytes
+ */
+#define TRTL_ELF_SMEM_ORIGIN 0x40200000
+#define TRTL_ELF_SMEM_LENGTH TRTL_VAR_MIRROR_DIR_OFFSET
+/* CPU memory size as described in rt/mockturtle.ld, stack included */
+#define TRTL_ELF_CPU_LENGTH 0x8000
+/* Shared memory windows: direct access followed by the atomic operations */
+#define TRTL_SMEM_WINDOW_SIZE 0x10000
+#define TRTL_SMEM_N_WINDOW 6
+/* Attempts of a consistent read before giving up */
+#define TRTL_SMEM_SEQ_RETRY 1000
+
+/* Messages in the receive pool of a HMQ */
+#define TRTL_HMQ_POOL_SIZE 64
+#define TRTL_CACHE_LINE 64
+/* Maximum number of buffers in a vectored I/O, as UIO_MAXIOV */
+#define TRTL_HMQ_IOV_MAX 1024
+
+/**
+ * Message of a HMQ pool, each one starts on its own cache line
+ */
+struct trtl_hmq_pool_msg {
+	struct trtl_msg msg;
+} __attribute__((aligned(TRTL_CACHE_LINE)));
+
+/**
+ * Pre-allocated messages to receive from a HMQ. Messages are released
+ * in any order; the free ones are kept on a stack
+ */
+struct trtl_hmq_pool {
+	struct trtl_hmq_pool_msg msg[TRTL_HMQ_POOL_SIZE]; /**< messages */
+	uint8_t busy[TRTL_HMQ_POOL_SIZE]; /**< message in use by the caller */
+	uint8_t free[TRTL_HMQ_POOL_SIZE]; /**< indexes of the free messages */
+	unsigned int n_free; /**< number of free messages */
+};
+
+/**
+ * Per-thread scratch buffers. Functions that nest use different buffers
+ */
+enum trtl_thread_buf_id {
+	TRTL_THREAD_BUF_IO, /**< shared memory operations */
+	TRTL_THREAD_BUF_DATA, /**< shared memory data */
+	__TRTL_THREAD_BUF_MAX,
+};
+
+/* Buckets of the open sysfs attributes table */
+#define TRTL_SYSFS_HASH 64
+
+/**
+ * Open sysfs attribute
+ */
+struct trtl_sysfs_attr {
+	struct trtl_sysfs_attr *next; /**< next attribute in the bucket */
+	char path[TRTL_SYSFS_PATH_LEN]; /**< attribute path */
+	int flags; /**< open flags */
+	int fd; /**< file descriptor */
+};
+
+/* Time before looking again for a mirror table that was not found */
+#define TRTL_VAR_MIRROR_RETRY_MS 1000
+
+/**
+ * Location of the mirror table of the application serving an input slot
+ */
+struct trtl_mirror_cache {
+	uint32_t rt_id; /**< RT application, 0 if none */
+	uint32_t addr; /**< mirror table address, 0 if not found */
+	uint32_t n_var; /**< mirror table number of variables */
+	uint64_t retry; /**< when the table was not found, time in
+			   milli-seconds before looking again */
+};
+
+struct trtl_stats_shard;
+
 /**
  * Internal descriptor for a WRNC device
  */
@@ -17,7 +94,154 @@ struct trtl_desc {
 	char path[TRTL_PATH_LEN]; /**< path to device */
 	int fd_dev; /**< File Descriptor of the device */
 	int fd_cpu[TRTL_MAX_CPU];  /**< File Descriptor of the CPUs */
+	volatile uint32_t *smem; /**< shared memory windows mapping, NULL when
+				    not mapped */
+	int smem_map_err; /**< the shared memory cannot be mapped */
+	struct trtl_sampler_ring *smp; /**< sampler ring mapping, NULL when
+					  not mapped */
+	size_t smp_len; /**< sampler ring mapping length */
+	uint32_t smp_tail; /**< next sample to read */
+	struct trtl_mirror_cache mirror[TRTL_MAX_HMQ_SLOT / 2]; /**< mirror
+								   tables by
+								   input slot */
+	struct trtl_hmq *hmq_cache[2][TRTL_MAX_HMQ_SLOT / 2]; /**< HMQ handles
+								 in use by the
+								 RT calls,
+								 by direction */
+	pthread_mutex_t hmq_cache_lock; /**< to protect the HMQ handles cache */
+	struct trtl_sysfs_attr *sysfs[TRTL_SYSFS_HASH]; /**< open sysfs
+							   attributes */
+	pthread_mutex_t sysfs_lock; /**< to protect the sysfs attributes table */
+	pthread_mutex_t lock; /**< to protect the lazy opening of the device */
+	pthread_mutex_t mirror_lock; /**< to protect the mirror table cache */
+	int stats_enable; /**< statistics are enabled */
+	uint64_t stats_id; /**< statistics identifier, never reused */
+	struct trtl_stats_shard *stats_shards; /**< statistics of each thread */
+	struct trtl_stats stats_base; /**< totals at the last reset */
+	pthread_mutex_t stats_lock; /**< to protect the statistics shards */
+
+};
+
+extern int trtl_discovery_init(void);
+extern void trtl_discovery_exit(void);
+extern uint32_t trtl_discovery_count(void);
+extern char **trtl_discovery_list(void);
+extern int trtl_discovery_lun_to_fmc(unsigned int lun, uint32_t *fmc_id);
+extern void *trtl_thread_buf(enum trtl_thread_buf_id id, size_t size);
+extern void trtl_stats_init(struct trtl_desc *wdesc);
+extern void trtl_stats_exit(struct trtl_desc *wdesc);
+extern uint64_t trtl_stats_now(void);
+extern void trtl_stats_account(struct trtl_desc *wdesc,
+			       enum trtl_stats_family family,
+			       uint64_t start, int err, size_t bytes);
 
+/**
+ * It starts to measure a call
+ * @return the current time, 0 when the statistics are disabled
+ */
+static inline uint64_t trtl_stats_start(struct trtl_dev *trtl)
+{
+	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+
+	if (!__atomic_load_n(&wdesc->stats_enable, __ATOMIC_RELAXED))
+		return 0;
+	return trtl_stats_now();
+}
+
+/**
+ * It accounts a call measured from trtl_stats_start()
+ */
+static inline void trtl_stats_end(struct trtl_dev *trtl,
+				  enum trtl_stats_family family,
+				  uint64_t start, int err, size_t bytes)
+{
+	if (start)
+		trtl_stats_account((struct trtl_desc *)trtl, family, start,
+				   err, bytes);
+}
+
+extern struct trtl_hmq *trtl_hmq_get(struct trtl_dev *trtl,
+				     unsigned int index, unsigned long flags);
+extern int trtl_cpu_mem_open(struct trtl_desc *wdesc, unsigned int index,
+			     int clean);
+extern int trtl_cpu_mem_write_fd(int fd, void *code, size_t length,
+				 unsigned int offset);
+extern int trtl_cpu_mem_write(struct trtl_desc *wdesc, unsigned int index,
+			      void *code, size_t length, unsigned int offset);
+extern int trtl_elf_smem_load_all(struct trtl_dev *trtl, void *code);
+extern int trtl_elf_cpu_check(void *code);
+extern int trtl_elf_cpu_load(struct trtl_desc *wdesc, unsigned int index,
+			     void *code);
+extern int trtl_elf_section_get(void *code, size_t length, const char *name,
+				uint32_t *offset, uint32_t *size);
+extern int trtl_elf_symbol_get(void *code, size_t length, const char *name,
+			       uint32_t *value, uint32_t *size);
+
+/**
+ * Descriptor of the binary log of an application
+ */
+struct trtl_log {
+	struct trtl_dev *trtl; /**< device token */
+	char *fmt; /**< format strings section */
+	uint32_t fmt_len; /**< format strings section length */
+	uint32_t addr; /**< ring address in shared memory */
+	uint32_t tail; /**< sequence number of the next record to read */
+};
+
+/* Maximum number of RPC in flight in a session */
+#define TRTL_RPC_MAX_PENDING (TRTL_PROTO_TRANS_SEQ_MASK + 1)
+/* Maximum number of answers read at once */
+#define TRTL_RPC_READ_BATCH 16
+
+/**
+ * Pending RPC
+ */
+struct trtl_rpc_req {
+	trtl_rpc_cb_t *cb; /**< completion callback, NULL when free */
+	void *arg; /**< callback argument */
+	uint64_t deadline; /**< expiration time in milli-seconds */
+};
+
+/**
+ * RPC session on a pair of slots
+ */
+struct trtl_rpc {
+	struct trtl_dev *trtl; /**< device token */
+	struct trtl_hmq *hmq_in; /**< where to send requests */
+	struct trtl_hmq *hmq_out; /**< where to receive answers */
+	unsigned int index_in; /**< input slot index */
+	unsigned int index_out; /**< output slot index */
+	unsigned int next; /**< next tag to try */
+	unsigned int n_pending; /**< number of RPC in flight */
+	struct trtl_rpc_req req[TRTL_RPC_MAX_PENDING]; /**< RPC in flight,
+							  by tag */
+};
+
+/* Maximum number of events dispatched at once */
+#define TRTL_LOOP_MAX_EVENTS 64
+
+/**
+ * Event source registered in a loop
+ */
+struct trtl_loop_src {
+	struct trtl_loop_src *next; /**< next source in the loop */
+	int fd; /**< polled file descriptor */
+	struct trtl_hmq *hmq; /**< HMQ slot, NULL for debug channels */
+	struct trtl_dbg *dbg; /**< debug channel, NULL for HMQ slots */
+	trtl_loop_hmq_cb_t *hmq_cb; /**< HMQ callback */
+	trtl_loop_dbg_cb_t *dbg_cb; /**< debug callback */
+	void *arg; /**< callback argument */
+	int removed; /**< removed while dispatching */
+};
+
+/**
+ * Event loop
+ */
+struct trtl_loop {
+	int epfd; /**< epoll instance */
+	struct trtl_loop_src *src; /**< registered sources */
+	struct trtl_loop_src *zombie; /**< sources removed while dispatching */
+	int running; /**< dispatching events */
 };
 
 #endif
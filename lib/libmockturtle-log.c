@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2016 CERN (www.cern.ch)
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ *
+ * Released according to the GNU GPL, version 3
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "libmockturtle-internal.h"
+
+#define TRTL_LOG_HDR_WORDS (sizeof(struct trtl_log_ring) / 4)
+#define TRTL_LOG_REC_WORDS (sizeof(struct trtl_log_record) / 4)
+
+
+/**
+ * It opens the binary log of the application running on a CPU. The
+ * format strings and the log location are taken from the application ELF
+ * @param[in] trtl device token
+ * @param[in] index CPU index
+ * @param[in] path path to the ELF of the running application
+ * @return a log token on success, NULL otherwise and errno is set
+ *         appropriately
+ */
+struct trtl_log *trtl_log_open(struct trtl_dev *trtl, unsigned int index,
+			       const char *path)
+{
+	struct trtl_log *log;
+	uint32_t off, size, rings;
+	void *code = NULL;
+	long len;
+	FILE *f;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	if (len > 0)
+		code = malloc(len);
+	if (!code || fread(code, 1, len, f) != len) {
+		fclose(f);
+		free(code);
+		errno = ETRTL_INVALID_ELF;
+		return NULL;
+	}
+	fclose(f);
+
+	log = calloc(1, sizeof(struct trtl_log));
+	if (!log)
+		goto out;
+	log->trtl = trtl;
+
+	if (!trtl_elf_is_valid(code, len)) {
+		errno = ETRTL_INVALID_ELF;
+		goto out_free;
+	}
+	if (index >= TRTL_LOG_MAX_CPU) {
+		errno = EINVAL;
+		goto out_free;
+	}
+	if (trtl_elf_symbol_get(code, len, TRTL_LOG_RING_SYMBOL, &log->addr,
+				&rings) ||
+	    trtl_elf_section_get(code, len, TRTL_LOG_FMT_SECTION, &off, &size) ||
+	    !rings || rings % (TRTL_LOG_MAX_CPU * 4) ||
+	    log->addr < TRTL_ELF_SMEM_ORIGIN || log->addr % 4 ||
+	    log->addr - TRTL_ELF_SMEM_ORIGIN > TRTL_ELF_SMEM_LENGTH ||
+	    rings > TRTL_ELF_SMEM_LENGTH - (log->addr - TRTL_ELF_SMEM_ORIGIN)) {
+		errno = ETRTL_LOG_INVALID;
+		goto out_free;
+	}
+
+	/*
+	 * There is a ring for each CPU. The rings are in the shared memory,
+	 * use the offset within it
+	 */
+	log->addr += index * (rings / TRTL_LOG_MAX_CPU);
+	log->addr -= TRTL_ELF_SMEM_ORIGIN;
+	log->fmt_len = size;
+	log->fmt = malloc(size + 1);
+	if (!log->fmt)
+		goto out_free;
+	memcpy(log->fmt, code + off, size);
+	log->fmt[size] = '\0';
+
+	free(code);
+	return log;
+
+out_free:
+	free(log);
+	log = NULL;
+out:
+	free(code);
+	return log;
+}
+
+
+/**
+ * It closes the binary log
+ * @param[in] log log token
+ */
+void trtl_log_close(struct trtl_log *log)
+{
+	free(log->fmt);
+	free(log);
+}
+
+
+/**
+ * It reads the ring header and it validates it
+ */
+static int trtl_log_header_get(struct trtl_log *log,
+			       struct trtl_log_ring *ring)
+{
+	int err;
+
+	err = trtl_smem_read(log->trtl, log->addr, (uint32_t *)ring,
+			     TRTL_LOG_HDR_WORDS, TRTL_SMEM_DIRECT);
+	if (err)
+		return -1;
+
+	if (ring->magic != TRTL_LOG_MAGIC || !ring->size ||
+	    ring->size & (ring->size - 1)) {
+		errno = ETRTL_LOG_INVALID;
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * It reads the oldest records not yet read. When the host is too slow,
+ * the records overwritten by the application are lost
+ * @param[in] log log token
+ * @param[out] rec where to store the records
+ * @param[in] n maximum number of records to read
+ * @return the number of records read, -1 on error and errno is set
+ *         appropriately
+ */
+int trtl_log_read(struct trtl_log *log, struct trtl_log_record *rec,
+		  unsigned int n)
+{
+	struct trtl_log_ring ring;
+	uint32_t count, skip = 0, idx;
+	int err, i;
+
+	err = trtl_log_header_get(log, &ring);
+	if (err)
+		return -1;
+
+	if (ring.head - log->tail > ring.size)
+		log->tail = ring.head - ring.size;
+	count = ring.head - log->tail;
+	if (count > n)
+		count = n;
+
+	for (i = 0; i < count; i++) {
+		idx = (log->tail + i) & (ring.size - 1);
+		err = trtl_smem_read(log->trtl,
+				     log->addr + sizeof(struct trtl_log_ring) +
+				     idx * sizeof(struct trtl_log_record),
+				     (uint32_t *)&rec[i], TRTL_LOG_REC_WORDS,
+				     TRTL_SMEM_DIRECT);
+		if (err)
+			return -1;
+	}
+
+	/*
+	 * The application may have overwritten the oldest records while we
+	 * were reading them. The record under write is the one following
+	 * the head, so it overlaps with the record 'head - size'
+	 */
+	err = trtl_log_header_get(log, &ring);
+	if (err)
+		return -1;
+	if (ring.head + 1 - log->tail > ring.size)
+		skip = ring.head + 1 - ring.size - log->tail;
+	if (skip > count)
+		skip = count;
+	memmove(rec, rec + skip, (count - skip) * sizeof(struct trtl_log_record));
+	log->tail += count;
+
+	return count - skip;
+}
+
+
+/**
+ * It formats a record. Arguments are always 32bit integers: the ones
+ * for the conversions 's' and 'p' are printed as addresses
+ * @param[in] log log token
+ * @param[in] rec record to format
+ * @param[out] buf where to write the string. It is always terminated
+ * @param[in] len buffer length
+ * @return the string length, -1 on error and errno is set appropriately
+ */
+int trtl_log_format(struct trtl_log *log, struct trtl_log_record *rec,
+		    char *buf, size_t len)
+{
+	char spec[16], *fmt;
+	unsigned int n = 0, a = 0, s;
+	uint32_t arg;
+
+	if (!len) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (rec->fmt >= log->fmt_len) {
+		errno = ETRTL_LOG_INVALID;
+		return -1;
+	}
+
+	buf[0] = '\0';
+	for (fmt = log->fmt + rec->fmt; *fmt && n < len - 1; ++fmt) {
+		if (*fmt != '%' || *(fmt + 1) == '%') {
+			fmt += (*fmt == '%');
+			buf[n++] = *fmt;
+			continue;
+		}
+
+		/* Copy flags and width, drop the length modifiers */
+		spec[0] = '%';
+		for (s = 1, ++fmt; *fmt && strchr("-+ #0123456789.lhz", *fmt);
+		     ++fmt)
+			if (!strchr("lhz", *fmt) && s < sizeof(spec) - 3)
+				spec[s++] = *fmt;
+		if (!*fmt)
+			break;
+
+		arg = a < TRTL_LOG_MAX_ARGS ? rec->args[a++] : 0;
+		switch (*fmt) {
+		case 's':
+		case 'p':
+			n += snprintf(buf + n, len - n, "0x%08x", arg);
+			break;
+		case 'd':
+		case 'i':
+			spec[s++] = *fmt;
+			spec[s] = '\0';
+			n += snprintf(buf + n, len - n, spec, (int32_t)arg);
+			break;
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'c':
+			spec[s++] = *fmt;
+			spec[s] = '\0';
+			n += snprintf(buf + n, len - n, spec, arg);
+			break;
+		default:
+			/* Not an integer conversion, show it as is */
+			n += snprintf(buf + n, len - n, "%%%c", *fmt);
+			break;
+		}
+		if (n > len - 1)
+			n = len - 1;
+	}
+	buf[n] = '\0';
+
+	return n;
+}
@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2016 CERN (www.cern.ch)
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ *
+ * Released according to the GNU GPL, version 3
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+
+#include "libmockturtle-internal.h"
+
+
+/**
+ * It creates an event loop. A loop is meant to be used by a single thread
+ * @return an event loop token on success, NULL otherwise and errno is set
+ *         appropriately
+ */
+struct trtl_loop *trtl_loop_create(void)
+{
+	struct trtl_loop *loop;
+
+	loop = calloc(1, sizeof(struct trtl_loop));
+	if (!loop)
+		return NULL;
+
+	loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (loop->epfd < 0) {
+		free(loop);
+		return NULL;
+	}
+
+	return loop;
+}
+
+
+static void trtl_loop_src_free_list(struct trtl_loop_src *src)
+{
+	struct trtl_loop_src *next;
+
+	for (; src; src = next) {
+		next = src->next;
+		free(src);
+	}
+}
+
+
+/**
+ * It destroys an event loop. The registered handles remain open
+ * @param[in] loop event loop token
+ */
+void trtl_loop_destroy(struct trtl_loop *loop)
+{
+	close(loop->epfd);
+	trtl_loop_src_free_list(loop->src);
+	trtl_loop_src_free_list(loop->zombie);
+	free(loop);
+}
+
+
+/**
+ * It returns the epoll file descriptor of the loop. It becomes readable
+ * when there are events to dispatch, so it can be polled by an external
+ * event loop which then calls trtl_loop_run() with timeout 0
+ * @param[in] loop event loop token
+ * @return a file descriptor
+ */
+int trtl_loop_fd(struct trtl_loop *loop)
+{
+	return loop->epfd;
+}
+
+
+static int trtl_loop_src_add(struct trtl_loop *loop, struct trtl_loop_src *src)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN | EPOLLERR;
+	ev.data.ptr = src;
+	if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, src->fd, &ev) < 0) {
+		free(src);
+		return -1;
+	}
+
+	src->next = loop->src;
+	loop->src = src;
+
+	return 0;
+}
+
+
+static int trtl_loop_src_del(struct trtl_loop *loop, struct trtl_hmq *hmq,
+			     struct trtl_dbg *dbg)
+{
+	struct trtl_loop_src **pp, *src;
+
+	for (pp = &loop->src; *pp; pp = &(*pp)->next) {
+		if ((hmq && (*pp)->hmq == hmq) || (dbg && (*pp)->dbg == dbg))
+			break;
+	}
+	if (!*pp) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	src = *pp;
+	*pp = src->next;
+	epoll_ctl(loop->epfd, EPOLL_CTL_DEL, src->fd, NULL);
+
+	/* Pending events may still point to it */
+	if (loop->running) {
+		src->removed = 1;
+		src->next = loop->zombie;
+		loop->zombie = src;
+	} else {
+		free(src);
+	}
+
+	return 0;
+}
+
+
+/**
+ * It registers an HMQ slot in the loop
+ * @param[in] loop event loop token
+ * @param[in] hmq HMQ slot token
+ * @param[in] cb callback to run when the slot is ready
+ * @param[in] arg callback argument
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+int trtl_loop_hmq_add(struct trtl_loop *loop, struct trtl_hmq *hmq,
+		      trtl_loop_hmq_cb_t *cb, void *arg)
+{
+	struct trtl_loop_src *src;
+
+	src = calloc(1, sizeof(struct trtl_loop_src));
+	if (!src)
+		return -1;
+	src->fd = hmq->fd;
+	src->hmq = hmq;
+	src->hmq_cb = cb;
+	src->arg = arg;
+
+	return trtl_loop_src_add(loop, src);
+}
+
+
+/**
+ * It removes an HMQ slot from the loop. It can be called from a callback
+ * @param[in] loop event loop token
+ * @param[in] hmq HMQ slot token
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+int trtl_loop_hmq_del(struct trtl_loop *loop, struct trtl_hmq *hmq)
+{
+	return trtl_loop_src_del(loop, hmq, NULL);
+}
+
+
+/**
+ * It registers a debug channel in the loop
+ * @param[in] loop event loop token
+ * @param[in] dbg debug token
+ * @param[in] cb callback to run when the channel is ready
+ * @param[in] arg callback argument
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+int trtl_loop_debug_add(struct trtl_loop *loop, struct trtl_dbg *dbg,
+			trtl_loop_dbg_cb_t *cb, void *arg)
+{
+	struct trtl_loop_src *src;
+
+	src = calloc(1, sizeof(struct trtl_loop_src));
+	if (!src)
+		return -1;
+	src->fd = dbg->fd;
+	src->dbg = dbg;
+	src->dbg_cb = cb;
+	src->arg = arg;
+
+	return trtl_loop_src_add(loop, src);
+}
+
+
+/**
+ * It removes a debug channel from the loop. It can be called from a callback
+ * @param[in] loop event loop token
+ * @param[in] dbg debug token
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+int trtl_loop_debug_del(struct trtl_loop *loop, struct trtl_dbg *dbg)
+{
+	return trtl_loop_src_del(loop, NULL, dbg);
+}
+
+
+/**
+ * It waits for events and it runs the callbacks of the ready handles.
+ * The cost of a wake up depends on the number of ready handles, not on
+ * the number of registered ones
+ * @param[in] loop event loop token
+ * @param[in] timeout_ms milli-seconds to wait, 0 to not wait, -1 forever
+ * @return the number of dispatched events, -1 on error and errno is set
+ *         appropriately
+ */
+int trtl_loop_run(struct trtl_loop *loop, int timeout_ms)
+{
+	struct epoll_event ev[TRTL_LOOP_MAX_EVENTS];
+	struct trtl_loop_src *src;
+	int i, n, done = 0;
+
+	n = epoll_wait(loop->epfd, ev, TRTL_LOOP_MAX_EVENTS, timeout_ms);
+	if (n < 0)
+		return -1;
+
+	loop->running = 1;
+	for (i = 0; i < n; i++) {
+		src = ev[i].data.ptr;
+		if (src->removed)
+			continue;
+		if (src->hmq)
+			src->hmq_cb(loop, src->hmq, ev[i].events, src->arg);
+		else
+			src->dbg_cb(loop, src->dbg, ev[i].events, src->arg);
+		done++;
+	}
+	loop->running = 0;
+
+	trtl_loop_src_free_list(loop->zombie);
+	loop->zombie = NULL;
+
+	return done;
+}
@@ -0,0 +1,250 @@
+/*
+ * Copyright (C) 2016 CERN (www.cern.ch)
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ *
+ * Released according to the GNU GPL, version 3
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "libmockturtle-internal.h"
+
+
+/**
+ * It returns the monotonic time in milli-seconds
+ */
+static uint64_t trtl_rpc_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/**
+ * It completes a pending RPC and it releases its tag
+ */
+static void trtl_rpc_complete(struct trtl_rpc *rpc, unsigned int tag, int err,
+			      struct trtl_proto_header *hdr, void *payload)
+{
+	struct trtl_rpc_req *req = &rpc->req[tag];
+	trtl_rpc_cb_t *cb = req->cb;
+
+	req->cb = NULL;
+	rpc->n_pending--;
+	cb(rpc, err, hdr, payload, req->arg);
+}
+
+
+/**
+ * It opens an RPC session on a pair of slots. Requests are sent on the
+ * input slot, answers are read from the output slot and matched to their
+ * request by the transaction descriptor, which the RT application copies
+ * from the request header. A session is meant to be used by a single
+ * thread, typically an event loop polling trtl_rpc_fd()
+ * @param[in] trtl device token
+ * @param[in] hmq_in hmq slot index where send the requests
+ * @param[in] hmq_out hmq slot index where the answers come
+ * @return an RPC session token on success, NULL otherwise and errno is set
+ *         appropriately
+ */
+struct trtl_rpc *trtl_rpc_open(struct trtl_dev *trtl,
+			       unsigned int hmq_in, unsigned int hmq_out)
+{
+	struct trtl_rpc *rpc;
+
+	rpc = calloc(1, sizeof(struct trtl_rpc));
+	if (!rpc)
+		return NULL;
+
+	rpc->hmq_in = trtl_hmq_get(trtl, hmq_in, TRTL_HMQ_INCOMING);
+	if (!rpc->hmq_in)
+		goto out;
+	/* Own output handle: it has its own read position in the driver */
+	rpc->hmq_out = trtl_hmq_open(trtl, hmq_out, 0);
+	if (!rpc->hmq_out)
+		goto out;
+
+	rpc->trtl = trtl;
+	rpc->index_in = hmq_in;
+	rpc->index_out = hmq_out;
+
+	return rpc;
+
+out:
+	free(rpc);
+	return NULL;
+}
+
+
+/**
+ * It closes an RPC session. The RPC in flight complete with ECANCELED
+ * @param[in] rpc RPC session token
+ */
+void trtl_rpc_close(struct trtl_rpc *rpc)
+{
+	unsigned int i;
+
+	for (i = 0; i < TRTL_RPC_MAX_PENDING; i++)
+		if (rpc->req[i].cb)
+			trtl_rpc_complete(rpc, i, ECANCELED, NULL, NULL);
+
+	trtl_hmq_close(rpc->hmq_out);
+	free(rpc);
+}
+
+
+/**
+ * It returns the file descriptor to poll (POLLIN) for answers
+ * @param[in] rpc RPC session token
+ * @return a file descriptor
+ */
+int trtl_rpc_fd(struct trtl_rpc *rpc)
+{
+	return rpc->hmq_out->fd;
+}
+
+
+/**
+ * It returns the number of RPC in flight
+ * @param[in] rpc RPC session token
+ * @return the number of RPC in flight
+ */
+unsigned int trtl_rpc_pending(struct trtl_rpc *rpc)
+{
+	return rpc->n_pending;
+}
+
+
+/**
+ * It sends an RT service message without waiting for the answer.
+ * The callback runs from trtl_rpc_dispatch() when the answer arrives or
+ * the timeout expires. The function sets the slots, the transaction
+ * descriptor and the synchronous flag of the header
+ * @param[in] rpc RPC session token
+ * @param[in] hdr message header
+ * @param[in] payload message payload, hdr->len words
+ * @param[in] timeout_ms milli-seconds to wait for the answer
+ * @param[in] cb completion callback
+ * @param[in] arg callback argument
+ * @return 0 on success, -1 otherwise and errno is set appropriately.
+ *         errno is EAGAIN when too many RPC are in flight
+ */
+int trtl_rpc_call(struct trtl_rpc *rpc, struct trtl_proto_header *hdr,
+		  void *payload, unsigned int timeout_ms,
+		  trtl_rpc_cb_t *cb, void *arg)
+{
+	struct trtl_msg msg;
+	unsigned int i, tag;
+	int err;
+
+	if (!cb) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (rpc->n_pending == TRTL_RPC_MAX_PENDING) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	for (i = 0; i < TRTL_RPC_MAX_PENDING; i++) {
+		tag = (rpc->next + i) % TRTL_RPC_MAX_PENDING;
+		if (!rpc->req[tag].cb)
+			break;
+	}
+
+	hdr->slot_io = (rpc->index_in << 4) | (rpc->index_out & 0xF);
+	hdr->flags |= TRTL_PROTO_FLAG_SYNC;
+	hdr->trans = TRTL_PROTO_TRANS_RPC | tag;
+	trtl_message_pack(&msg, hdr, payload);
+
+	err = trtl_hmq_send(rpc->hmq_in, &msg);
+	if (err)
+		return -1;
+
+	rpc->req[tag].cb = cb;
+	rpc->req[tag].arg = arg;
+	rpc->req[tag].deadline = trtl_rpc_now() + timeout_ms;
+	rpc->next = (tag + 1) % TRTL_RPC_MAX_PENDING;
+	rpc->n_pending++;
+
+	return 0;
+}
+
+
+/**
+ * It returns the time left before the first RPC in flight expires.
+ * Use it as poll() timeout
+ * @param[in] rpc RPC session token
+ * @return milli-seconds, -1 when there are no RPC in flight
+ */
+int trtl_rpc_timeout_get(struct trtl_rpc *rpc)
+{
+	uint64_t now, first = UINT64_MAX;
+	unsigned int i;
+
+	if (!rpc->n_pending)
+		return -1;
+
+	for (i = 0; i < TRTL_RPC_MAX_PENDING; i++)
+		if (rpc->req[i].cb && rpc->req[i].deadline < first)
+			first = rpc->req[i].deadline;
+
+	now = trtl_rpc_now();
+
+	return first > now ? first - now : 0;
+}
+
+
+/**
+ * It reads the available answers and it runs their callbacks, then it
+ * expires the RPC without answer in time (ETIME). Answers that do not
+ * belong to the session are ignored
+ * @param[in] rpc RPC session token
+ * @return the number of completed RPC, -1 on error and errno is set
+ *         appropriately
+ */
+int trtl_rpc_dispatch(struct trtl_rpc *rpc)
+{
+	struct trtl_msg msg[TRTL_RPC_READ_BATCH];
+	struct trtl_proto_header hdr;
+	unsigned int tag, i;
+	int n, done = 0;
+	uint64_t now;
+
+	do {
+		n = trtl_hmq_receive_n(rpc->hmq_out, msg, TRTL_RPC_READ_BATCH);
+		if (n < 0)
+			return -1;
+
+		for (i = 0; i < n; i++) {
+			trtl_message_header_get(&msg[i], &hdr);
+			tag = hdr.trans & TRTL_PROTO_TRANS_SEQ_MASK;
+			if (!(hdr.trans & TRTL_PROTO_TRANS_RPC) ||
+			    !rpc->req[tag].cb)
+				continue;
+			trtl_rpc_complete(rpc, tag, 0, &hdr,
+					  &msg[i].data[sizeof(hdr) / 4]);
+			done++;
+		}
+	} while (n == TRTL_RPC_READ_BATCH);
+
+	if (!rpc->n_pending)
+		return done;
+
+	now = trtl_rpc_now();
+	for (i = 0; i < TRTL_RPC_MAX_PENDING; i++) {
+		if (!rpc->req[i].cb || rpc->req[i].deadline > now)
+			continue;
+		trtl_rpc_complete(rpc, i, ETIME, NULL, NULL);
+		done++;
+	}
+
+	return done;
+}
@@ -5,8 +5,11 @@
  * Released according to the GNU GPL, version 3
  */
 
-#include <libmockturtle.h>
+#include <stddef.h>
+#include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include "libmockturtle-internal.h"
 
 /**
  * It embeds the header into the message
@@ -148,6 +151,126 @@ void trtl_message_structure_pop(struct trtl_msg *msg,
 	memcpy(data, data + tlv->size + 8, hdr->len * 4);
 }
 
+/* Message words used by the header */
+#define TRTL_HDR_WORDS (sizeof(struct trtl_proto_header) / 4)
+
+/**
+ * It prepares an iterator over the TLV records of a received message.
+ * Records are not copied: the iterator returns pointers into the message
+ * @param[out] it TLV iterator
+ * @param[in] msg raw message
+ * @param[out] hdr message header
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+int trtl_message_tlv_iter_init(struct trtl_tlv_iter *it,
+			       struct trtl_msg *msg,
+			       struct trtl_proto_header *hdr)
+{
+	trtl_message_header_get(msg, hdr);
+	if (TRTL_HDR_WORDS + hdr->len > TRTL_MAX_PAYLOAD_SIZE) {
+		errno = ETRTL_INVALID_MESSAGE;
+		return -1;
+	}
+
+	it->msg = msg;
+	it->offset = TRTL_HDR_WORDS;
+	it->end = TRTL_HDR_WORDS + hdr->len;
+
+	return 0;
+}
+
+
+/**
+ * It gets the next TLV record. The structure pointer refers to the
+ * message, so it is valid as long as the message is
+ * @param[in] it TLV iterator
+ * @param[out] tlv TLV record
+ * @return 1 when there is a record, 0 at the end of the payload, -1 when
+ *         the record does not fit in the payload and errno is set
+ *         appropriately
+ */
+int trtl_message_tlv_next(struct trtl_tlv_iter *it,
+			  struct trtl_structure_tlv *tlv)
+{
+	uint32_t size;
+
+	if (it->offset >= it->end)
+		return 0;
+
+	if (it->end - it->offset < 2)
+		goto err;
+	size = it->msg->data[it->offset + 1];
+	if (size / 4 > it->end - it->offset - 2)
+		goto err;
+
+	tlv->index = it->msg->data[it->offset];
+	tlv->size = size;
+	tlv->structure = &it->msg->data[it->offset + 2];
+	it->offset += 2 + size / 4;
+
+	return 1;
+
+err:
+	it->offset = it->end;
+	errno = ETRTL_INVALID_MESSAGE;
+	return -1;
+}
+
+
+/**
+ * It prepares a message to be filled with TLV records. Complete it with
+ * trtl_message_tlv_build_end()
+ * @param[out] it TLV iterator
+ * @param[in] msg raw message
+ */
+void trtl_message_tlv_build_init(struct trtl_tlv_iter *it,
+				 struct trtl_msg *msg)
+{
+	it->msg = msg;
+	it->offset = TRTL_HDR_WORDS;
+	it->end = TRTL_MAX_PAYLOAD_SIZE;
+}
+
+
+/**
+ * It appends a TLV record to the message. The header is not updated
+ * @param[in] it TLV iterator
+ * @param[in] tlv TLV record, its size must be a multiple of 4
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+int trtl_message_tlv_append(struct trtl_tlv_iter *it,
+			    struct trtl_structure_tlv *tlv)
+{
+	if (tlv->size % 4 ||
+	    tlv->size / 4 + 2 > it->end - it->offset) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	it->msg->data[it->offset++] = tlv->index;
+	it->msg->data[it->offset++] = tlv->size;
+	memcpy(&it->msg->data[it->offset], tlv->structure, tlv->size);
+	it->offset += tlv->size / 4;
+
+	return 0;
+}
+
+
+/**
+ * It completes a message filled with TLV records: it sets the payload
+ * length and it embeds the header
+ * @param[in] it TLV iterator
+ * @param[in|out] hdr message header, the length is updated
+ */
+void trtl_message_tlv_build_end(struct trtl_tlv_iter *it,
+				struct trtl_proto_header *hdr)
+{
+	hdr->len = it->offset - TRTL_HDR_WORDS;
+	trtl_message_header_set(it->msg, hdr);
+	it->msg->datalen = it->offset;
+}
+
+
 /**
  * Retrieve the current Real-Time Application version running. This is a
  * synchronous message.
@@ -163,9 +286,9 @@ int trtl_rt_version_get(struct trtl_dev *trtl, struct trtl_rt_version *version,
 	struct trtl_proto_header hdr;
 	struct trtl_hmq *hmq;
 	struct trtl_msg msg;
+	uint64_t start;
 	int err;
 
-	memset(&msg, 0, sizeof(struct trtl_msg));
 	memset(&hdr, 0, sizeof(struct trtl_proto_header));
 	hdr.msg_id = RT_ACTION_RECV_VERSION;
 	hdr.slot_io = (hmq_in << 4) | hmq_out;
@@ -173,24 +296,31 @@ int trtl_rt_version_get(struct trtl_dev *trtl, struct trtl_rt_version *version,
 	hdr.len = 0;
 	trtl_message_pack(&msg, &hdr, NULL);
 
-	hmq = trtl_hmq_open(trtl, hmq_in, TRTL_HMQ_INCOMING);
-	if (!hmq)
-		return -1;
+	start = trtl_stats_start(trtl);
+	hmq = trtl_hmq_get(trtl, hmq_in, TRTL_HMQ_INCOMING);
+	if (!hmq) {
+		err = -1;
+		goto out;
+	}
 
 	/* Send the message and get answer */
         err = trtl_hmq_send_and_receive_sync(hmq, hmq_out, &msg,
 					     trtl_default_timeout_ms);
-	trtl_hmq_close(hmq);
-	if (err <= 0)
-		return -1;
+	if (err <= 0) {
+		err = -1;
+		goto out;
+	}
 
 	trtl_message_unpack(&msg, &hdr, version);
+	err = 0;
 	if (hdr.msg_id != RT_ACTION_SEND_VERSION) {
 		errno = ETRTL_INVALID_MESSAGE;
-		return -1;
+		err = -1;
 	}
-
-	return 0;
+out:
+	trtl_stats_end(trtl, TRTL_STATS_RT, start, err,
+		       sizeof(struct trtl_rt_version));
+	return err;
 }
 
 
@@ -207,6 +337,7 @@ int trtl_rt_ping(struct trtl_dev *trtl,
 	struct trtl_proto_header hdr;
 	struct trtl_hmq *hmq;
 	struct trtl_msg msg;
+	uint64_t start;
 	int err;
 
 	memset(&hdr, 0, sizeof(struct trtl_proto_header));
@@ -216,23 +347,29 @@ int trtl_rt_ping(struct trtl_dev *trtl,
 	hdr.len = 0;
 	trtl_message_pack(&msg, &hdr, NULL);
 
-	hmq = trtl_hmq_open(trtl, hmq_in, TRTL_HMQ_INCOMING);
-	if (!hmq)
-		return -1;
+	start = trtl_stats_start(trtl);
+	hmq = trtl_hmq_get(trtl, hmq_in, TRTL_HMQ_INCOMING);
+	if (!hmq) {
+		err = -1;
+		goto out;
+	}
 
 	/* Send the message and get answer */
         err = trtl_hmq_send_and_receive_sync(hmq, hmq_out, &msg,
 					     trtl_default_timeout_ms);
-	if (err <= 0)
-		return -1;
-	trtl_hmq_close(hmq);
+	if (err <= 0) {
+		err = -1;
+		goto out;
+	}
 	trtl_message_unpack(&msg, &hdr, NULL);
+	err = 0;
 	if (hdr.msg_id != RT_ACTION_SEND_ACK) {
 		errno = ETRTL_INVALID_MESSAGE;
-		return -1;
+		err = -1;
 	}
-
-	return 0;
+out:
+	trtl_stats_end(trtl, TRTL_STATS_RT, start, err, 0);
+	return err;
 }
 
 
@@ -248,12 +385,10 @@ static inline int trtl_rt_variable(struct trtl_dev *trtl,
 	struct trtl_hmq *hmq;
 	int err;
 
-	hmq = trtl_hmq_open(trtl, (hdr->slot_io >> 4 & 0xF), TRTL_HMQ_INCOMING);
+	hmq = trtl_hmq_get(trtl, (hdr->slot_io >> 4 & 0xF), TRTL_HMQ_INCOMING);
 	if (!hmq)
 		return -1;
 
-	memset(&msg, 0, sizeof(struct trtl_msg));
-
 	/* Send asynchronous message, we do not wait for answers  */
 	trtl_message_pack(&msg, hdr, variables);
 	if (hdr->flags & TRTL_PROTO_FLAG_SYNC) {
@@ -264,7 +399,6 @@ static inline int trtl_rt_variable(struct trtl_dev *trtl,
 	} else {
 		err = trtl_hmq_send(hmq, &msg);
 	}
-	trtl_hmq_close(hmq);
 
 	return err <= 0 ? -1 : 0;
 }
@@ -303,20 +437,146 @@ int trtl_rt_variable_set(struct trtl_dev *trtl,
 			 uint32_t *var,
 			 unsigned int n_var)
 {
+	uint64_t start = trtl_stats_start(trtl);
 	int err;
 
 	hdr->msg_id = RT_ACTION_RECV_FIELD_SET;
 	hdr->len = n_var * 2;
 
 	err = trtl_rt_variable(trtl, hdr, var, n_var);
-	if (err)
-		return err;
-	if ((hdr->flags & TRTL_PROTO_FLAG_SYNC) &&
+	if (!err && (hdr->flags & TRTL_PROTO_FLAG_SYNC) &&
 	    hdr->msg_id != RT_ACTION_SEND_FIELD_GET) {
 		errno = ETRTL_INVALID_MESSAGE;
+		err = -1;
+	}
+	trtl_stats_end(trtl, TRTL_STATS_RT, start, err, n_var * 8);
+
+	return err;
+}
+
+
+/**
+ * It returns the monotonic time in milli-seconds
+ */
+static uint64_t trtl_rt_variable_mirror_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+/**
+ * It looks in the mirror directory for the mirror table of the RT
+ * application that serves an input slot. Each CPU has its own directory
+ * entry, the input slot tells which CPU gets the request.
+ * A table not found stays cached for TRTL_VAR_MIRROR_RETRY_MS
+ */
+static int trtl_rt_variable_mirror_find(struct trtl_desc *wdesc,
+					struct trtl_mirror_cache *cache,
+					uint32_t rt_id, unsigned int slot)
+{
+	struct trtl_dev *trtl = (struct trtl_dev *)wdesc;
+	uint32_t dir[TRTL_VAR_MIRROR_DIR_SIZE], hdr[TRTL_VAR_MIRROR_HDR_WORDS];
+	uint32_t addr;
+	int err, i;
+
+	cache->rt_id = rt_id;
+	cache->addr = 0;
+	cache->retry = trtl_rt_variable_mirror_now() + TRTL_VAR_MIRROR_RETRY_MS;
+	err = trtl_smem_read(trtl, TRTL_VAR_MIRROR_DIR_OFFSET, dir,
+			     TRTL_VAR_MIRROR_DIR_SIZE, TRTL_SMEM_DIRECT);
+	if (err)
 		return -1;
+
+	for (i = 0; i < TRTL_VAR_MIRROR_DIR_SIZE; i++) {
+		addr = dir[i] - TRTL_ELF_SMEM_ORIGIN;
+		if (dir[i] < TRTL_ELF_SMEM_ORIGIN || addr % 4 ||
+		    addr + sizeof(hdr) > TRTL_VAR_MIRROR_DIR_OFFSET)
+			continue;
+		err = trtl_smem_read(trtl, addr, hdr, TRTL_VAR_MIRROR_HDR_WORDS,
+				     TRTL_SMEM_DIRECT);
+		if (err)
+			return -1;
+		if (hdr[0] != TRTL_VAR_MIRROR_MAGIC || hdr[1] != rt_id ||
+		    !(hdr[4] & (1 << slot)) ||
+		    addr + sizeof(hdr) + TRTL_VAR_MIRROR_WORDS(hdr[3]) * 4 >
+		    TRTL_VAR_MIRROR_DIR_OFFSET)
+			continue;
+
+		cache->addr = addr;
+		cache->n_var = hdr[3];
+		return 0;
 	}
 
+	errno = ENOENT;
+	return -1;
+}
+
+
+/**
+ * It gets variables from the mirror table published by the RT application
+ * in shared memory. It fails when one of the variables is not mirrored
+ */
+static int trtl_rt_variable_mirror_get(struct trtl_dev *trtl,
+				       struct trtl_proto_header *hdr,
+				       uint32_t *var, unsigned int n_var)
+{
+	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+	struct trtl_mirror_cache *cache;
+	uint32_t *table, *map, *val, addr, n_mirror, rt_id = hdr->rt_app_id;
+	unsigned int n_map, len, slot = (hdr->slot_io >> 4) & 0xF;
+	int err, i;
+
+	if (!rt_id || slot >= TRTL_MAX_HMQ_SLOT / 2)
+		return -1;
+	cache = &wdesc->mirror[slot];
+
+	/* Take a snapshot of the cached table location */
+	pthread_mutex_lock(&wdesc->mirror_lock);
+	err = 0;
+	if (cache->rt_id != rt_id ||
+	    (!cache->addr && trtl_rt_variable_mirror_now() >= cache->retry))
+		err = trtl_rt_variable_mirror_find(wdesc, cache, rt_id, slot);
+	addr = cache->addr;
+	n_mirror = cache->n_var;
+	pthread_mutex_unlock(&wdesc->mirror_lock);
+	if (err || !addr)
+		return -1;
+
+	n_map = (n_mirror + 31) / 32;
+	len = TRTL_VAR_MIRROR_HDR_WORDS + TRTL_VAR_MIRROR_WORDS(n_mirror);
+	table = trtl_thread_buf(TRTL_THREAD_BUF_DATA, len * sizeof(uint32_t));
+	if (!table)
+		return -1;
+	err = trtl_smem_read_consistent(trtl, addr +
+					offsetof(struct trtl_var_mirror, seq),
+					addr, table, len);
+	if (err)
+		return -1;
+
+	/* The application may have been replaced */
+	if (table[0] != TRTL_VAR_MIRROR_MAGIC || table[1] != rt_id ||
+	    table[3] != n_mirror || !(table[4] & (1 << slot))) {
+		pthread_mutex_lock(&wdesc->mirror_lock);
+		if (cache->rt_id == rt_id && cache->addr == addr)
+			cache->rt_id = 0;
+		pthread_mutex_unlock(&wdesc->mirror_lock);
+		return -1;
+	}
+
+	map = table + TRTL_VAR_MIRROR_HDR_WORDS;
+	val = map + n_map;
+	for (i = 0; i < n_var * 2; i += 2) {
+		if (var[i] >= n_mirror ||
+		    !(map[var[i] / 32] & (1 << (var[i] % 32))))
+			return -1;
+	}
+	for (i = 0; i < n_var * 2; i += 2)
+		var[i + 1] = val[var[i]];
+
 	return 0;
 }
 
@@ -337,6 +597,9 @@ int trtl_rt_variable_set(struct trtl_dev *trtl,
  * This kind of message is always synchronous. The 'variables' field will be
  * overwritten by the syncrhonous answer; the answer contains the read back
  * values for the requested variables.
+ * When the header identifies the RT application and all the variables are
+ * mirrored in shared memory (RT_VARIABLE_FLAG_MIRROR), the values are read
+ * from the shared memory and no message is sent.
  * This function will change the header content, in particular it will change
  * the following fields: msg_id, flags, len
  * @param[in] trtl device token
@@ -350,6 +613,7 @@ int trtl_rt_variable_get(struct trtl_dev *trtl,
 			 uint32_t *var,
 			 unsigned int n_var)
 {
+	uint64_t start = trtl_stats_start(trtl);
 	int err;
 
 	hdr->msg_id = RT_ACTION_RECV_FIELD_GET;
@@ -357,15 +621,20 @@ int trtl_rt_variable_get(struct trtl_dev *trtl,
 	hdr->flags |= TRTL_PROTO_FLAG_SYNC;
 	hdr->len = n_var * 2;
 
+	if (!trtl_rt_variable_mirror_get(trtl, hdr, var, n_var)) {
+		hdr->msg_id = RT_ACTION_SEND_FIELD_GET;
+		err = 0;
+		goto out;
+	}
+
         err = trtl_rt_variable(trtl, hdr, var, n_var);
-	if (err)
-		return err;
-	if (hdr->msg_id != RT_ACTION_SEND_FIELD_GET) {
+	if (!err && hdr->msg_id != RT_ACTION_SEND_FIELD_GET) {
 		errno = ETRTL_INVALID_MESSAGE;
-		return -1;
+		err = -1;
 	}
-
-	return 0;
+out:
+	trtl_stats_end(trtl, TRTL_STATS_RT, start, err, n_var * 8);
+	return err;
 }
 
 
@@ -377,32 +646,51 @@ static int trtl_rt_structure(struct trtl_dev *trtl,
 			     struct trtl_structure_tlv *tlv,
 			     unsigned int n_tlv)
 {
+	struct trtl_structure_tlv rec;
+	struct trtl_tlv_iter it;
 	struct trtl_msg msg;
 	struct trtl_hmq *hmq;
 	int err, i;
 
-	hmq = trtl_hmq_open(trtl, (hdr->slot_io >> 4 & 0xF), TRTL_HMQ_INCOMING);
+	hmq = trtl_hmq_get(trtl, (hdr->slot_io >> 4 & 0xF), TRTL_HMQ_INCOMING);
 	if (!hmq)
 		return -1;
 
-	memset(&msg, 0, sizeof(struct trtl_msg));
-
-	/* Send asynchronous message, we do not wait for answers  */
+	trtl_message_tlv_build_init(&it, &msg);
 	for (i = 0; i < n_tlv; ++i)
-		trtl_message_structure_push(&msg, hdr, &tlv[i]);
+		if (trtl_message_tlv_append(&it, &tlv[i]))
+			return -1;
+	trtl_message_tlv_build_end(&it, hdr);
 
-	if (hdr->flags & TRTL_PROTO_FLAG_SYNC) {
-		err = trtl_hmq_send_and_receive_sync(hmq, (hdr->slot_io & 0xF),
-						     &msg, 1000);
-		if (err > 0)
-			for (i = 0; i < n_tlv; ++i)
-				trtl_message_structure_pop(&msg, hdr, &tlv[i]);
-	} else {
+	if (!(hdr->flags & TRTL_PROTO_FLAG_SYNC)) {
+		/* Send asynchronous message, we do not wait for answers  */
 		err = trtl_hmq_send(hmq, &msg);
+		return err ? -1 : 0;
 	}
-	trtl_hmq_close(hmq);
 
-	return err <= 0 ? -1 : 0;
+	err = trtl_hmq_send_and_receive_sync(hmq, (hdr->slot_io & 0xF),
+					     &msg, 1000);
+	if (err <= 0)
+		return -1;
+
+	if (trtl_message_tlv_iter_init(&it, &msg, hdr))
+		return -1;
+	for (i = 0; i < n_tlv; ++i) {
+		err = trtl_message_tlv_next(&it, &rec);
+		if (err < 0)
+			return -1;
+		if (!err)
+			break;
+		if (rec.size > tlv[i].size) {
+			errno = ETRTL_INVALID_MESSAGE;
+			return -1;
+		}
+		tlv[i].index = rec.index;
+		tlv[i].size = rec.size;
+		memcpy(tlv[i].structure, rec.structure, rec.size);
+	}
+
+	return 0;
 }
 
 
@@ -420,21 +708,21 @@ int trtl_rt_structure_set(struct trtl_dev *trtl,
 			  struct trtl_structure_tlv *tlv,
 			  unsigned int n_tlv)
 {
+	uint64_t start = trtl_stats_start(trtl);
 	int err;
 
 	hdr->len = 0;
 	hdr->msg_id = RT_ACTION_RECV_STRUCT_SET;
 
 	err = trtl_rt_structure(trtl, hdr, tlv, n_tlv);
-	if (err)
-		return err;
-	if ((hdr->flags & TRTL_PROTO_FLAG_SYNC) &&
+	if (!err && (hdr->flags & TRTL_PROTO_FLAG_SYNC) &&
 	    hdr->msg_id != RT_ACTION_SEND_STRUCT_GET) {
 		errno = ETRTL_INVALID_MESSAGE;
-		return -1;
+		err = -1;
 	}
+	trtl_stats_end(trtl, TRTL_STATS_RT, start, err, hdr->len * 4);
 
-	return 0;
+	return err;
 }
 
 /**
@@ -451,6 +739,7 @@ int trtl_rt_structure_get(struct trtl_dev *trtl,
 			  struct trtl_structure_tlv *tlv,
 			  unsigned int n_tlv)
 {
+	uint64_t start = trtl_stats_start(trtl);
 	int err;
 
 	hdr->len = 0;
@@ -459,12 +748,11 @@ int trtl_rt_structure_get(struct trtl_dev *trtl,
 	hdr->flags |= TRTL_PROTO_FLAG_SYNC;
 
         err = trtl_rt_structure(trtl, hdr, tlv, n_tlv);
-	if (err)
-		return err;
-	if (hdr->msg_id != RT_ACTION_SEND_STRUCT_GET) {
+	if (!err && hdr->msg_id != RT_ACTION_SEND_STRUCT_GET) {
 		errno = ETRTL_INVALID_MESSAGE;
-		return -1;
+		err = -1;
 	}
+	trtl_stats_end(trtl, TRTL_STATS_RT, start, err, hdr->len * 4);
 
-	return 0;
+	return err;
 }
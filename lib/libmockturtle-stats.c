@@ -0,0 +1,286 @@
+/*
+ * Copyright (C) 2016 CERN (www.cern.ch)
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ *
+ * Released according to the GNU GPL, version 3
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "libmockturtle-internal.h"
+
+/**
+ * Statistics of a thread on a device
+ */
+struct trtl_stats_shard {
+	struct trtl_stats_shard *next; /**< next shard of the device */
+	int refs; /**< owners: the device and the thread */
+	int dead; /**< the device has been closed */
+	struct trtl_stats stats; /**< counters, written by one thread only */
+};
+
+/**
+ * Shards in use by a thread, one per device
+ */
+struct trtl_stats_tls {
+	struct trtl_stats_tls *next;
+	uint64_t id; /**< device statistics identifier */
+	struct trtl_stats_shard *shard;
+};
+
+static uint64_t trtl_stats_next_id = 1;
+static __thread struct trtl_stats_tls *trtl_stats_tls;
+static pthread_key_t trtl_stats_key;
+static pthread_once_t trtl_stats_once = PTHREAD_ONCE_INIT;
+
+
+/**
+ * It drops a reference to a shard, the last owner frees it
+ */
+static void trtl_stats_shard_put(struct trtl_stats_shard *shard)
+{
+	if (!__atomic_sub_fetch(&shard->refs, 1, __ATOMIC_ACQ_REL))
+		free(shard);
+}
+
+static void trtl_stats_tls_free(void *arg)
+{
+	struct trtl_stats_tls *tls, *next;
+
+	for (tls = arg; tls; tls = next) {
+		next = tls->next;
+		trtl_stats_shard_put(tls->shard);
+		free(tls);
+	}
+}
+
+
+/**
+ * It removes from the calling thread the entries of the closed devices
+ */
+static void trtl_stats_tls_prune(void)
+{
+	struct trtl_stats_tls **pp, *tls;
+
+	for (pp = &trtl_stats_tls; (tls = *pp);) {
+		if (!__atomic_load_n(&tls->shard->dead, __ATOMIC_ACQUIRE)) {
+			pp = &tls->next;
+			continue;
+		}
+		*pp = tls->next;
+		trtl_stats_shard_put(tls->shard);
+		free(tls);
+	}
+	pthread_setspecific(trtl_stats_key, trtl_stats_tls);
+}
+
+static void trtl_stats_key_init(void)
+{
+	pthread_key_create(&trtl_stats_key, trtl_stats_tls_free);
+}
+
+
+/**
+ * It initializes the statistics of a device. They are disabled
+ */
+void trtl_stats_init(struct trtl_desc *wdesc)
+{
+	wdesc->stats_enable = 0;
+	wdesc->stats_id = __atomic_fetch_add(&trtl_stats_next_id, 1,
+					     __ATOMIC_RELAXED);
+	wdesc->stats_shards = NULL;
+	memset(&wdesc->stats_base, 0, sizeof(struct trtl_stats));
+	pthread_mutex_init(&wdesc->stats_lock, NULL);
+}
+
+
+/**
+ * It releases the statistics of a device. The threads drop their entries
+ * that refer to it on their next new device, or when they exit
+ */
+void trtl_stats_exit(struct trtl_desc *wdesc)
+{
+	struct trtl_stats_shard *shard, *next;
+
+	for (shard = wdesc->stats_shards; shard; shard = next) {
+		next = shard->next;
+		__atomic_store_n(&shard->dead, 1, __ATOMIC_RELEASE);
+		trtl_stats_shard_put(shard);
+	}
+	wdesc->stats_shards = NULL;
+	pthread_mutex_destroy(&wdesc->stats_lock);
+}
+
+
+/**
+ * It returns the statistics shard of the calling thread for a device
+ */
+static struct trtl_stats_shard *trtl_stats_shard_get(struct trtl_desc *wdesc)
+{
+	struct trtl_stats_tls *tls;
+	struct trtl_stats_shard *shard;
+
+	for (tls = trtl_stats_tls; tls; tls = tls->next)
+		if (tls->id == wdesc->stats_id)
+			return tls->shard;
+
+	/* First call of this thread on this device */
+	pthread_once(&trtl_stats_once, trtl_stats_key_init);
+	trtl_stats_tls_prune();
+	tls = malloc(sizeof(struct trtl_stats_tls));
+	if (!tls)
+		return NULL;
+	shard = calloc(1, sizeof(struct trtl_stats_shard));
+	if (!shard) {
+		free(tls);
+		return NULL;
+	}
+	shard->refs = 2;
+
+	pthread_mutex_lock(&wdesc->stats_lock);
+	shard->next = wdesc->stats_shards;
+	wdesc->stats_shards = shard;
+	pthread_mutex_unlock(&wdesc->stats_lock);
+
+	tls->id = wdesc->stats_id;
+	tls->shard = shard;
+	tls->next = trtl_stats_tls;
+	trtl_stats_tls = tls;
+	pthread_setspecific(trtl_stats_key, tls);
+
+	return shard;
+}
+
+
+/**
+ * It returns the current time in nano-seconds
+ */
+uint64_t trtl_stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/* Single writer: a relaxed load and store is enough, no locked operation */
+#define trtl_stats_add(_cnt, _val) \
+	__atomic_store_n(&(_cnt), (_cnt) + (_val), __ATOMIC_RELAXED)
+
+/**
+ * It accounts a completed call. errno is preserved
+ * @param[in] wdesc device descriptor
+ * @param[in] family API family
+ * @param[in] start value returned by trtl_stats_start(), 0 when disabled
+ * @param[in] err call result, 0 on success
+ * @param[in] bytes bytes transferred
+ */
+void trtl_stats_account(struct trtl_desc *wdesc, enum trtl_stats_family family,
+			uint64_t start, int err, size_t bytes)
+{
+	struct trtl_stats_shard *shard;
+	struct trtl_stats_counters *cnt;
+	uint64_t ns = trtl_stats_now() - start;
+	int errsv = errno, bucket;
+
+	shard = trtl_stats_shard_get(wdesc);
+	if (!shard)
+		goto out;
+	cnt = &shard->stats.family[family];
+
+	bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	if (bucket >= TRTL_STATS_HIST_BUCKETS)
+		bucket = TRTL_STATS_HIST_BUCKETS - 1;
+
+	trtl_stats_add(cnt->calls, 1);
+	if (err) {
+		trtl_stats_add(cnt->errors, 1);
+		if (errsv == ETIME)
+			trtl_stats_add(cnt->timeouts, 1);
+	} else {
+		trtl_stats_add(cnt->bytes, bytes);
+	}
+	trtl_stats_add(cnt->latency_ns, ns);
+	trtl_stats_add(cnt->hist[bucket], 1);
+out:
+	errno = errsv;
+}
+
+
+/**
+ * It enables or disables the statistics of a device. When disabled, the
+ * instrumented calls cost a single test
+ * @param[in] trtl device token
+ * @param[in] enable 1 to enable, 0 to disable
+ */
+void trtl_stats_enable(struct trtl_dev *trtl, int enable)
+{
+	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+
+	__atomic_store_n(&wdesc->stats_enable, !!enable, __ATOMIC_RELAXED);
+}
+
+
+/**
+ * It sums the counters of all the threads
+ */
+static void trtl_stats_merge(struct trtl_desc *wdesc, struct trtl_stats *stats)
+{
+	struct trtl_stats_shard *shard;
+	uint64_t *dst, *src;
+	int i;
+
+	memset(stats, 0, sizeof(struct trtl_stats));
+	dst = (uint64_t *)stats;
+	for (shard = wdesc->stats_shards; shard; shard = shard->next) {
+		src = (uint64_t *)&shard->stats;
+		for (i = 0; i < sizeof(struct trtl_stats) / 8; i++)
+			dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	}
+}
+
+
+/**
+ * It gets the statistics of a device, accumulated by all the threads
+ * since the last reset
+ * @param[in] trtl device token
+ * @param[out] stats statistics
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+int trtl_stats_get(struct trtl_dev *trtl, struct trtl_stats *stats)
+{
+	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+	uint64_t *dst = (uint64_t *)stats, *base;
+	int i;
+
+	pthread_mutex_lock(&wdesc->stats_lock);
+	trtl_stats_merge(wdesc, stats);
+	base = (uint64_t *)&wdesc->stats_base;
+	for (i = 0; i < sizeof(struct trtl_stats) / 8; i++)
+		dst[i] -= base[i];
+	pthread_mutex_unlock(&wdesc->stats_lock);
+
+	return 0;
+}
+
+
+/**
+ * It resets the statistics of a device. Threads keep writing their own
+ * counters: the current totals become the new origin
+ * @param[in] trtl device token
+ */
+void trtl_stats_reset(struct trtl_dev *trtl)
+{
+	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+
+	pthread_mutex_lock(&wdesc->stats_lock);
+	trtl_stats_merge(wdesc, &wdesc->stats_base);
+	pthread_mutex_unlock(&wdesc->stats_lock);
+}
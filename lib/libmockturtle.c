@@ -8,6 +8,8 @@
 #include <sys/types.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -29,6 +31,8 @@ static char *trtl_error_str[] = {
 	"The HMQ slot is close",
 	"Invalid message",
 	"Error while reading HMQ messages",
+	"Invalid ELF image",
+	"Invalid or not initialized binary log",
 	NULL,
 };
 
@@ -49,23 +53,13 @@ char *trtl_strerror(int err)
 
 /**
  * It initializes the WRNC library. It must be called before doing
- * anything else. If you are going to load/unload WRNC devices, then
- * you have to un-load (trtl_exit()) e reload (trtl_init()) the library.
+ * anything else. It builds the index of the available devices, which is
+ * kept up to date by trtl_discovery_dispatch()
  * @return 0 on success, otherwise -1 and errno is appropriately set
  */
 int trtl_init()
 {
-	/* As you can see there is nothing to do because everything is
-	   dynamical and does not require a special initialization.
-	   Instead of removing this function and force the user to use it
-	   I choosed to keep it even if it's empty. The reason is simple:
-	   I do not know in the future if we need this library initialization,
-	   if we will need it and we don't have it than we have to force ALL
-	   our users to change all the software stack behind this library
-	   which is not trivial and not backward compatible. I prefer to avoid
-	   it and force people today to use this function and save a lot of
-	   time in the future */
-	return 0;
+	return trtl_discovery_init();
 }
 
 
@@ -76,33 +70,19 @@ int trtl_init()
  */
 void trtl_exit()
 {
-	/* READ trtl_init() */
+	trtl_discovery_exit();
 }
 
 
 /**
  * It returns the number of available WRNCs. This is not calculated on demand.
- * It depends on library initialization.
+ * It depends on library initialization and on the hot-plug events
+ * dispatched so far.
  * @return the number of WRNC available
  */
 uint32_t trtl_count()
 {
-	glob_t g;
-	uint32_t count;
-	int err;
-
-	err = glob("/dev/trtl-[A-Fa-f0-9][A-Fa-f0-9][A-Fa-f0-9][A-Fa-f0-9]",
-		   GLOB_NOSORT, NULL, &g);
-	if (err != GLOB_NOMATCH)
-		return 0;
-	err = glob("/dev/mockturtle/trtl-[A-Fa-f0-9][A-Fa-f0-9][A-Fa-f0-9][A-Fa-f0-9]",
-		   GLOB_NOSORT | GLOB_APPEND, NULL, &g);
-	if (err)
-		return 0;
-	count = g.gl_pathc;
-	globfree(&g);
-
-	return count;
+	return trtl_discovery_count();
 }
 
 
@@ -114,30 +94,7 @@ uint32_t trtl_count()
  */
 char **trtl_list()
 {
-	char **list = NULL;
-	glob_t g;
-	int err, i, count;
-
-	err = glob("/dev/trtl-[A-Fa-f0-9][A-Fa-f0-9][A-Fa-f0-9][A-Fa-f0-9]",
-		   GLOB_NOSORT, NULL, &g);
-	if (err != GLOB_NOMATCH)
-		return NULL;
-	err = glob("/dev/mockturtle/trtl-[A-Fa-f0-9][A-Fa-f0-9][A-Fa-f0-9][A-Fa-f0-9]",
-		   GLOB_NOSORT | GLOB_APPEND, NULL, &g);
-	if (err)
-		return NULL;
-	count = g.gl_pathc;
-
-	list = malloc(sizeof(char *) * (count + 1));
-	if (!list)
-		return NULL;
-	for (i = 0; i < count; ++i)
-		list[i] = strdup(basename(g.gl_pathv[i]));
-	list[i] = NULL;
-
-	globfree(&g);
-
-	return list;
+	return trtl_discovery_list();
 }
 
 
@@ -155,6 +112,68 @@ void trtl_list_free(char **list)
 }
 
 
+static pthread_key_t trtl_thread_key;
+static pthread_once_t trtl_thread_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Per-thread scratch buffers
+ */
+struct trtl_thread_bufs {
+	void *buf[__TRTL_THREAD_BUF_MAX];
+	size_t size[__TRTL_THREAD_BUF_MAX];
+};
+
+static void trtl_thread_bufs_free(void *arg)
+{
+	struct trtl_thread_bufs *tb = arg;
+	int i;
+
+	for (i = 0; i < __TRTL_THREAD_BUF_MAX; ++i)
+		free(tb->buf[i]);
+	free(tb);
+}
+
+static void trtl_thread_key_init(void)
+{
+	pthread_key_create(&trtl_thread_key, trtl_thread_bufs_free);
+}
+
+
+/**
+ * It returns a scratch buffer that belongs to the calling thread. It is
+ * valid until the next call with the same identifier from the same thread,
+ * and it is released when the thread exits. Hot paths use it instead of
+ * allocating memory on each call
+ * @param[in] id buffer identifier
+ * @param[in] size minimum buffer size in bytes
+ * @return a buffer, NULL on error and errno is set appropriately
+ */
+void *trtl_thread_buf(enum trtl_thread_buf_id id, size_t size)
+{
+	struct trtl_thread_bufs *tb;
+	void *buf;
+
+	pthread_once(&trtl_thread_once, trtl_thread_key_init);
+	tb = pthread_getspecific(trtl_thread_key);
+	if (!tb) {
+		tb = calloc(1, sizeof(struct trtl_thread_bufs));
+		if (!tb)
+			return NULL;
+		pthread_setspecific(trtl_thread_key, tb);
+	}
+
+	if (tb->size[id] < size) {
+		buf = realloc(tb->buf[id], size);
+		if (!buf)
+			return NULL;
+		tb->buf[id] = buf;
+		tb->size[id] = size;
+	}
+
+	return tb->buf[id];
+}
+
+
 /**
  * It opens a WRNC device using a string descriptor. The descriptor correspond
  * to the main char device name of the white-rabbit node-core.
@@ -189,6 +208,17 @@ struct trtl_dev *trtl_open(const char *device)
 	trtl->fd_dev = -1;
 	for (i = 0; i < TRTL_MAX_CPU; ++i)
 		trtl->fd_cpu[i] = -1;
+	trtl->smem = NULL;
+	trtl->smem_map_err = 0;
+	trtl->smp = NULL;
+	memset(trtl->mirror, 0, sizeof(trtl->mirror));
+	memset(trtl->hmq_cache, 0, sizeof(trtl->hmq_cache));
+	pthread_mutex_init(&trtl->hmq_cache_lock, NULL);
+	memset(trtl->sysfs, 0, sizeof(trtl->sysfs));
+	pthread_mutex_init(&trtl->sysfs_lock, NULL);
+	pthread_mutex_init(&trtl->lock, NULL);
+	pthread_mutex_init(&trtl->mirror_lock, NULL);
+	trtl_stats_init(trtl);
 
 	return (struct trtl_dev *)trtl;
 
@@ -230,6 +260,9 @@ struct trtl_dev *trtl_open_by_lun(unsigned int lun)
 	uint32_t dev_id;
 	int ret;
 
+	if (!trtl_discovery_lun_to_fmc(lun, &dev_id))
+		return trtl_open_by_fmc(dev_id);
+
 	ret = snprintf(path, sizeof(path), "/dev/trtl.%d", lun);
 	if (ret < 0 || ret >= sizeof(path)) {
 		errno = EINVAL;
@@ -245,6 +278,64 @@ struct trtl_dev *trtl_open_by_lun(unsigned int lun)
 }
 
 
+/**
+ * It returns a file descriptor for a sysfs attribute. Attributes are opened
+ * on first use and closed by trtl_close()
+ */
+static int trtl_sysfs_fd(struct trtl_desc *wdesc, char *path, int flags)
+{
+	struct trtl_sysfs_attr *attr, **head;
+	unsigned int hash = flags;
+	char *c;
+
+	for (c = path; *c; ++c)
+		hash = hash * 31 + *c;
+	head = &wdesc->sysfs[hash % TRTL_SYSFS_HASH];
+
+	pthread_mutex_lock(&wdesc->sysfs_lock);
+	for (attr = *head; attr; attr = attr->next)
+		if (attr->flags == flags && !strcmp(attr->path, path))
+			goto out;
+
+	attr = malloc(sizeof(struct trtl_sysfs_attr));
+	if (!attr)
+		goto out;
+	attr->fd = open(path, flags | O_CLOEXEC);
+	if (attr->fd < 0) {
+		free(attr);
+		attr = NULL;
+		goto out;
+	}
+	attr->flags = flags;
+	strncpy(attr->path, path, TRTL_SYSFS_PATH_LEN);
+	attr->next = *head;
+	*head = attr;
+out:
+	pthread_mutex_unlock(&wdesc->sysfs_lock);
+
+	return attr ? attr->fd : -1;
+}
+
+
+/**
+ * It closes all the sysfs attributes in use
+ */
+static void trtl_sysfs_close(struct trtl_desc *wdesc)
+{
+	struct trtl_sysfs_attr *attr, *next;
+	int i;
+
+	for (i = 0; i < TRTL_SYSFS_HASH; ++i) {
+		for (attr = wdesc->sysfs[i]; attr; attr = next) {
+			next = attr->next;
+			close(attr->fd);
+			free(attr);
+		}
+		wdesc->sysfs[i] = NULL;
+	}
+}
+
+
 /**
  * It closes a WRNC device opened with one of the following functions:
  * trtl_open(), wrcn_open_by_lun(), trtl_open_by_fmc()
@@ -258,6 +349,12 @@ void trtl_close(struct trtl_dev *trtl)
 	if (!trtl)
 		return;
 
+	if (wdesc->smem)
+		munmap((void *)wdesc->smem,
+		       TRTL_SMEM_WINDOW_SIZE * TRTL_SMEM_N_WINDOW);
+	if (wdesc->smp)
+		munmap(wdesc->smp, wdesc->smp_len);
+
 	if (wdesc->fd_dev >= 0)
 		close(wdesc->fd_dev);
 
@@ -265,6 +362,18 @@ void trtl_close(struct trtl_dev *trtl)
 		if (wdesc->fd_cpu[i] >= 0)
 			close(wdesc->fd_cpu[i]);
 
+	for (i = 0; i < TRTL_MAX_HMQ_SLOT / 2; ++i) {
+		trtl_hmq_close(wdesc->hmq_cache[0][i]);
+		trtl_hmq_close(wdesc->hmq_cache[1][i]);
+	}
+	pthread_mutex_destroy(&wdesc->hmq_cache_lock);
+
+	trtl_sysfs_close(wdesc);
+	pthread_mutex_destroy(&wdesc->sysfs_lock);
+	pthread_mutex_destroy(&wdesc->lock);
+	pthread_mutex_destroy(&wdesc->mirror_lock);
+	trtl_stats_exit(wdesc);
+
 	free(wdesc);
 }
 
@@ -272,46 +381,46 @@ void trtl_close(struct trtl_dev *trtl)
 /**
  * Generic function that reads from a sysfs attribute
  */
-static int trtl_sysfs_read(char *path, void *buf, size_t len)
+static int trtl_sysfs_read(struct trtl_desc *wdesc, char *path,
+			   void *buf, size_t len)
 {
-	int fd, i;
+	int fd;
 
-	fd = open(path, O_RDONLY);
+	fd = trtl_sysfs_fd(wdesc, path, O_RDONLY);
 	if (fd < 0)
 		return -1;
-	i = read(fd, buf, len);
-	close(fd);
 
-	return i;
+	/* Reading from the beginning runs the attribute show() again */
+	return pread(fd, buf, len, 0);
 }
 
 
 /**
  * Generic function that writes to a sysfs attribute
  */
-static int trtl_sysfs_write(char *path, void *buf, size_t len)
+static int trtl_sysfs_write(struct trtl_desc *wdesc, char *path,
+			    void *buf, size_t len)
 {
-	int fd, i;
+	int fd;
 
-	fd = open(path, O_WRONLY);
+	fd = trtl_sysfs_fd(wdesc, path, O_WRONLY);
 	if (fd < 0)
 		return -1;
-	i = write(fd, buf, len);
-	close(fd);
 
-	return i;
+	return pwrite(fd, buf, len, 0);
 }
 
 /**
  * Generic function that parse a string from a sysfs attribute
  */
-static int trtl_sysfs_scanf(char *path, const char *fmt, ...)
+static int trtl_sysfs_scanf(struct trtl_desc *wdesc, char *path,
+			    const char *fmt, ...)
 {
 	char buf[TRTL_SYSFS_READ_LEN];
 	va_list args;
 	int ret;
 
-	ret = trtl_sysfs_read(path, buf, TRTL_SYSFS_READ_LEN);
+	ret = trtl_sysfs_read(wdesc, path, buf, TRTL_SYSFS_READ_LEN);
 	if (ret < 0)
 		return ret;
 
@@ -332,7 +441,8 @@ static int trtl_sysfs_scanf(char *path, const char *fmt, ...)
 /**
  * Generic function that build a string to be written in a sysfs attribute
  */
-static int trtl_sysfs_printf(char *path, const char *fmt, ...)
+static int trtl_sysfs_printf(struct trtl_desc *wdesc, char *path,
+			     const char *fmt, ...)
 {
 	char buf[TRTL_SYSFS_READ_LEN];
 	va_list args;
@@ -342,7 +452,7 @@ static int trtl_sysfs_printf(char *path, const char *fmt, ...)
 	vsnprintf(buf, TRTL_SYSFS_READ_LEN, fmt, args);
 	va_end(args);
 
-        ret = trtl_sysfs_write(path, buf, TRTL_SYSFS_READ_LEN);
+	ret = trtl_sysfs_write(wdesc, path, buf, TRTL_SYSFS_READ_LEN);
 	if (ret == TRTL_SYSFS_READ_LEN)
 		return 0;
 	return -1;
@@ -363,7 +473,7 @@ int trtl_cpu_count(struct trtl_dev *trtl, uint32_t *n_cpu)
 	snprintf(path, TRTL_SYSFS_PATH_LEN, "/sys/class/mockturtle/%s/n_cpu",
 		 wdesc->name);
 
-	return trtl_sysfs_scanf(path, "%x", n_cpu);
+	return trtl_sysfs_scanf(wdesc, path, "%x", n_cpu);
 }
 
 
@@ -382,7 +492,7 @@ int trtl_app_id_get(struct trtl_dev *trtl, uint32_t *app_id)
 		 "/sys/class/mockturtle/%s/application_id",
 		 wdesc->name);
 
-	return trtl_sysfs_scanf(path, "%x", app_id);
+	return trtl_sysfs_scanf(wdesc, path, "%x", app_id);
 }
 
 
@@ -401,7 +511,7 @@ int trtl_cpu_reset_get(struct trtl_dev *trtl, uint32_t *mask)
 		 "/sys/class/mockturtle/%s/reset_mask",
 		 wdesc->name);
 
-	return trtl_sysfs_scanf(path, "%x", mask);
+	return trtl_sysfs_scanf(wdesc, path, "%x", mask);
 }
 
 
@@ -420,7 +530,7 @@ int trtl_cpu_reset_set(struct trtl_dev *trtl, uint32_t mask)
 		 "/sys/class/mockturtle/%s/reset_mask",
 		 wdesc->name);
 
-	return trtl_sysfs_printf(path, "%x", mask);
+	return trtl_sysfs_printf(wdesc, path, "%x", mask);
 }
 
 
@@ -439,7 +549,7 @@ int trtl_cpu_run_get(struct trtl_dev *trtl, uint32_t *mask)
 		 "/sys/class/mockturtle/%s/enable_mask",
 		 wdesc->name);
 
-	return trtl_sysfs_scanf(path, "%x", mask);
+	return trtl_sysfs_scanf(wdesc, path, "%x", mask);
 }
 
 
@@ -458,44 +568,107 @@ int trtl_cpu_run_set(struct trtl_dev *trtl, uint32_t mask)
 		 "/sys/class/mockturtle/%s/enable_mask",
 		 wdesc->name);
 
-	return trtl_sysfs_printf(path, "%x", mask);
+	return trtl_sysfs_printf(wdesc, path, "%x", mask);
 }
 
 
 /**
- * It loads a trtl CPU firmware from a given buffer
- * @param[in] trtl device token
+ * It opens the memory of a CPU for writing
+ * @param[in] wdesc device descriptor
  * @param[in] index CPU index
- * @param[in] code buffer containing the CPU firmware binary code
- * @param[in] length code length
- * @return the number of written byte, on error -1 and errno is
- *         set appropriately
+ * @param[in] clean 1 to let the driver clean the memory on each write,
+ *            0 to keep it, -1 for the driver default
+ * @return a file descriptor, on error -1 and errno is set appropriately
  */
-int trtl_cpu_load_application_raw(struct trtl_dev *trtl,
-				  unsigned int index,
-				  void *code, size_t length,
-				  unsigned int offset)
+int trtl_cpu_mem_open(struct trtl_desc *wdesc, unsigned int index, int clean)
 {
-	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
 	char path[TRTL_DEVICE_PATH_LEN];
-	int fd, i = 0;
+	int fd;
 
 	snprintf(path, TRTL_DEVICE_PATH_LEN, "%s/%s-cpu-%02d",
 		 wdesc->path, wdesc->name, index);
 	fd = open(path, O_WRONLY);
 	if (fd < 0)
 		return -1;
-	lseek(fd, offset, SEEK_SET);
+	if (clean >= 0 && ioctl(fd, TRTL_IOCTL_CPU_CLEAN, clean)) {
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/**
+ * It writes a memory chunk into an open CPU memory
+ * @param[in] fd file descriptor from trtl_cpu_mem_open()
+ * @param[in] code buffer containing the memory chunk
+ * @param[in] length code length
+ * @param[in] offset memory offset where to write the code
+ * @return the number of written byte, on error -1 and errno is
+ *         set appropriately
+ */
+int trtl_cpu_mem_write_fd(int fd, void *code, size_t length,
+			  unsigned int offset)
+{
+	size_t i = 0;
+	ssize_t n;
 
 	do {
-		i += write(fd, code, length);
+		n = pwrite(fd, code + i, length - i, offset + i);
+		if (n < 0)
+			return -1;
+		i += n;
 	} while (i < length);
 
-	close(fd);
 	return i;
 }
 
 
+/**
+ * It writes a memory chunk into the CPU memory
+ * @param[in] wdesc device descriptor
+ * @param[in] index CPU index
+ * @param[in] code buffer containing the memory chunk
+ * @param[in] length code length
+ * @param[in] offset memory offset where to write the code
+ * @return the number of written byte, on error -1 and errno is
+ *         set appropriately
+ */
+int trtl_cpu_mem_write(struct trtl_desc *wdesc, unsigned int index,
+		       void *code, size_t length, unsigned int offset)
+{
+	int fd, ret;
+
+	fd = trtl_cpu_mem_open(wdesc, index, -1);
+	if (fd < 0)
+		return -1;
+	ret = trtl_cpu_mem_write_fd(fd, code, length, offset);
+	close(fd);
+
+	return ret;
+}
+
+
+/**
+ * It loads a trtl CPU firmware from a given buffer
+ * @param[in] trtl device token
+ * @param[in] index CPU index
+ * @param[in] code buffer containing the CPU firmware binary code
+ * @param[in] length code length
+ * @return the number of written byte, on error -1 and errno is
+ *         set appropriately
+ */
+int trtl_cpu_load_application_raw(struct trtl_dev *trtl,
+				  unsigned int index,
+				  void *code, size_t length,
+				  unsigned int offset)
+{
+	return trtl_cpu_mem_write((struct trtl_desc *)trtl, index,
+				  code, length, offset);
+}
+
+
 /**
  * It dumps a WRNC CPU firmware into a given buffer
  * @param[in] trtl device token
@@ -533,7 +706,8 @@ int trtl_cpu_dump_application_raw(struct trtl_dev *trtl,
 
 
 /**
- * It loads a WRNC CPU firmware from a given file
+ * It loads a WRNC CPU firmware from a given file. The file can be
+ * a flat binary or an ELF image
  * @param[in] trtl device token
  * @param[in] index CPU index
  * @param[in] path path to the firmware file
@@ -570,12 +744,17 @@ int trtl_cpu_load_application_file(struct trtl_dev *trtl,
 		return -1;
 	}
 
+	if (trtl_elf_is_valid(code, len)) {
+		i = trtl_cpu_load_application_elf(trtl, index, code, len);
+		free(code);
+		return i;
+	}
+
 	i = trtl_cpu_load_application_raw(trtl, index, code, len, 0);
+	free(code);
 	if (i != len)
 		return -1;
 
-	free(code);
-
 	return 0;
 }
 
@@ -647,6 +826,7 @@ struct trtl_hmq *trtl_hmq_open(struct trtl_dev *trtl, unsigned int index,
 	hmq->index = index;
 	hmq->flags = flags;
 	hmq->fd = fd;
+	hmq->pool = NULL;
 	snprintf(hmq->syspath, 64, "/sys/class/mockturtle/%s/%s-hmq-%c-%02d",
 		 wdesc->name, wdesc->name, (dir ? 'i' : 'o'), index);
 
@@ -654,6 +834,40 @@ struct trtl_hmq *trtl_hmq_open(struct trtl_dev *trtl, unsigned int index,
 }
 
 
+/**
+ * It returns a HMQ handle that belongs to the device. The handle is opened
+ * on first use and closed by trtl_close(), so the caller must not close it.
+ * Handles are shared by all the threads: use them only for operations
+ * that the driver serializes (send, synchronous messages)
+ * @param[in] trtl device token
+ * @param[in] index HMQ index
+ * @param[in] flags HMQ flags, only the direction is used
+ * @return a HMQ token on success, NULL on error and errno is set appropriately
+ */
+struct trtl_hmq *trtl_hmq_get(struct trtl_dev *trtl, unsigned int index,
+			      unsigned long flags)
+{
+	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+	unsigned int dir = !!(flags & TRTL_HMQ_INCOMING);
+	struct trtl_hmq *hmq;
+
+	if (index >= TRTL_MAX_HMQ_SLOT / 2) {
+		errno = ETRTL_INVAL_SLOT;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&wdesc->hmq_cache_lock);
+	hmq = wdesc->hmq_cache[dir][index];
+	if (!hmq) {
+		hmq = trtl_hmq_open(trtl, index, flags & TRTL_HMQ_INCOMING);
+		wdesc->hmq_cache[dir][index] = hmq;
+	}
+	pthread_mutex_unlock(&wdesc->hmq_cache_lock);
+
+	return hmq;
+}
+
+
 /**
  * It closes a HMQ slot
  * @param[in] hmq HMQ device descriptor
@@ -663,6 +877,7 @@ void trtl_hmq_close(struct trtl_hmq *hmq)
 {
 	if (hmq && hmq->fd > 0) {
 		close(hmq->fd);
+		free(hmq->pool);
 		free(hmq);
 	}
 }
@@ -687,7 +902,7 @@ int trtl_hmq_share_set(struct trtl_dev *trtl, unsigned int dir,
 		 "/sys/class/mockturtle/%s/%s-hmq-%c-%02d/shared_by_users",
 		 wdesc->name, wdesc->name, (dir ? 'i' : 'o'), index);
 
-	return trtl_sysfs_printf(path, "%d", status);
+	return trtl_sysfs_printf(wdesc, path, "%d", status);
 }
 
 
@@ -709,26 +924,16 @@ int trtl_hmq_share_get(struct trtl_dev *trtl, unsigned int dir,
 		 "/sys/class/mockturtle/%s/%s-hmq-%c-%02d/shared_by_users",
 		 wdesc->name, wdesc->name, (dir ? 'i' : 'o'), index);
 
-	return trtl_sysfs_scanf(path, "%d", status);
+	return trtl_sysfs_scanf(wdesc, path, "%d", status);
 }
 
 /**
- * It sends a synchronous message. The slots are uni-directional, so you must
- * specify where write the message and where the answer is expected.
- * @param[in] hmq HMQ device descriptor on the input slot
- * @param[in] index_out index of the HMQ output slot
- * @param[in,out] msg it contains the message to be sent; the answer will
- *                overwrite the message
- * @param[in] timeout_ms maximum ms to wait for an answer. If you ask for
- *            0ms timeout, the driver will use the default driver timeout.
- * @return On success, a positive number is returned; this number represent
- *         the remaining ms to the timeout. -1 on error and errno is set
- *         appropriately
+ * trtl_hmq_send_and_receive_sync() without statistics
  */
-int trtl_hmq_send_and_receive_sync(struct trtl_hmq *hmq,
-				   unsigned int index_out,
-				   struct trtl_msg *msg,
-				   unsigned int timeout_ms)
+static int __trtl_hmq_send_and_receive_sync(struct trtl_hmq *hmq,
+					    unsigned int index_out,
+					    struct trtl_msg *msg,
+					    unsigned int timeout_ms)
 {
 	struct trtl_msg_sync smsg;
 	int err;
@@ -757,6 +962,43 @@ int trtl_hmq_send_and_receive_sync(struct trtl_hmq *hmq,
 }
 
 
+/**
+ * It sends a synchronous message. The slots are uni-directional, so you must
+ * specify where write the message and where the answer is expected.
+ * @param[in] hmq HMQ device descriptor on the input slot
+ * @param[in] index_out index of the HMQ output slot
+ * @param[in,out] msg it contains the message to be sent; the answer will
+ *                overwrite the message
+ * @param[in] timeout_ms maximum ms to wait for an answer. If you ask for
+ *            0ms timeout, the driver will use the default driver timeout.
+ * @return On success, a positive number is returned; this number represent
+ *         the remaining ms to the timeout. -1 on error and errno is set
+ *         appropriately
+ */
+int trtl_hmq_send_and_receive_sync(struct trtl_hmq *hmq,
+				   unsigned int index_out,
+				   struct trtl_msg *msg,
+				   unsigned int timeout_ms)
+{
+	uint64_t start;
+	size_t bytes;
+	int ret;
+
+	if (!hmq) {
+		errno = ETRTL_HMQ_CLOSE;
+		return -1;
+	}
+
+	start = trtl_stats_start(hmq->trtl);
+	bytes = msg->datalen * 4;
+	ret = __trtl_hmq_send_and_receive_sync(hmq, index_out, msg, timeout_ms);
+	trtl_stats_end(hmq->trtl, TRTL_STATS_HMQ_SYNC, start, ret < 0,
+		       bytes + msg->datalen * 4);
+
+	return ret;
+}
+
+
 /**
  * It sets the driver buffer size.
  * Note that this does not affect the hardware in any way. The hardware
@@ -767,11 +1009,12 @@ int trtl_hmq_send_and_receive_sync(struct trtl_hmq *hmq,
  */
 int trtl_hmq_buffer_size_set(struct trtl_hmq *hmq, uint32_t size)
 {
+	struct trtl_desc *wdesc = (struct trtl_desc *)hmq->trtl;
 	char path[TRTL_SYSFS_PATH_LEN];
 
 	snprintf(path, TRTL_SYSFS_PATH_LEN, "%s/buffer_size", hmq->syspath);
 
-	return trtl_sysfs_printf(path, "%d", size);
+	return trtl_sysfs_printf(wdesc, path, "%d", size);
 }
 
 
@@ -783,11 +1026,12 @@ int trtl_hmq_buffer_size_set(struct trtl_hmq *hmq, uint32_t size)
  */
 int trtl_hmq_buffer_size_get(struct trtl_hmq *hmq, uint32_t *size)
 {
+	struct trtl_desc *wdesc = (struct trtl_desc *)hmq->trtl;
 	char path[TRTL_SYSFS_PATH_LEN];
 
 	snprintf(path, TRTL_SYSFS_PATH_LEN, "%s/buffer_size", hmq->syspath);
 
-	return trtl_sysfs_scanf(path, "%d", size);
+	return trtl_sysfs_scanf(wdesc, path, "%d", size);
 }
 
 
@@ -799,12 +1043,13 @@ int trtl_hmq_buffer_size_get(struct trtl_hmq *hmq, uint32_t *size)
  */
 int trtl_hmq_width_get(struct trtl_hmq *hmq, uint32_t *width)
 {
+	struct trtl_desc *wdesc = (struct trtl_desc *)hmq->trtl;
 	char path[TRTL_SYSFS_PATH_LEN];
 	int err;
 
 	snprintf(path, TRTL_SYSFS_PATH_LEN, "%s/width_max", hmq->syspath);
 
-	err = trtl_sysfs_scanf(path, "%d", width);
+	err = trtl_sysfs_scanf(wdesc, path, "%d", width);
 	*width = 4 * (*width); /* Convert to byte */
 
 	return err;
@@ -844,11 +1089,99 @@ int trtl_hmq_msg_max_get(struct trtl_hmq *hmq, uint32_t *max)
  */
 int trtl_hmq_count_max_hw_get(struct trtl_hmq *hmq, uint32_t *max)
 {
+	struct trtl_desc *wdesc = (struct trtl_desc *)hmq->trtl;
 	char path[TRTL_SYSFS_PATH_LEN];
 
 	snprintf(path, TRTL_SYSFS_PATH_LEN, "%s/count_max_hw", hmq->syspath);
 
-	return trtl_sysfs_scanf(path, "%d", max);
+	return trtl_sysfs_scanf(wdesc, path, "%d", max);
+}
+
+
+/**
+ * It reads all the attributes of a HMQ slot
+ * @return 0 on success, -1 on error and errno is set appropriately.
+ *         errno is ENOENT when the slot does not exist
+ */
+static int trtl_hmq_state_get(struct trtl_desc *wdesc, unsigned int dir,
+			      unsigned int index, struct trtl_hmq_state *st)
+{
+	char path[TRTL_SYSFS_PATH_LEN];
+	int n, err;
+
+	n = snprintf(path, TRTL_SYSFS_PATH_LEN,
+		     "/sys/class/mockturtle/%s/%s-hmq-%c-%02d/",
+		     wdesc->name, wdesc->name, (dir ? 'i' : 'o'), index);
+
+	strncpy(path + n, "buffer_size", TRTL_SYSFS_PATH_LEN - n);
+	err = trtl_sysfs_scanf(wdesc, path, "%d", &st->buffer_size);
+	if (err)
+		return err;
+	strncpy(path + n, "width_max", TRTL_SYSFS_PATH_LEN - n);
+	err = trtl_sysfs_scanf(wdesc, path, "%d", &st->width);
+	if (err)
+		return err;
+	st->width *= 4; /* Convert to byte */
+	strncpy(path + n, "count_max_hw", TRTL_SYSFS_PATH_LEN - n);
+	err = trtl_sysfs_scanf(wdesc, path, "%d", &st->count_max_hw);
+	if (err)
+		return err;
+	strncpy(path + n, "count_hw", TRTL_SYSFS_PATH_LEN - n);
+	err = trtl_sysfs_scanf(wdesc, path, "%d", &st->count_hw);
+	if (err)
+		return err;
+	strncpy(path + n, "shared_by_users", TRTL_SYSFS_PATH_LEN - n);
+
+	return trtl_sysfs_scanf(wdesc, path, "%d", &st->shared);
+}
+
+
+/**
+ * It gets the status of the device, of its CPUs and of its HMQ slots at
+ * once. The sysfs attributes remain open, so periodic calls are cheap
+ * @param[in] trtl device token
+ * @param[out] state device status
+ * @return 0 on success, -1 on error and errno is set appropriately
+ */
+int trtl_dev_state_get(struct trtl_dev *trtl, struct trtl_dev_state *state)
+{
+	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+	int err;
+
+	memset(state, 0, sizeof(struct trtl_dev_state));
+
+	err = trtl_app_id_get(trtl, &state->app_id);
+	if (err)
+		return err;
+	err = trtl_cpu_count(trtl, &state->n_cpu);
+	if (err)
+		return err;
+	err = trtl_cpu_run_get(trtl, &state->enable_mask);
+	if (err)
+		return err;
+	err = trtl_cpu_reset_get(trtl, &state->reset_mask);
+	if (err)
+		return err;
+
+	/* Slots are numbered contiguously, stop at the first missing one */
+	for (; state->n_hmq_in < TRTL_MAX_HMQ_SLOT / 2; state->n_hmq_in++) {
+		err = trtl_hmq_state_get(wdesc, 1, state->n_hmq_in,
+					 &state->hmq_in[state->n_hmq_in]);
+		if (err && errno == ENOENT)
+			break;
+		if (err)
+			return err;
+	}
+	for (; state->n_hmq_out < TRTL_MAX_HMQ_SLOT / 2; state->n_hmq_out++) {
+		err = trtl_hmq_state_get(wdesc, 0, state->n_hmq_out,
+					 &state->hmq_out[state->n_hmq_out]);
+		if (err && errno == ENOENT)
+			break;
+		if (err)
+			return err;
+	}
+
+	return 0;
 }
 
 
@@ -860,52 +1193,374 @@ int trtl_hmq_count_max_hw_get(struct trtl_hmq *hmq, uint32_t *max)
 static int trtl_dev_open(struct trtl_desc *wdesc)
 {
 	char path[64];
+	int fd, err = 0;
 
+	/* Once open, it remains open until trtl_close() */
+	if (__atomic_load_n(&wdesc->fd_dev, __ATOMIC_ACQUIRE) >= 0)
+		return 0;
 
+	pthread_mutex_lock(&wdesc->lock);
 	if (wdesc->fd_dev < 0) {
 		snprintf(path, 64, "%s/%s", wdesc->path, wdesc->name);
-	        wdesc->fd_dev = open(path, O_RDWR);
-		if (wdesc->fd_dev < 0)
-			return -1;
+		fd = open(path, O_RDWR | O_CLOEXEC);
+		if (fd < 0)
+			err = -1;
+		else
+			__atomic_store_n(&wdesc->fd_dev, fd, __ATOMIC_RELEASE);
 	}
+	pthread_mutex_unlock(&wdesc->lock);
 
-	return 0;
+	return err;
 }
 
 /**
- * It execute the ioctl command to read/write an smem address
+ * It maps the shared memory windows. When the driver cannot map them,
+ * the library falls back to the ioctl interface
  * @param[in] wdesc device descriptor
- * @param[in] addr memory address where start the operations
- * @param[in, out] data value in/to the shared memory
  * @return 0 on success, -1 otherwise and errno is set appropriately
  */
-static int trtl_smem_io(struct trtl_desc *wdesc,
-			uint32_t addr, uint32_t *data, size_t count,
-			enum trtl_smem_modifier mod, int is_input)
+static int trtl_smem_map(struct trtl_desc *wdesc)
 {
-	struct trtl_smem_io io;
-	int err, i;
+	void *map;
+	int err = 0;
 
-	err = trtl_dev_open(wdesc);
+	/* Once mapped, it remains mapped until trtl_close() */
+	if (__atomic_load_n(&wdesc->smem, __ATOMIC_ACQUIRE))
+		return 0;
+	if (__atomic_load_n(&wdesc->smem_map_err, __ATOMIC_RELAXED) ||
+	    trtl_dev_open(wdesc))
+		return -1;
+
+	pthread_mutex_lock(&wdesc->lock);
+	if (!wdesc->smem && !wdesc->smem_map_err) {
+		map = mmap(NULL, TRTL_SMEM_WINDOW_SIZE * TRTL_SMEM_N_WINDOW,
+			   PROT_READ | PROT_WRITE, MAP_SHARED, wdesc->fd_dev, 0);
+		if (map == MAP_FAILED)
+			__atomic_store_n(&wdesc->smem_map_err, 1,
+					 __ATOMIC_RELAXED);
+		else
+			__atomic_store_n(&wdesc->smem, map, __ATOMIC_RELEASE);
+	}
+	if (!wdesc->smem)
+		err = -1;
+	pthread_mutex_unlock(&wdesc->lock);
+
+	return err;
+}
+
+/**
+ * trtl_smem_io_batch() without statistics
+ */
+static int __trtl_smem_io_batch(struct trtl_dev *trtl, struct trtl_smem_io *io,
+				unsigned int n)
+{
+	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+	struct trtl_smem_io_batch batch;
+	int err, i;
+
+	if (!trtl_smem_map(wdesc)) {
+		for (i = 0; i < n; i++) {
+			if (io[i].addr % 4 ||
+			    io[i].addr >= TRTL_SMEM_WINDOW_SIZE ||
+			    io[i].mod >= TRTL_SMEM_N_WINDOW) {
+				errno = EINVAL;
+				return -1;
+			}
+			if (!io[i].is_input)
+				wdesc->smem[(io[i].mod * TRTL_SMEM_WINDOW_SIZE +
+					     io[i].addr) / 4] = io[i].value;
+			io[i].value = wdesc->smem[io[i].addr / 4];
+		}
+
+		return 0;
+	}
+
+	err = trtl_dev_open(wdesc);
 	if (err)
 		return -1;
 
-	io.is_input = is_input;
-	io.mod = mod;
-	for (i = 0; i < count; i++) {
-		io.addr = addr + (i * 4);
-		if (!io.is_input)
-			io.value = data[i];
-		err = ioctl(wdesc->fd_dev, TRTL_IOCTL_SMEM_IO, &io);
+	for (i = 0; i < n; i += batch.n_io) {
+		batch.n_io = n - i;
+		if (batch.n_io > TRTL_SMEM_IO_BATCH_MAX)
+			batch.n_io = TRTL_SMEM_IO_BATCH_MAX;
+		batch.unused = 0;
+		batch.io = (uintptr_t)&io[i];
+		err = ioctl(wdesc->fd_dev, TRTL_IOCTL_SMEM_IO_BATCH, &batch);
 		if (err)
 			return -1;
-		data[i] = io.value;
 	}
 
+	return 0;
+}
+
+/**
+ * It execute the ioctl command to read/write an smem address
+ * @param[in] wdesc device descriptor
+ * @param[in] addr memory address where start the operations
+ * @param[in, out] data value in/to the shared memory
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+static int trtl_smem_io(struct trtl_desc *wdesc,
+			uint32_t addr, uint32_t *data, size_t count,
+			enum trtl_smem_modifier mod, int is_input)
+{
+	volatile uint32_t *win;
+	struct trtl_smem_io *io;
+	int err, i;
+
+	if (!trtl_smem_map(wdesc)) {
+		if (addr % 4 || addr + count * 4 > TRTL_SMEM_WINDOW_SIZE ||
+		    mod >= TRTL_SMEM_N_WINDOW) {
+			errno = EINVAL;
+			return -1;
+		}
+
+		win = wdesc->smem + (mod * TRTL_SMEM_WINDOW_SIZE + addr) / 4;
+		for (i = 0; i < count; i++) {
+			if (!is_input)
+				win[i] = data[i];
+			data[i] = wdesc->smem[addr / 4 + i];
+		}
+
+		return 0;
+	}
+
+	io = trtl_thread_buf(TRTL_THREAD_BUF_IO,
+			     count * sizeof(struct trtl_smem_io));
+	if (!io)
+		return -1;
+
+	for (i = 0; i < count; i++) {
+		io[i].addr = addr + (i * 4);
+		io[i].is_input = is_input;
+		io[i].mod = mod;
+		io[i].value = is_input ? 0 : data[i];
+	}
+	err = __trtl_smem_io_batch((struct trtl_dev *)wdesc, io, count);
+	for (i = 0; !err && i < count; i++)
+		data[i] = io[i].value;
+
+	return err;
+}
+
+
+
+/**
+ * It executes a sequence of read/write operations on the shared memory.
+ * Each operation can use a different modifier. After the call, the value
+ * of each operation is the value in the shared memory after the operation
+ * @param[in] trtl device token
+ * @param[in, out] io operations to execute in order
+ * @param[in] n number of operations
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+int trtl_smem_io_batch(struct trtl_dev *trtl, struct trtl_smem_io *io,
+		       unsigned int n)
+{
+	uint64_t start = trtl_stats_start(trtl);
+	int err;
+
+	err = __trtl_smem_io_batch(trtl, io, n);
+	trtl_stats_end(trtl, TRTL_STATS_SMEM, start, err, n * 4);
+
+	return err;
+}
+
+/**
+ * trtl_smem_read_consistent() without statistics
+ */
+static int __trtl_smem_read_consistent(struct trtl_dev *trtl,
+				       uint32_t seq_addr, uint32_t addr,
+				       uint32_t *data, size_t count)
+{
+	struct trtl_smem_io *io;
+	int err, i, retry;
+
+	/* Sequence, values and sequence again: one batch per attempt */
+	io = trtl_thread_buf(TRTL_THREAD_BUF_IO,
+			     (count + 2) * sizeof(struct trtl_smem_io));
+	if (!io)
+		return -1;
+	for (i = 0; i < count + 2; i++) {
+		io[i].is_input = 1;
+		io[i].mod = TRTL_SMEM_DIRECT;
+		io[i].addr = addr + (i - 1) * 4;
+	}
+	io[0].addr = seq_addr;
+	io[count + 1].addr = seq_addr;
+
+	for (retry = 0; retry < TRTL_SMEM_SEQ_RETRY; retry++) {
+		err = __trtl_smem_io_batch(trtl, io, count + 2);
+		if (err)
+			break;
+		if (io[0].value & 1 || io[0].value != io[count + 1].value)
+			continue;
+		for (i = 0; i < count; i++)
+			data[i] = io[i + 1].value;
+		break;
+	}
+	if (!err && retry == TRTL_SMEM_SEQ_RETRY) {
+		errno = EAGAIN;
+		err = -1;
+	}
+
+	return err;
+}
+
+
+/**
+ * It reads a set of cells published by the RT application with
+ * smem_seq_publish(). The read is repeated until the sequence word is
+ * even and it does not change across the read, so the values are
+ * a coherent snapshot
+ * @param[in] trtl device token
+ * @param[in] seq_addr address of the sequence word
+ * @param[in] addr memory address where start the read
+ * @param[out] data values read from the shared memory
+ * @param[in] count number of values in data
+ * @return 0 on success, -1 otherwise and errno is set appropriately.
+ *         errno is EAGAIN when the values are always under update
+ */
+int trtl_smem_read_consistent(struct trtl_dev *trtl, uint32_t seq_addr,
+			      uint32_t addr, uint32_t *data, size_t count)
+{
+	uint64_t start = trtl_stats_start(trtl);
+	int err;
+
+	err = __trtl_smem_read_consistent(trtl, seq_addr, addr, data, count);
+	trtl_stats_end(trtl, TRTL_STATS_SMEM, start, err, count * 4);
+
+	return err;
+}
+
+
+/**
+ * It starts the shared memory sampler. The driver periodically samples
+ * the given ranges into a ring that the library maps. A running sampler
+ * is replaced and its samples are lost
+ * @param[in] trtl device token
+ * @param[in] cfg sampler configuration
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+int trtl_sampler_start(struct trtl_dev *trtl, struct trtl_sampler_cfg *cfg)
+{
+	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+	unsigned int i, n_word = 0;
+	size_t sample_size;
+	void *map;
+	int err;
+
+	err = trtl_dev_open(wdesc);
+	if (err)
+		return -1;
+	err = ioctl(wdesc->fd_dev, TRTL_IOCTL_SAMPLER_START, cfg);
+	if (err)
+		return -1;
+
+	if (wdesc->smp)
+		munmap(wdesc->smp, wdesc->smp_len);
+	wdesc->smp = NULL;
+
+	for (i = 0; i < cfg->n_range; i++)
+		n_word += cfg->range[i].count;
+	sample_size = (sizeof(struct trtl_sample) + n_word * 4 + 7) & ~7;
+	wdesc->smp_len = sizeof(struct trtl_sampler_ring) +
+		cfg->n_sample * sample_size;
+	map = mmap(NULL, wdesc->smp_len, PROT_READ, MAP_SHARED,
+		   wdesc->fd_dev, TRTL_SAMPLER_MMAP_OFFSET);
+	if (map == MAP_FAILED) {
+		ioctl(wdesc->fd_dev, TRTL_IOCTL_SAMPLER_STOP);
+		return -1;
+	}
+	wdesc->smp = map;
+	wdesc->smp_tail = 0;
 
 	return 0;
 }
 
+
+/**
+ * It stops the shared memory sampler
+ * @param[in] trtl device token
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+int trtl_sampler_stop(struct trtl_dev *trtl)
+{
+	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+	int err;
+
+	if (wdesc->smp)
+		munmap(wdesc->smp, wdesc->smp_len);
+	wdesc->smp = NULL;
+
+	err = trtl_dev_open(wdesc);
+	if (err)
+		return -1;
+
+	return ioctl(wdesc->fd_dev, TRTL_IOCTL_SAMPLER_STOP);
+}
+
+
+/**
+ * It returns the size of a sample, struct trtl_sample included
+ * @param[in] trtl device token
+ * @return the sample size, 0 when the sampler is not running
+ */
+size_t trtl_sampler_sample_size(struct trtl_dev *trtl)
+{
+	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+
+	return wdesc->smp ? wdesc->smp->sample_size : 0;
+}
+
+
+/**
+ * It reads the oldest samples not yet read. When the host is too slow,
+ * the samples overwritten by the driver are lost
+ * @param[in] trtl device token
+ * @param[out] buf where to store the samples, trtl_sampler_sample_size()
+ *             bytes each
+ * @param[in] n maximum number of samples to read
+ * @return the number of samples read, -1 on error and errno is set
+ *         appropriately
+ */
+int trtl_sampler_read(struct trtl_dev *trtl, void *buf, unsigned int n)
+{
+	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+	volatile struct trtl_sampler_ring *ring = wdesc->smp;
+	struct trtl_sample *slot, *sample;
+	uint32_t head, seq;
+	int count = 0;
+
+	if (!ring) {
+		errno = ENODEV;
+		return -1;
+	}
+
+	head = ring->head;
+	__sync_synchronize();
+	if (head - wdesc->smp_tail > ring->n_sample)
+		wdesc->smp_tail = head - ring->n_sample;
+
+	for (; wdesc->smp_tail != head && count < n; wdesc->smp_tail++) {
+		slot = (void *)wdesc->smp + sizeof(struct trtl_sampler_ring) +
+			(wdesc->smp_tail & (ring->n_sample - 1)) *
+			ring->sample_size;
+		sample = buf + count * ring->sample_size;
+
+		memcpy(sample, slot, ring->sample_size);
+		__sync_synchronize();
+		seq = *(volatile uint32_t *)&slot->seq;
+		/* Drop the samples overwritten while copying them */
+		if (sample->seq != wdesc->smp_tail || seq != wdesc->smp_tail)
+			continue;
+		count++;
+	}
+
+	return count;
+}
+
+
 /**
  * It does a direct acces to the shared memory to read a set of cells
  * @param[in] trtl device token
@@ -920,8 +1575,13 @@ int trtl_smem_read(struct trtl_dev *trtl, uint32_t addr, uint32_t *data,
 		   size_t count, enum trtl_smem_modifier mod)
 {
 	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+	uint64_t start = trtl_stats_start(trtl);
+	int err;
 
-	return trtl_smem_io(wdesc, addr, data, count, mod, 1);
+	err = trtl_smem_io(wdesc, addr, data, count, mod, 1);
+	trtl_stats_end(trtl, TRTL_STATS_SMEM, start, err, count * 4);
+
+	return err;
 }
 
 
@@ -939,8 +1599,85 @@ int trtl_smem_write(struct trtl_dev *trtl, uint32_t addr, uint32_t *data,
 		    size_t count, enum trtl_smem_modifier mod)
 {
 	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+	uint64_t start = trtl_stats_start(trtl);
+	int err;
+
+	err = trtl_smem_io(wdesc, addr, data, count, mod, 0);
+	trtl_stats_end(trtl, TRTL_STATS_SMEM, start, err, count * 4);
+
+	return err;
+}
+
+
+/**
+ * It loads a set of applications, one per CPU, and then it starts all
+ * the CPUs at once. Applications can be flat binaries or ELF images;
+ * an image with size 0 only restarts the CPU. The shared memory segments
+ * of the ELF images are written while all the CPUs are held, so the set
+ * should include all the CPUs that use the shared memory
+ * @param[in] trtl device token
+ * @param[in] image list of applications to load
+ * @param[in] n number of applications
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+int trtl_cpu_load_application_gang(struct trtl_dev *trtl,
+				   struct trtl_cpu_image *image,
+				   unsigned int n)
+{
+	struct trtl_desc *wdesc = (struct trtl_desc *)trtl;
+	struct trtl_gang_image img[TRTL_MAX_CPU];
+	struct trtl_gang_load gang;
+	int elf[TRTL_MAX_CPU];
+	int err = 0, i, has_elf = 0;
+
+	if (n > TRTL_MAX_CPU) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	err = trtl_dev_open(wdesc);
+	if (err)
+		return -1;
 
-	return trtl_smem_io(wdesc, addr, data, count, mod, 0);
+	/* The driver loads flat binaries, ELF images are loaded by segment */
+	for (i = 0; i < n; i++) {
+		img[i].index = image[i].index;
+		img[i].size = image[i].size;
+		img[i].code = (uintptr_t)image[i].code;
+		elf[i] = trtl_elf_is_valid(image[i].code, image[i].size);
+		if (!elf[i])
+			continue;
+		if (trtl_elf_cpu_check(image[i].code))
+			return -1;
+		has_elf = 1;
+		img[i].size = 0;
+	}
+
+	gang.n_image = n;
+	gang.image = (uintptr_t)img;
+	gang.flags = has_elf ? 0 : TRTL_GANG_START;
+	err = ioctl(wdesc->fd_dev, TRTL_IOCTL_GANG_LOAD, &gang);
+	if (err || !has_elf)
+		return err ? -1 : 0;
+
+	/* The CPUs are held: write the ELF segments, shared memory included */
+	for (i = 0; i < n; i++) {
+		if (!elf[i])
+			continue;
+		err = trtl_elf_cpu_load(wdesc, image[i].index, image[i].code);
+		if (err)
+			return -1;
+		err = trtl_elf_smem_load_all(trtl, image[i].code);
+		if (err)
+			return -1;
+	}
+
+	for (i = 0; i < n; i++)
+		img[i].size = 0;
+	gang.flags = TRTL_GANG_START;
+	err = ioctl(wdesc->fd_dev, TRTL_IOCTL_GANG_LOAD, &gang);
+
+	return err ? -1 : 0;
 }
 
 
@@ -1070,14 +1807,10 @@ int trtl_cpu_is_enable(struct trtl_dev *trtl, unsigned int index,
 
 
 /**
- * It gets from the driver a list of messages
- * @param[in] hmq HMQ device descriptor
- * @param[in] msg buffer where store incoming messages
- * @param[in] n maximum number of messages to read
- * @return number of message read, -1 on error and errno is set appropriately
+ * trtl_hmq_receive_n() without statistics
  */
-int trtl_hmq_receive_n(struct trtl_hmq *hmq,
-		       struct trtl_msg *msg, unsigned int n)
+static int __trtl_hmq_receive_n(struct trtl_hmq *hmq,
+				struct trtl_msg *msg, unsigned int n)
 {
 	int ret, size;
 
@@ -1098,6 +1831,33 @@ int trtl_hmq_receive_n(struct trtl_hmq *hmq,
 }
 
 
+/**
+ * It gets from the driver a list of messages
+ * @param[in] hmq HMQ device descriptor
+ * @param[in] msg buffer where store incoming messages
+ * @param[in] n maximum number of messages to read
+ * @return number of message read, -1 on error and errno is set appropriately
+ */
+int trtl_hmq_receive_n(struct trtl_hmq *hmq,
+		       struct trtl_msg *msg, unsigned int n)
+{
+	uint64_t start;
+	int ret;
+
+	if (!hmq) {
+		errno = ETRTL_HMQ_CLOSE;
+		return -1;
+	}
+
+	start = trtl_stats_start(hmq->trtl);
+	ret = __trtl_hmq_receive_n(hmq, msg, n);
+	trtl_stats_end(hmq->trtl, TRTL_STATS_HMQ_RECV, start, ret < 0,
+		       ret * sizeof(struct trtl_msg));
+
+	return ret;
+}
+
+
 /**
  * It allocates and returns a message from an output message queue slot.
  * The user of this function is in charge to release the memory.
@@ -1124,12 +1884,114 @@ struct trtl_msg *trtl_hmq_receive(struct trtl_hmq *hmq)
 
 
 /**
- * It sends a message to an input message queue slot.
+ * It gets messages from an output message queue slot into its message
+ * pool. Messages remain valid until released, in any order, with
+ * trtl_hmq_msg_release().
+ * The pool is allocated on first use; no allocation happens afterwards
  * @param[in] hmq HMQ device descriptor
- * @param[in] msg message to send
- * @return 0 on success, -1 otherwise and errno is set appropriately
+ * @param[out] msg pointers to the received messages
+ * @param[in] n maximum number of messages to receive
+ * @return number of message received, -1 on error and errno is set
+ *         appropriately. errno is ENOBUFS when all the pool messages
+ *         are in use
  */
-int trtl_hmq_send(struct trtl_hmq *hmq, struct trtl_msg *msg)
+int trtl_hmq_receive_pool_n(struct trtl_hmq *hmq,
+			    struct trtl_msg **msg, unsigned int n)
+{
+	struct trtl_hmq_pool *pool;
+	unsigned int i;
+	int ret;
+
+	if (!hmq || hmq->fd < 0) {
+		errno = ETRTL_HMQ_CLOSE;
+		return -1;
+	}
+
+	if (!hmq->pool) {
+		if (posix_memalign((void **)&hmq->pool, TRTL_CACHE_LINE,
+				   sizeof(struct trtl_hmq_pool)))
+			return -1;
+		memset(hmq->pool, 0, sizeof(struct trtl_hmq_pool));
+		for (i = 0; i < TRTL_HMQ_POOL_SIZE; i++)
+			hmq->pool->free[i] = TRTL_HMQ_POOL_SIZE - 1 - i;
+		hmq->pool->n_free = TRTL_HMQ_POOL_SIZE;
+	}
+	pool = hmq->pool;
+
+	if (!pool->n_free) {
+		errno = ENOBUFS;
+		return -1;
+	}
+	if (n > pool->n_free)
+		n = pool->n_free;
+
+	/* One read fills the free messages from the top of the stack */
+	for (i = 0; i < n; i++)
+		msg[i] = &pool->msg[pool->free[pool->n_free - 1 - i]].msg;
+	ret = trtl_hmq_receive_iov(hmq, msg, n);
+	if (ret <= 0)
+		return ret;
+
+	for (i = 0; i < ret; i++)
+		pool->busy[(struct trtl_hmq_pool_msg *)msg[i] - pool->msg] = 1;
+	pool->n_free -= ret;
+
+	return ret;
+}
+
+
+/**
+ * It gets a message from an output message queue slot into its message
+ * pool. The message must be released with trtl_hmq_msg_release()
+ * @param[in] hmq HMQ device descriptor
+ * @return a WRNC message, NULL on error and errno is set appropriately.
+ *         errno is EAGAIN when there are no messages
+ */
+struct trtl_msg *trtl_hmq_receive_pool(struct trtl_hmq *hmq)
+{
+	struct trtl_msg *msg;
+	int ret;
+
+	ret = trtl_hmq_receive_pool_n(hmq, &msg, 1);
+	if (ret < 0)
+		return NULL;
+	if (ret == 0) {
+		errno = EAGAIN;
+		return NULL;
+	}
+
+	return msg;
+}
+
+
+/**
+ * It releases a message received with trtl_hmq_receive_pool() or
+ * trtl_hmq_receive_pool_n()
+ * @param[in] hmq HMQ device descriptor
+ * @param[in] msg message to release
+ */
+void trtl_hmq_msg_release(struct trtl_hmq *hmq, struct trtl_msg *msg)
+{
+	struct trtl_hmq_pool *pool = hmq->pool;
+	unsigned int index;
+
+	if (!pool || (void *)msg < (void *)pool->msg ||
+	    (void *)msg >= (void *)(pool->msg + TRTL_HMQ_POOL_SIZE))
+		return;
+	index = (struct trtl_hmq_pool_msg *)msg - pool->msg;
+	if (msg != &pool->msg[index].msg)
+		return;
+	if (!pool->busy[index])
+		return;
+	pool->busy[index] = 0;
+	pool->free[pool->n_free++] = index;
+}
+
+
+/**
+ * trtl_hmq_send() without statistics
+ */
+static int __trtl_hmq_send(struct trtl_hmq *hmq, struct trtl_msg *msg)
 {
 	int n;
 
@@ -1152,6 +2014,178 @@ int trtl_hmq_send(struct trtl_hmq *hmq, struct trtl_msg *msg)
 }
 
 
+/**
+ * It sends a message to an input message queue slot.
+ * @param[in] hmq HMQ device descriptor
+ * @param[in] msg message to send
+ * @return 0 on success, -1 otherwise and errno is set appropriately
+ */
+int trtl_hmq_send(struct trtl_hmq *hmq, struct trtl_msg *msg)
+{
+	uint64_t start;
+	int err;
+
+	if (!hmq) {
+		errno = ETRTL_HMQ_CLOSE;
+		return -1;
+	}
+
+	start = trtl_stats_start(hmq->trtl);
+	err = __trtl_hmq_send(hmq, msg);
+	trtl_stats_end(hmq->trtl, TRTL_STATS_HMQ_SEND, start, err,
+		       msg->datalen * 4);
+
+	return err;
+}
+
+
+/**
+ * trtl_hmq_send_n() without statistics
+ */
+static int __trtl_hmq_send_n(struct trtl_hmq *hmq, struct trtl_msg **msg,
+			     unsigned int n)
+{
+	struct iovec iov[TRTL_HMQ_IOV_MAX];
+	unsigned int i, count, done = 0;
+	ssize_t ret;
+
+	if (!hmq || hmq->fd < 0) {
+		errno = ETRTL_HMQ_CLOSE;
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (msg[i]->datalen >= TRTL_MAX_PAYLOAD_SIZE) {
+			errno = EINVAL;
+			return -1;
+		}
+	}
+
+	/* One system call for each TRTL_HMQ_IOV_MAX messages */
+	while (done < n) {
+		count = n - done;
+		if (count > TRTL_HMQ_IOV_MAX)
+			count = TRTL_HMQ_IOV_MAX;
+		for (i = 0; i < count; i++) {
+			iov[i].iov_base = msg[done + i];
+			iov[i].iov_len = sizeof(struct trtl_msg);
+		}
+
+		ret = writev(hmq->fd, iov, count);
+		if (ret < 0)
+			return done ? done : -1;
+		done += ret / sizeof(struct trtl_msg);
+		if (ret / sizeof(struct trtl_msg) < count)
+			break;
+	}
+
+	return done;
+}
+
+
+/**
+ * It sends many messages, from separate buffers, to an input message queue
+ * slot with a system call for each 1024 messages
+ * @param[in] hmq HMQ device descriptor
+ * @param[in] msg messages to send
+ * @param[in] n number of messages
+ * @return number of messages sent, -1 on error and errno is set
+ *         appropriately
+ */
+int trtl_hmq_send_n(struct trtl_hmq *hmq, struct trtl_msg **msg,
+		    unsigned int n)
+{
+	uint64_t start;
+	int ret, i;
+	size_t bytes = 0;
+
+	if (!hmq) {
+		errno = ETRTL_HMQ_CLOSE;
+		return -1;
+	}
+
+	start = trtl_stats_start(hmq->trtl);
+	ret = __trtl_hmq_send_n(hmq, msg, n);
+	if (start)
+		for (i = 0; i < ret; i++)
+			bytes += msg[i]->datalen * 4;
+	trtl_stats_end(hmq->trtl, TRTL_STATS_HMQ_SEND, start, ret < 0, bytes);
+
+	return ret;
+}
+
+
+/**
+ * trtl_hmq_receive_iov() without statistics
+ */
+static int __trtl_hmq_receive_iov(struct trtl_hmq *hmq, struct trtl_msg **msg,
+				  unsigned int n)
+{
+	struct iovec iov[TRTL_HMQ_IOV_MAX];
+	unsigned int i, count, done = 0;
+	ssize_t ret;
+
+	if (!hmq || hmq->fd < 0) {
+		errno = ETRTL_HMQ_CLOSE;
+		return -1;
+	}
+
+	/* One system call for each TRTL_HMQ_IOV_MAX messages */
+	while (done < n) {
+		count = n - done;
+		if (count > TRTL_HMQ_IOV_MAX)
+			count = TRTL_HMQ_IOV_MAX;
+		for (i = 0; i < count; i++) {
+			iov[i].iov_base = msg[done + i];
+			iov[i].iov_len = sizeof(struct trtl_msg);
+		}
+
+		ret = readv(hmq->fd, iov, count);
+		if (ret < 0)
+			return done ? done : -1;
+		if (ret % sizeof(struct trtl_msg)) {
+			errno = ETRTL_HMQ_CLOSE;
+			return -1;
+		}
+		done += ret / sizeof(struct trtl_msg);
+		/* The driver does not block, a short read means no more */
+		if (ret / sizeof(struct trtl_msg) < count)
+			break;
+	}
+
+	return done;
+}
+
+
+/**
+ * It gets messages, into separate buffers, from an output message queue
+ * slot with a system call for each 1024 messages
+ * @param[in] hmq HMQ device descriptor
+ * @param[out] msg buffers where store the messages
+ * @param[in] n number of buffers
+ * @return number of message received, -1 on error and errno is set
+ *         appropriately
+ */
+int trtl_hmq_receive_iov(struct trtl_hmq *hmq, struct trtl_msg **msg,
+			 unsigned int n)
+{
+	uint64_t start;
+	int ret;
+
+	if (!hmq) {
+		errno = ETRTL_HMQ_CLOSE;
+		return -1;
+	}
+
+	start = trtl_stats_start(hmq->trtl);
+	ret = __trtl_hmq_receive_iov(hmq, msg, n);
+	trtl_stats_end(hmq->trtl, TRTL_STATS_HMQ_RECV, start, ret < 0,
+		       ret * sizeof(struct trtl_msg));
+
+	return ret;
+}
+
+
 /**
  * It adds a new filter to the given hmq descriptor
  * @param[in] hmq HMQ device descriptor
@@ -1209,7 +2243,8 @@ struct trtl_dbg *trtl_debug_open(struct trtl_dev *trtl, unsigned int index)
 	snprintf(path, 64, "/sys/kernel/debug/%s/%s-cpu-%02d-dbg",
 		 wdesc->name, wdesc->name, index);
 
-	dbg->fd = open(path, O_RDONLY);
+	/* The driver blocks until a line arrives, we poll instead */
+	dbg->fd = open(path, O_RDONLY | O_NONBLOCK);
 	if (dbg->fd < 0) {
 	        free(dbg);
 		return NULL;
@@ -1253,11 +2288,13 @@ int trtl_debug_message_get(struct trtl_dbg *dbg, char *buf, size_t count)
 	memset(buf, 0, count);
 	do {
 		n = read(dbg->fd, buf + real_count, count - real_count);
+		if (n < 0 && errno == EAGAIN)
+			n = 0;
 		if (n < 0)
 		        return -1;
 		real_count += n;
 		/* check if the string from the CPU is shorter */
-	        if (buf[real_count - 1] == '\0')
+	        if (real_count && buf[real_count - 1] == '\0')
 		        break;
 
 		/*
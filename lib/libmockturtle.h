@@ -39,6 +39,8 @@ struct trtl_dbg {
 };
 
 
+struct trtl_hmq_pool;
+
 /**
  * HMQ slot descriptor
  */
@@ -50,6 +52,7 @@ struct trtl_hmq {
 			       counting from 0*/
 	unsigned long flags; /**< flags associated to the slot */
 	int fd; /**< file descriptor */
+	struct trtl_hmq_pool *pool; /**< receive message pool */
 };
 
 #define TRTL_FMC_OFFSET 2 /* FIXME this is an hack because fmc-bus does not allow
@@ -78,6 +81,8 @@ enum trtl_error_number {
 	ETRTL_HMQ_CLOSE, /**< The HMQ is closed */
 	ETRTL_INVALID_MESSAGE, /**< Invalid message */
 	ETRTL_HMQ_READ, /**< Error while reading messages */
+	ETRTL_INVALID_ELF, /**< Invalid ELF image */
+	ETRTL_LOG_INVALID, /**< Invalid or not initialized binary log */
 	__ETRTL_MAX,
 };
 
@@ -91,6 +96,115 @@ struct trtl_structure_tlv {
 	size_t size; /**< structure size in byte */
 };
 
+/**
+ * Descriptor of a CPU application for the gang load
+ */
+struct trtl_cpu_image {
+	uint32_t index; /**< CPU index */
+	uint32_t size; /**< application size in byte. When 0 the CPU is
+			  only restarted */
+	void *code; /**< application code (flat binary or ELF image) */
+};
+
+/**
+ * Description of a device in the discovery index
+ */
+struct trtl_dev_info {
+	char name[TRTL_NAME_LEN]; /**< device name */
+	uint32_t fmc_id; /**< FMC device id */
+	int lun; /**< Logical Unit Number, -1 when unknown */
+	uint32_t app_id; /**< application identifier */
+	uint32_t n_cpu; /**< number of CPUs */
+	unsigned int n_hmq_in; /**< number of input slots */
+	unsigned int n_hmq_out; /**< number of output slots */
+};
+
+/**
+ * Device hot-plug events
+ */
+enum trtl_discovery_event {
+	TRTL_DISCOVERY_ADD, /**< a device appeared */
+	TRTL_DISCOVERY_REMOVE, /**< a device disappeared */
+	TRTL_DISCOVERY_CHANGE, /**< a device description changed */
+};
+
+/**
+ * Hot-plug callback. On TRTL_DISCOVERY_ADD the slots may not be all
+ * registered yet: a TRTL_DISCOVERY_CHANGE follows with the updated counts
+ */
+typedef void (trtl_discovery_cb_t)(enum trtl_discovery_event event,
+				   struct trtl_dev_info *info, void *arg);
+
+/**
+ * Status of a HMQ slot
+ */
+struct trtl_hmq_state {
+	uint32_t buffer_size; /**< driver buffer size in bytes */
+	uint32_t width; /**< maximum message size in bytes */
+	uint32_t count_max_hw; /**< maximum number of messages in hardware */
+	uint32_t count_hw; /**< number of messages in hardware */
+	uint32_t shared; /**< message share mode */
+};
+
+/**
+ * Status of a device
+ */
+struct trtl_dev_state {
+	uint32_t app_id; /**< application identifier */
+	uint32_t n_cpu; /**< number of CPUs */
+	uint32_t enable_mask; /**< CPUs enable lines */
+	uint32_t reset_mask; /**< CPUs reset lines */
+	unsigned int n_hmq_in; /**< number of input slots */
+	unsigned int n_hmq_out; /**< number of output slots */
+	struct trtl_hmq_state hmq_in[TRTL_MAX_HMQ_SLOT / 2]; /**< input slots */
+	struct trtl_hmq_state hmq_out[TRTL_MAX_HMQ_SLOT / 2]; /**< output
+								 slots */
+};
+
+/**
+ * API families with statistics
+ */
+enum trtl_stats_family {
+	TRTL_STATS_HMQ_SEND, /**< asynchronous messages sent */
+	TRTL_STATS_HMQ_RECV, /**< asynchronous messages received */
+	TRTL_STATS_HMQ_SYNC, /**< synchronous messages */
+	TRTL_STATS_SMEM, /**< shared memory access */
+	TRTL_STATS_RT, /**< Real Time service messages */
+	__TRTL_STATS_MAX,
+};
+
+#define TRTL_STATS_HIST_BUCKETS 32
+
+/**
+ * Counters of an API family. Bucket 'i' of the latency histogram counts the
+ * calls that took from 2^(i-1) to 2^i nano-seconds; the last bucket
+ * counts also the slower ones
+ */
+struct trtl_stats_counters {
+	uint64_t calls; /**< number of calls */
+	uint64_t errors; /**< number of failed calls */
+	uint64_t timeouts; /**< number of calls failed for timeout */
+	uint64_t bytes; /**< bytes transferred by the successful calls */
+	uint64_t latency_ns; /**< total time spent in the calls */
+	uint64_t hist[TRTL_STATS_HIST_BUCKETS]; /**< latency histogram */
+};
+
+/**
+ * Statistics of a device
+ */
+struct trtl_stats {
+	struct trtl_stats_counters family[__TRTL_STATS_MAX];
+};
+
+/**
+ * Cursor over the TLV records of a message payload
+ */
+struct trtl_tlv_iter {
+	struct trtl_msg *msg; /**< message */
+	unsigned int offset; /**< next record position in 32bit words */
+	unsigned int end; /**< payload end in 32bit words */
+};
+
 /**
  * @file libmockturtle.c
  */
@@ -105,6 +219,11 @@ extern void trtl_exit();
 extern uint32_t trtl_count();
 extern char **trtl_list();
 extern void trtl_list_free(char **list);
+extern int trtl_dev_info_get(uint32_t device_id, struct trtl_dev_info *info);
+extern int trtl_discovery_subscribe(trtl_discovery_cb_t *cb, void *arg);
+extern void trtl_discovery_unsubscribe(trtl_discovery_cb_t *cb, void *arg);
+extern int trtl_discovery_fd(void);
+extern int trtl_discovery_dispatch(void);
 
 extern struct trtl_dev *trtl_open(const char *device);
 extern struct trtl_dev *trtl_open_by_fmc(uint32_t device_id);
@@ -112,6 +231,11 @@ extern struct trtl_dev *trtl_open_by_lun(unsigned int lun);
 extern void trtl_close(struct trtl_dev *trtl);
 extern char *trtl_name_get(struct trtl_dev *trtl);
 extern int trtl_app_id_get(struct trtl_dev *trtl, uint32_t *app_id);
+extern int trtl_dev_state_get(struct trtl_dev *trtl,
+			      struct trtl_dev_state *state);
+extern void trtl_stats_enable(struct trtl_dev *trtl, int enable);
+extern int trtl_stats_get(struct trtl_dev *trtl, struct trtl_stats *stats);
+extern void trtl_stats_reset(struct trtl_dev *trtl);
 /**@}*/
 
 /**
@@ -126,6 +250,13 @@ extern int trtl_cpu_load_application_raw(struct trtl_dev *trtl,
 extern int trtl_cpu_load_application_file(struct trtl_dev *trtl,
 					  unsigned int index,
 					  char *path);
+extern int trtl_cpu_load_application_elf(struct trtl_dev *trtl,
+					 unsigned int index,
+					 void *code, size_t length);
+extern int trtl_elf_is_valid(void *code, size_t length);
+extern int trtl_cpu_load_application_gang(struct trtl_dev *trtl,
+					  struct trtl_cpu_image *image,
+					  unsigned int n);
 extern int trtl_cpu_dump_application_raw(struct trtl_dev *trtl,
 					 unsigned int index,
 					 void *code, size_t length,
@@ -165,7 +296,15 @@ extern int trtl_hmq_share_get(struct trtl_dev *trtl, unsigned int dir,
 extern int trtl_hmq_receive_n(struct trtl_hmq *hmq,
 			      struct trtl_msg *msg, unsigned int n);
 extern struct trtl_msg *trtl_hmq_receive(struct trtl_hmq *hmq);
+extern struct trtl_msg *trtl_hmq_receive_pool(struct trtl_hmq *hmq);
+extern int trtl_hmq_receive_pool_n(struct trtl_hmq *hmq,
+				   struct trtl_msg **msg, unsigned int n);
+extern void trtl_hmq_msg_release(struct trtl_hmq *hmq, struct trtl_msg *msg);
 extern int trtl_hmq_send(struct trtl_hmq *hmq, struct trtl_msg *msg);
+extern int trtl_hmq_send_n(struct trtl_hmq *hmq, struct trtl_msg **msg,
+			   unsigned int n);
+extern int trtl_hmq_receive_iov(struct trtl_hmq *hmq, struct trtl_msg **msg,
+				unsigned int n);
 extern int trtl_hmq_send_and_receive_sync(struct trtl_hmq *hmq,
 					   unsigned int index_out,
 					   struct trtl_msg *msg,
@@ -193,6 +332,31 @@ extern int trtl_smem_read(struct trtl_dev *trtl, uint32_t addr, uint32_t *data,
 			  size_t count, enum trtl_smem_modifier mod);
 extern int trtl_smem_write(struct trtl_dev *trtl, uint32_t addr, uint32_t *data,
 			   size_t count, enum trtl_smem_modifier mod);
+extern int trtl_smem_io_batch(struct trtl_dev *trtl, struct trtl_smem_io *io,
+			      unsigned int n);
+extern int trtl_smem_read_consistent(struct trtl_dev *trtl, uint32_t seq_addr,
+				     uint32_t addr, uint32_t *data,
+				     size_t count);
+extern int trtl_sampler_start(struct trtl_dev *trtl,
+			      struct trtl_sampler_cfg *cfg);
+extern int trtl_sampler_stop(struct trtl_dev *trtl);
+extern size_t trtl_sampler_sample_size(struct trtl_dev *trtl);
+extern int trtl_sampler_read(struct trtl_dev *trtl, void *buf, unsigned int n);
+/**@}*/
+
+/**
+ * @defgroup log Binary Log
+ * Functions to read and decode the binary log of an application
+ * @{
+ */
+struct trtl_log;
+extern struct trtl_log *trtl_log_open(struct trtl_dev *trtl,
+				      unsigned int index, const char *path);
+extern void trtl_log_close(struct trtl_log *log);
+extern int trtl_log_read(struct trtl_log *log, struct trtl_log_record *rec,
+			 unsigned int n);
+extern int trtl_log_format(struct trtl_log *log, struct trtl_log_record *rec,
+			   char *buf, size_t len);
 /**@}*/
 
 /**
@@ -229,6 +393,17 @@ extern void trtl_message_structure_push(struct trtl_msg *msg,
 extern void trtl_message_structure_pop(struct trtl_msg *msg,
 				       struct trtl_proto_header *hdr,
 				       struct trtl_structure_tlv *tlv);
+extern int trtl_message_tlv_iter_init(struct trtl_tlv_iter *it,
+				      struct trtl_msg *msg,
+				      struct trtl_proto_header *hdr);
+extern int trtl_message_tlv_next(struct trtl_tlv_iter *it,
+				 struct trtl_structure_tlv *tlv);
+extern void trtl_message_tlv_build_init(struct trtl_tlv_iter *it,
+					struct trtl_msg *msg);
+extern int trtl_message_tlv_append(struct trtl_tlv_iter *it,
+				   struct trtl_structure_tlv *tlv);
+extern void trtl_message_tlv_build_end(struct trtl_tlv_iter *it,
+				       struct trtl_proto_header *hdr);
 /**@}*/
 
 /**
@@ -256,6 +431,61 @@ extern int trtl_rt_structure_get(struct trtl_dev *trtl,
 				 struct trtl_structure_tlv *tlv,
 				 unsigned int n_tlv);
 /**@}*/
+
+/**
+ * @defgroup rpc RPC sessions
+ * Asynchronous RT service messages, many in flight on a pair of slots
+ * @{
+ */
+struct trtl_rpc;
+/**
+ * RPC completion callback. On success 'err' is 0, and 'hdr' and 'payload'
+ * describe the answer; they are valid only during the call. Otherwise
+ * 'err' is an errno value and 'hdr' and 'payload' are NULL
+ */
+typedef void (trtl_rpc_cb_t)(struct trtl_rpc *rpc, int err,
+			     struct trtl_proto_header *hdr, void *payload,
+			     void *arg);
+extern struct trtl_rpc *trtl_rpc_open(struct trtl_dev *trtl,
+				      unsigned int hmq_in,
+				      unsigned int hmq_out);
+extern void trtl_rpc_close(struct trtl_rpc *rpc);
+extern int trtl_rpc_fd(struct trtl_rpc *rpc);
+extern int trtl_rpc_call(struct trtl_rpc *rpc, struct trtl_proto_header *hdr,
+			 void *payload, unsigned int timeout_ms,
+			 trtl_rpc_cb_t *cb, void *arg);
+extern int trtl_rpc_dispatch(struct trtl_rpc *rpc);
+extern int trtl_rpc_timeout_get(struct trtl_rpc *rpc);
+extern unsigned int trtl_rpc_pending(struct trtl_rpc *rpc);
+/**@}*/
+
+/**
+ * @defgroup loop Event loop
+ * Dispatch of HMQ and debug events from many devices
+ * @{
+ */
+struct trtl_loop;
+/**
+ * Callback for a ready HMQ slot. 'events' is the set of epoll events
+ */
+typedef void (trtl_loop_hmq_cb_t)(struct trtl_loop *loop, struct trtl_hmq *hmq,
+				  uint32_t events, void *arg);
+/**
+ * Callback for a ready debug channel. 'events' is the set of epoll events
+ */
+typedef void (trtl_loop_dbg_cb_t)(struct trtl_loop *loop, struct trtl_dbg *dbg,
+				  uint32_t events, void *arg);
+extern struct trtl_loop *trtl_loop_create(void);
+extern void trtl_loop_destroy(struct trtl_loop *loop);
+extern int trtl_loop_fd(struct trtl_loop *loop);
+extern int trtl_loop_hmq_add(struct trtl_loop *loop, struct trtl_hmq *hmq,
+			     trtl_loop_hmq_cb_t *cb, void *arg);
+extern int trtl_loop_hmq_del(struct trtl_loop *loop, struct trtl_hmq *hmq);
+extern int trtl_loop_debug_add(struct trtl_loop *loop, struct trtl_dbg *dbg,
+			       trtl_loop_dbg_cb_t *cb, void *arg);
+extern int trtl_loop_debug_del(struct trtl_loop *loop, struct trtl_dbg *dbg);
+extern int trtl_loop_run(struct trtl_loop *loop, int timeout_ms);
+/**@}*/
 #ifdef __cplusplus
 };
 #endif
@@ -0,0 +1,467 @@
+/*
+ * Copyright (C) 2016 CERN (www.cern.ch)
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#ifndef __LIB_TRTL_HPP__
+#define __LIB_TRTL_HPP__
+/** @file libmockturtle.hpp */
+
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include "libmockturtle.h"
+
+/**
+ * @defgroup cpp C++ interface
+ * Header-only C++ layer over the C library: RAII tokens and messages
+ * whose layout is checked at compile time. C library errors are thrown
+ * as trtl::error
+ * @{
+ */
+namespace trtl {
+
+/**
+ * Error from the C library. The code is the errno value, or one of
+ * the ETRTL_* values
+ */
+class error : public std::runtime_error {
+public:
+	explicit error(int code)
+		: std::runtime_error(trtl_strerror(code)), code_(code) {}
+	int code() const { return code_; }
+private:
+	int code_;
+};
+
+namespace detail {
+
+/* Payload words after the protocol header */
+static const unsigned int max_payload_words =
+	TRTL_MAX_PAYLOAD_SIZE - sizeof(struct trtl_proto_header) / 4;
+
+inline void throw_errno()
+{
+	throw error(errno);
+}
+
+inline int check(int ret)
+{
+	if (ret < 0)
+		throw_errno();
+	return ret;
+}
+
+template <typename T>
+inline T *check(T *ptr)
+{
+	if (!ptr)
+		throw_errno();
+	return ptr;
+}
+
+/**
+ * Layout rules for anything copied word by word into a message: the
+ * gateware swaps the byte order of each 32bit word, so only whole,
+ * 32bit aligned words survive the trip
+ */
+template <typename T>
+struct word_layout {
+	static const bool value = std::is_trivially_copyable<T>::value &&
+				  std::is_standard_layout<T>::value &&
+				  sizeof(T) % 4 == 0 && alignof(T) == 4;
+};
+
+/* Words used by a structure in a TLV message: index, size, data */
+template <typename... S>
+struct tlv_words;
+
+template <>
+struct tlv_words<> {
+	static const unsigned int value = 0;
+};
+
+template <typename S, typename... R>
+struct tlv_words<S, R...> {
+	static const unsigned int value = 2 + sizeof(S) / 4 +
+					  tlv_words<R...>::value;
+};
+
+} /* namespace detail */
+
+
+/**
+ * Message with a typed payload. The payload type declares its message
+ * identifier as `static const uint8_t msg_id`; size, length and
+ * alignment are checked at compile time. The payload lives in place
+ * in the raw message, so nothing is copied to send or to receive it
+ */
+template <typename P>
+class message {
+	static_assert(detail::word_layout<P>::value,
+		      "payload must be trivially copyable 32bit words");
+	static_assert(sizeof(P) / 4 <= detail::max_payload_words,
+		      "payload does not fit in a message");
+	static_assert(std::is_same<decltype(P::msg_id), const uint8_t>::value,
+		      "payload must declare 'static const uint8_t msg_id'");
+public:
+	/** Number of payload words, as in the header length */
+	static const uint8_t len = sizeof(P) / 4;
+
+	/**
+	 * It prepares a message for the given application and slots
+	 */
+	explicit message(uint16_t rt_app_id = 0, uint8_t slot_io = 0,
+			 uint8_t flags = 0)
+	{
+		struct trtl_proto_header hdr;
+
+		std::memset(&hdr, 0, sizeof(hdr));
+		hdr.rt_app_id = rt_app_id;
+		hdr.slot_io = slot_io;
+		hdr.flags = flags;
+		header(hdr);
+		std::memset(payload_words(), 0, sizeof(P));
+	}
+
+	/** It sets the header; message identifier and length come from P */
+	void header(struct trtl_proto_header hdr)
+	{
+		hdr.msg_id = P::msg_id;
+		hdr.len = len;
+		trtl_message_header_set(&raw_, &hdr);
+		raw_.datalen += len;
+	}
+
+	struct trtl_proto_header header() const
+	{
+		struct trtl_proto_header hdr;
+
+		trtl_message_header_get(const_cast<struct trtl_msg *>(&raw_),
+					&hdr);
+		return hdr;
+	}
+
+	/**
+	 * It tells if the message carries a P: right identifier and length.
+	 * Use it on received messages before reading the payload
+	 */
+	bool valid() const
+	{
+		struct trtl_proto_header hdr = header();
+
+		return hdr.msg_id == P::msg_id && hdr.len == len &&
+		       raw_.datalen >= sizeof(hdr) / 4 + len;
+	}
+
+	P &payload() { return *reinterpret_cast<P *>(payload_words()); }
+	const P &payload() const
+	{
+		return *reinterpret_cast<const P *>(payload_words());
+	}
+
+	struct trtl_msg *raw() { return &raw_; }
+	const struct trtl_msg *raw() const { return &raw_; }
+
+private:
+	uint32_t *payload_words()
+	{
+		return &raw_.data[sizeof(struct trtl_proto_header) / 4];
+	}
+	const uint32_t *payload_words() const
+	{
+		return &raw_.data[sizeof(struct trtl_proto_header) / 4];
+	}
+
+	struct trtl_msg raw_;
+};
+
+
+/**
+ * Real-Time application variable at a fixed index. T is one 32bit word
+ */
+template <uint32_t Index, typename T = uint32_t>
+struct variable {
+	static_assert(detail::word_layout<T>::value && sizeof(T) == 4,
+		      "a variable is one 32bit word");
+	static const uint32_t index = Index;
+	T value;
+};
+
+/**
+ * Real-Time application structure. S declares its index as
+ * `static const uint32_t index` and it follows the payload layout rules
+ */
+template <typename S>
+struct structure_check {
+	static_assert(detail::word_layout<S>::value,
+		      "structure must be trivially copyable 32bit words");
+	static_assert(std::is_same<decltype(S::index), const uint32_t>::value,
+		      "structure must declare 'static const uint32_t index'");
+	static const bool value = true;
+};
+
+
+/**
+ * Device token
+ */
+class device {
+public:
+	explicit device(const char *name)
+		: dev_(detail::check(trtl_open(name))) {}
+
+	static device by_fmc(uint32_t device_id)
+	{
+		return device(detail::check(trtl_open_by_fmc(device_id)));
+	}
+
+	static device by_lun(unsigned int lun)
+	{
+		return device(detail::check(trtl_open_by_lun(lun)));
+	}
+
+	~device() { if (dev_) trtl_close(dev_); }
+	device(device &&o) : dev_(o.dev_) { o.dev_ = nullptr; }
+	device &operator=(device &&o)
+	{
+		std::swap(dev_, o.dev_);
+		return *this;
+	}
+	device(const device &) = delete;
+	device &operator=(const device &) = delete;
+
+	struct trtl_dev *get() const { return dev_; }
+	const char *name() const { return trtl_name_get(dev_); }
+
+	uint32_t app_id() const
+	{
+		uint32_t id;
+
+		detail::check(trtl_app_id_get(dev_, &id));
+		return id;
+	}
+
+	/**
+	 * It sets the given variables in one message. The header gives the
+	 * application, the slots and the flags
+	 */
+	template <typename... V>
+	void variable_set(struct trtl_proto_header hdr, const V &...vars)
+	{
+		static_assert(sizeof...(V) > 0, "no variables");
+		static_assert(sizeof...(V) * 2 <= detail::max_payload_words,
+			      "too many variables for a message");
+		uint32_t buf[sizeof...(V) * 2];
+
+		variable_pack(buf, vars...);
+		detail::check(trtl_rt_variable_set(dev_, &hdr, buf,
+						   sizeof...(V)));
+	}
+
+	/**
+	 * It gets the given variables in one message
+	 */
+	template <typename... V>
+	void variable_get(struct trtl_proto_header hdr, V &...vars)
+	{
+		static_assert(sizeof...(V) > 0, "no variables");
+		static_assert(sizeof...(V) * 2 <= detail::max_payload_words,
+			      "too many variables for a message");
+		uint32_t buf[sizeof...(V) * 2];
+
+		variable_pack(buf, vars...);
+		detail::check(trtl_rt_variable_get(dev_, &hdr, buf,
+						   sizeof...(V)));
+		variable_unpack(buf, vars...);
+	}
+
+	/**
+	 * It sets the given structures in one message
+	 */
+	template <typename... S>
+	void structure_set(struct trtl_proto_header hdr, const S &...s)
+	{
+		static_assert(sizeof...(S) > 0, "no structures");
+		static_assert(detail::tlv_words<S...>::value <=
+			      detail::max_payload_words,
+			      "too many structures for a message");
+		struct trtl_structure_tlv tlv[sizeof...(S)];
+
+		structure_pack(tlv, const_cast<S &>(s)...);
+		detail::check(trtl_rt_structure_set(dev_, &hdr, tlv,
+						    sizeof...(S)));
+	}
+
+	/**
+	 * It gets the given structures in one message
+	 */
+	template <typename... S>
+	void structure_get(struct trtl_proto_header hdr, S &...s)
+	{
+		static_assert(sizeof...(S) > 0, "no structures");
+		static_assert(detail::tlv_words<S...>::value <=
+			      detail::max_payload_words,
+			      "too many structures for a message");
+		struct trtl_structure_tlv tlv[sizeof...(S)];
+
+		structure_pack(tlv, s...);
+		detail::check(trtl_rt_structure_get(dev_, &hdr, tlv,
+						    sizeof...(S)));
+	}
+
+	struct trtl_rt_version version(unsigned int hmq_in,
+				       unsigned int hmq_out)
+	{
+		struct trtl_rt_version v;
+
+		detail::check(trtl_rt_version_get(dev_, &v, hmq_in, hmq_out));
+		return v;
+	}
+
+	void ping(unsigned int hmq_in, unsigned int hmq_out)
+	{
+		detail::check(trtl_rt_ping(dev_, hmq_in, hmq_out));
+	}
+
+private:
+	explicit device(struct trtl_dev *dev) : dev_(dev) {}
+
+	static void variable_pack(uint32_t *) {}
+	template <typename V, typename... R>
+	static void variable_pack(uint32_t *buf, const V &v, const R &...r)
+	{
+		buf[0] = V::index;
+		std::memcpy(&buf[1], &v.value, 4);
+		variable_pack(buf + 2, r...);
+	}
+
+	static void variable_unpack(const uint32_t *) {}
+	template <typename V, typename... R>
+	static void variable_unpack(const uint32_t *buf, V &v, R &...r)
+	{
+		std::memcpy(&v.value, &buf[1], 4);
+		variable_unpack(buf + 2, r...);
+	}
+
+	static void structure_pack(struct trtl_structure_tlv *) {}
+	template <typename S, typename... R>
+	static void structure_pack(struct trtl_structure_tlv *tlv, S &s,
+				   R &...r)
+	{
+		static_assert(structure_check<S>::value, "");
+		tlv->index = S::index;
+		tlv->structure = &s;
+		tlv->size = sizeof(S);
+		structure_pack(tlv + 1, r...);
+	}
+
+	struct trtl_dev *dev_;
+};
+
+
+/**
+ * HMQ slot token
+ */
+class hmq {
+public:
+	hmq(device &dev, unsigned int index, unsigned long flags)
+		: hmq_(detail::check(trtl_hmq_open(dev.get(), index, flags))) {}
+	~hmq() { if (hmq_) trtl_hmq_close(hmq_); }
+	hmq(hmq &&o) : hmq_(o.hmq_) { o.hmq_ = nullptr; }
+	hmq &operator=(hmq &&o)
+	{
+		std::swap(hmq_, o.hmq_);
+		return *this;
+	}
+	hmq(const hmq &) = delete;
+	hmq &operator=(const hmq &) = delete;
+
+	struct trtl_hmq *get() const { return hmq_; }
+
+	template <typename P>
+	void send(message<P> &msg)
+	{
+		detail::check(trtl_hmq_send(hmq_, msg.raw()));
+	}
+
+	/**
+	 * It receives one message
+	 * @return false when there are no messages, or the message is not
+	 *         a P
+	 */
+	template <typename P>
+	bool receive(message<P> &msg)
+	{
+		if (!detail::check(trtl_hmq_receive_n(hmq_, msg.raw(), 1)))
+			return false;
+		return msg.valid();
+	}
+
+	/**
+	 * It sends a synchronous message and it waits for the answer A
+	 */
+	template <typename P, typename A>
+	void send_and_receive_sync(unsigned int index_out,
+				   const message<P> &msg, message<A> &answer,
+				   unsigned int timeout_ms =
+					trtl_default_timeout_ms)
+	{
+		*answer.raw() = *msg.raw();
+		if (!detail::check(trtl_hmq_send_and_receive_sync(hmq_,
+							index_out,
+							answer.raw(),
+							timeout_ms))) {
+			errno = ETIME;
+			detail::throw_errno();
+		}
+		if (!answer.valid()) {
+			errno = ETRTL_INVALID_MESSAGE;
+			detail::throw_errno();
+		}
+	}
+
+private:
+	struct trtl_hmq *hmq_;
+};
+
+
+/**
+ * Debug channel token
+ */
+class debug {
+public:
+	debug(device &dev, unsigned int cpu)
+		: dbg_(detail::check(trtl_debug_open(dev.get(), cpu))) {}
+	~debug() { if (dbg_) trtl_debug_close(dbg_); }
+	debug(debug &&o) : dbg_(o.dbg_) { o.dbg_ = nullptr; }
+	debug &operator=(debug &&o)
+	{
+		std::swap(dbg_, o.dbg_);
+		return *this;
+	}
+	debug(const debug &) = delete;
+	debug &operator=(const debug &) = delete;
+
+	struct trtl_dbg *get() const { return dbg_; }
+	int fd() const { return dbg_->fd; }
+
+	/**
+	 * It reads a debug message
+	 * @return number of bytes read, 0 when there are none
+	 */
+	int message_get(char *buf, size_t count)
+	{
+		return detail::check(trtl_debug_message_get(dbg_, buf, count));
+	}
+
+private:
+	struct trtl_dbg *dbg_;
+};
+
+} /* namespace trtl */
+/**@}*/
+
+#endif
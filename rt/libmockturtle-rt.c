@@ -128,6 +128,87 @@ int rt_version_getter(struct trtl_proto_header *hin, void *pin,
 }
 
 
+/**
+ * It returns the value of a variable
+ */
+static inline uint32_t rt_variable_value(struct rt_variable *var)
+{
+	return (*(uint32_t *)var->addr >> var->offset) & var->mask;
+}
+
+
+/**
+ * It writes the value of a mirrored variable in the mirror table.
+ * The caller must hold the table sequence
+ */
+static inline void rt_variable_mirror_set(unsigned int index)
+{
+	struct trtl_var_mirror *mirror = _app->mirror;
+	struct rt_variable *var = &_app->variables[index];
+
+	if (var->flags & RT_VARIABLE_FLAG_MIRROR)
+		mirror->word[(mirror->n_var + 31) / 32 + index] =
+			rt_variable_value(var);
+}
+
+
+/**
+ * It refreshes all the mirrored variables. Applications mirroring
+ * hardware registers, or variables changed by themselves, should call it
+ * periodically from their main loop
+ */
+void rt_variable_mirror_update(void)
+{
+	int i;
+
+	if (!_app->mirror)
+		return;
+
+	smem_seq_write_begin((volatile int *)&_app->mirror->seq);
+	for (i = 0; i < _app->n_variables; ++i)
+		rt_variable_mirror_set(i);
+	smem_seq_write_end((volatile int *)&_app->mirror->seq);
+}
+
+
+/**
+ * It initializes the mirror table and it publishes it in the directory
+ */
+static void rt_variable_mirror_init(void)
+{
+	volatile uint32_t *dir = (volatile uint32_t *)(SMEM_BASE +
+						TRTL_VAR_MIRROR_DIR_OFFSET);
+	struct trtl_var_mirror *mirror = _app->mirror;
+	unsigned int core;
+	int i;
+
+	core = WRN_CPU_LR_STAT_CORE_ID_R(lr_readl(WRN_CPU_LR_REG_STAT));
+	if (core >= TRTL_VAR_MIRROR_DIR_SIZE)
+		return;
+	dir[core] = 0;
+	if (!mirror)
+		return;
+
+	mirror->magic = 0;
+	mirror->rt_id = _app->version.rt_id;
+	mirror->seq = 0;
+	mirror->n_var = _app->n_variables;
+	mirror->slot_in = 0;
+	for (i = 0; i < _app->n_mq; ++i)
+		if (!(_app->mq[i].flags & RT_MQ_FLAGS_REMOTE))
+			mirror->slot_in |= 1 << _app->mq[i].index;
+	for (i = 0; i < (_app->n_variables + 31) / 32; ++i)
+		mirror->word[i] = 0;
+	for (i = 0; i < _app->n_variables; ++i)
+		if (_app->variables[i].flags & RT_VARIABLE_FLAG_MIRROR)
+			mirror->word[i / 32] |= 1 << (i % 32);
+	rt_variable_mirror_update();
+	mirror->magic = TRTL_VAR_MIRROR_MAGIC;
+
+	dir[core] = (uint32_t)mirror;
+}
+
+
 /**
  * This is a generic setter that an external system can invoke
  * to set a set of variable values.
@@ -144,6 +225,9 @@ int rt_variable_setter(struct trtl_proto_header *hin, void *pin,
 	if (hin->len % 2)
 		rt_send_nack(hin, pin, hout, pout);
 
+	if (_app->mirror)
+		smem_seq_write_begin((volatile int *)&_app->mirror->seq);
+
 	/* Write all values in the proper place */
 	for (i = 0; i < hin->len; i += 2) {
 		if (din[i] >= _app->n_variables)
@@ -155,6 +239,8 @@ int rt_variable_setter(struct trtl_proto_header *hin, void *pin,
 			*mem = val;
 		else
 			*mem = (*mem & ~var->mask) | val;
+		if (_app->mirror)
+			rt_variable_mirror_set(din[i]);
 
 #ifdef LIBRT_DEBUG
 		pp_printf("%s index %d/%d | [0x%p] = 0x%08x <- 0x%08x (0x%08x) | index in msg (%d/%d)\n",
@@ -166,6 +252,9 @@ int rt_variable_setter(struct trtl_proto_header *hin, void *pin,
 #endif
 	}
 
+	if (_app->mirror)
+		smem_seq_write_end((volatile int *)&_app->mirror->seq);
+
 	/* Return back new values. Host can compare with what it sent
 	   to spot errors */
 	if (hin->flags & TRTL_PROTO_FLAG_SYNC)
@@ -204,7 +293,7 @@ int rt_variable_getter(struct trtl_proto_header *hin, void *pin,
 		dout[i] = din[i];
 		var = &_app->variables[dout[i]];
 		mem = (uint32_t *) var->addr;
-		val = (*mem >> var->offset) & var->mask;
+		val = rt_variable_value(var);
 		dout[i + 1] = val;
 #ifdef LIBRT_DEBUG
 		pp_printf("%s index %d/%d | [0x%p] = 0x%08x -> 0x%08x | index in msg (%d/%d)\n",
@@ -390,6 +479,8 @@ void rt_init(struct rt_application *app)
 			  MQ_OUT(_app->mq[i].index) + MQ_SLOT_COMMAND);
 	}
 
+	rt_variable_mirror_init();
+
 #ifdef LIBRT_DEBUG
 	pp_printf("Exported Variables");
 	for (i = 0; i < _app->n_variables; ++i)
@@ -14,6 +14,7 @@
 #include "mockturtle-rt-common.h"
 #include "mockturtle-rt-mqueue.h"
 #include "mockturtle-rt-message.h"
+#include "mockturtle-rt-smem.h"
 #include "pp-printf.h"
 
 #define RT_VARIABLE_FLAG_REG	(1 << 0)
@@ -53,6 +54,7 @@ static inline void rt_print_header(struct trtl_proto_header *h)
 extern uint32_t msg_seq;
 
 #define RT_VARIABLE_FLAG_WO (1 << 0)
+#define RT_VARIABLE_FLAG_MIRROR (1 << 1) /**< publish it in shared memory */
 /**
  * Description of a RealTime variable that we want to export to user-space
  */
@@ -97,8 +99,24 @@ struct rt_application {
 
 	action_t **actions;
 	unsigned int n_actions;
+
+	/**
+	 * Shared memory table for the variables flagged with
+	 * RT_VARIABLE_FLAG_MIRROR. Optional, declare it with
+	 * RT_VARIABLE_MIRROR_DECLARE()
+	 */
+	struct trtl_var_mirror *mirror;
 };
 
+/**
+ * It declares the shared memory table for the mirrored variables of
+ * an application with _n variables
+ */
+#define RT_VARIABLE_MIRROR_DECLARE(_name, _n)				\
+	SMEM struct trtl_var_mirror _name = {				\
+		.word = { [TRTL_VAR_MIRROR_WORDS(_n) - 1] = 0 },	\
+	}
+
 extern void rt_init(struct rt_application *app);
 extern int rt_mq_register(struct rt_mq *mq, unsigned int n);
 extern int rt_mq_action_register(uint32_t id, action_t action);
@@ -134,6 +152,7 @@ extern int rt_variable_setter(struct trtl_proto_header *hin, void *pin,
 			    struct trtl_proto_header *hout, void *pout);
 extern int rt_variable_getter(struct trtl_proto_header *hin, void *pin,
 			    struct trtl_proto_header *hout, void *pout);
+extern void rt_variable_mirror_update(void);
 extern int rt_structure_setter(struct trtl_proto_header *hin, void *pin,
 			       struct trtl_proto_header *hout, void *pout);
 extern int rt_structure_getter(struct trtl_proto_header *hin, void *pin,
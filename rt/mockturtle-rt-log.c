@@ -0,0 +1,58 @@
+/*
+ * Copyright (C) 2016 CERN (www.cern.ch)
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ *
+ * Released according to the GNU GPL, version 2 or any later version.
+ */
+
+/*.
+ * White Rabbit Node Core
+ *
+ * rt-log.c: binary logging
+ */
+
+#include "mockturtle-rt-log.h"
+
+#ifndef RT_LOG_SIZE
+#define RT_LOG_SIZE 64
+#endif
+
+#if RT_LOG_SIZE & (RT_LOG_SIZE - 1)
+#error "RT_LOG_SIZE must be a power of 2"
+#endif
+
+/*
+ * The shared memory is common to all the CPUs, so each CPU logs in its own
+ * ring. Rings are TRTL_LOG_MAX_CPU consecutive copies of this structure:
+ * the host gets their stride from the size of TRTL_LOG_RING_SYMBOL
+ */
+struct rt_log_cpu_ring {
+	struct trtl_log_ring hdr;
+	struct trtl_log_record rec[RT_LOG_SIZE];
+};
+
+SMEM struct rt_log_cpu_ring rt_log_ring[TRTL_LOG_MAX_CPU];
+
+volatile struct trtl_log_ring *rt_log_self;
+
+
+/**
+ * It initializes the log ring of the running CPU. The magic number is
+ * written last, so the host does not read a ring which is not ready
+ */
+void rt_log_init(void)
+{
+	volatile struct trtl_log_ring *ring;
+	unsigned int core;
+
+	core = WRN_CPU_LR_STAT_CORE_ID_R(lr_readl(WRN_CPU_LR_REG_STAT));
+	if (core >= TRTL_LOG_MAX_CPU)
+		return;
+
+	ring = &rt_log_ring[core].hdr;
+	ring->magic = 0;
+	ring->size = RT_LOG_SIZE;
+	ring->head = 0;
+	ring->magic = TRTL_LOG_MAGIC;
+	rt_log_self = ring;
+}
@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2016 CERN (www.cern.ch)
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ *
+ * Released according to the GNU GPL, version 2 or any later version.
+ */
+
+/*.
+ * White Rabbit Node Core
+ *
+ * rt-log.h: binary logging
+ *
+ * Log records contain only a reference to the format string and the raw
+ * arguments: formatting is done on the host by mockturtle-log, which gets
+ * the format strings from the application ELF. Format strings live in a
+ * section that is not loaded, so they do not use CPU memory. Only integer
+ * arguments are supported.
+ *
+ * Build the application with RT_USE_LOG=<number of records> to use it.
+ */
+
+#ifndef __RT_LOG_H
+#define __RT_LOG_H
+
+#include <stdint.h>
+
+#include "mockturtle-common.h"
+#include "mockturtle-rt-common.h"
+#include "mockturtle-rt-smem.h"
+
+/* Log ring of the running CPU, NULL until rt_log_init() */
+extern volatile struct trtl_log_ring *rt_log_self;
+
+
+/**
+ * It stores a record in the log ring
+ */
+static inline void __rt_log(const char *fmt, uint32_t a0, uint32_t a1,
+			    uint32_t a2, uint32_t a3, uint32_t a4)
+{
+	volatile struct trtl_log_ring *ring = rt_log_self;
+	volatile struct trtl_log_record *rec;
+	uint32_t head;
+
+	if (!ring)
+		return;
+	head = ring->head;
+	rec = &ring->rec[head & (ring->size - 1)];
+	rec->fmt = (uint32_t)fmt;
+	rec->sec = lr_readl(WRN_CPU_LR_REG_TAI_SEC);
+	rec->cycles = lr_readl(WRN_CPU_LR_REG_TAI_CYCLES);
+	rec->args[0] = a0;
+	rec->args[1] = a1;
+	rec->args[2] = a2;
+	rec->args[3] = a3;
+	rec->args[4] = a4;
+	/* Publish the record only when it is complete */
+	ring->head = head + 1;
+}
+
+#define __rt_log_args(_fmt, _a0, _a1, _a2, _a3, _a4, ...)		\
+	__rt_log(_fmt, (uint32_t)(_a0), (uint32_t)(_a1), (uint32_t)(_a2), \
+		 (uint32_t)(_a3), (uint32_t)(_a4))
+
+/* Number of arguments, up to 16 */
+#define __rt_log_nargs(...)						\
+	__rt_log_nargs_(0, ##__VA_ARGS__, 16, 15, 14, 13, 12, 11, 10, 9, \
+			8, 7, 6, 5, 4, 3, 2, 1, 0)
+#define __rt_log_nargs_(_0, _1, _2, _3, _4, _5, _6, _7, _8, _9, _10,	\
+			_11, _12, _13, _14, _15, _16, _n, ...) _n
+
+/**
+ * It logs a message with up to TRTL_LOG_MAX_ARGS integer arguments.
+ * More arguments do not compile
+ */
+#define rt_log(_fmt, ...)						\
+	do {								\
+		static const char __rt_log_fmt[]			\
+		__attribute__((section(".rt_log_fmt"), used)) = _fmt;	\
+		typedef char __rt_log_too_many_args			\
+		[__rt_log_nargs(__VA_ARGS__) <= TRTL_LOG_MAX_ARGS ? 1 : -1] \
+		__attribute__((unused));				\
+		__rt_log_args(__rt_log_fmt, ##__VA_ARGS__, 0, 0, 0, 0, 0); \
+	} while (0)
+
+extern void rt_log_init(void);
+
+#endif
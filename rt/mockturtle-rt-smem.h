@@ -16,6 +16,8 @@
 #ifndef __WRNODE_SMEM_H
 #define __WRNODE_SMEM_H
 
+#define SMEM_BASE		0x40200000
+
 #define SMEM_RANGE_ADD		0x10000
 #define SMEM_RANGE_SUB		0x20000
 #define SMEM_RANGE_SET		0x30000
@@ -78,4 +80,43 @@ static inline void smem_atomic_xor(int *p, int x)
 	__smem_atomic_op(p, x, SMEM_RANGE_FLIP);
 }
 
+
+/**
+ * It starts the update of the variables protected by the sequence word
+ * pointed by seq. The sequence is odd while the update is in progress,
+ * the host uses it to detect torn reads
+ */
+static inline void smem_seq_write_begin(volatile int *seq)
+{
+	smem_atomic_add(seq, 1);
+	asm volatile ("" : : : "memory");
+}
+
+
+/**
+ * It completes the update of the variables protected by the sequence word
+ * pointed by seq
+ */
+static inline void smem_seq_write_end(volatile int *seq)
+{
+	asm volatile ("" : : : "memory");
+	smem_atomic_add(seq, 1);
+}
+
+
+/**
+ * It publishes n words in the shared memory, protected by the sequence
+ * word pointed by seq. The host reads them with trtl_smem_read_consistent()
+ */
+static inline void smem_seq_publish(volatile int *seq, volatile int *dst,
+				    const int *src, unsigned int n)
+{
+	unsigned int i;
+
+	smem_seq_write_begin(seq);
+	for (i = 0; i < n; ++i)
+		dst[i] = src[i];
+	smem_seq_write_end(seq);
+}
+
 #endif
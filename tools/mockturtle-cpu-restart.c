@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <errno.h>
 #include <libmockturtle.h>
@@ -35,7 +36,8 @@ static void help()
 int main(int argc, char *argv[])
 {
 	unsigned int i = 0, j, si = 0, di = 0;
-	unsigned int index[MAX_DEV][MAX_CPU];
+	unsigned int index[MAX_DEV][MAX_CPU], n_cpu[MAX_DEV];
+	struct trtl_cpu_image img[MAX_CPU];
 	uint32_t dev_id[MAX_DEV];
 	struct trtl_dev *trtl[MAX_DEV];
 	char c;
@@ -54,12 +56,14 @@ int main(int argc, char *argv[])
 				break;
 			sscanf(optarg, "%d", &index[di - 1][si]);
 			si++;
+			n_cpu[di - 1] = si;
 			break;
 		case 'D':
 		/* Save device ids to use */
 			if (di >= MAX_DEV)
 				break;
 			sscanf(optarg, "0x%x", &dev_id[di]);
+			n_cpu[di] = 0;
 			di++;
 			si = 0;
 			break;
@@ -83,19 +87,18 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	/* Restart given CPUs */
+	/* Restart given CPUs, all the CPUs of a device start together */
 	for (i = 0; i < di; i++) {
-		for (j = 0; j < si; j++) {
-			err = 0;
-			err |= trtl_cpu_stop(trtl[i], index[i][j]);
-			err |= trtl_cpu_disable(trtl[i], index[i][j]);
-			err |= trtl_cpu_enable(trtl[i], index[i][j]);
-			err |= trtl_cpu_start(trtl[i], index[i][j]);
-			if (err) {
-				fprintf(stderr,
-					"Failed to restart CPU %d. Last error: %s\n",
-					index[i][j], trtl_strerror(errno));
-			}
+		if (!n_cpu[i])
+			continue;
+		memset(img, 0, sizeof(img));
+		for (j = 0; j < n_cpu[i]; j++)
+			img[j].index = index[i][j];
+		err = trtl_cpu_load_application_gang(trtl[i], img, n_cpu[i]);
+		if (err) {
+			fprintf(stderr,
+				"Failed to restart CPUs of device 0x%04x: %s\n",
+				dev_id[i], trtl_strerror(errno));
 		}
 	}
 
@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <errno.h>
 #include <libmockturtle.h>
 #include <getopt.h>
@@ -19,19 +20,90 @@ static void help()
 	fprintf(stderr, "It loads (or dumps) an application to a white-rabbit node-core internal CPU\n\n");
 	fprintf(stderr, "-D   device identificator\n");
 	fprintf(stderr, "-i   CPU index\n");
-	fprintf(stderr, "-f   path to the binary to load. If the option '-d' is set, then\n");
-	fprintf(stderr, "     this is where the program will store the current CPU application\n");
+	fprintf(stderr, "-f   path to the binary or ELF to load. If the option '-d' is set,\n");
+	fprintf(stderr, "     then this is where the program will store the current CPU\n");
+	fprintf(stderr, "     application (flat binary)\n");
 	fprintf(stderr, "-d   dump current application\n");
 	fprintf(stderr, "-h   show this help\n");
 	fprintf(stderr, "\n");
+	fprintf(stderr,
+		"You can load several CPUs at once, so the arguments '-i' and '-f' may appear several times. All the CPUs start together once loaded\n\n");
+	fprintf(stderr,
+		"e.g. Load CPUs 0 and 1 of device 0x0382\n\n");
+	fprintf(stderr,
+		"        mockturtle-loader -D 0x0382 -i 0 -f cpu0.bin -i 1 -f cpu1.elf\n\n");
 	exit(1);
 }
 
+
+/**
+ * It reads a whole file into a new buffer
+ */
+static void *file_read(char *path, uint32_t *size)
+{
+	void *code;
+	FILE *f;
+	long len;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return NULL;
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	if (len < 0) {
+		fclose(f);
+		return NULL;
+	}
+
+	code = malloc(len);
+	if (code && fread(code, 1, len, f) != len) {
+		free(code);
+		code = NULL;
+	}
+	fclose(f);
+	*size = len;
+
+	return code;
+}
+
+
+/**
+ * It loads all the given applications and it starts the CPUs together
+ */
+static int gang_load(struct trtl_dev *trtl, unsigned int *index,
+		     char **file, unsigned int n)
+{
+	struct trtl_cpu_image img[TRTL_MAX_CPU];
+	int i, err = -1;
+
+	memset(img, 0, sizeof(img));
+	for (i = 0; i < n; i++) {
+		img[i].index = index[i];
+		img[i].code = file_read(file[i], &img[i].size);
+		if (!img[i].code) {
+			fprintf(stderr, "Cannot read %s: %s\n",
+				file[i], strerror(errno));
+			goto out;
+		}
+	}
+
+	err = trtl_cpu_load_application_gang(trtl, img, n);
+	if (err)
+		fprintf(stderr, "Cannot load applications: %s\n",
+			trtl_strerror(errno));
+out:
+	for (i = 0; i < n; i++)
+		free(img[i].code);
+	return err;
+}
+
 int main(int argc, char *argv[])
 {
 	int cpu_index = 0, err, dump = 0;
+	unsigned int index[TRTL_MAX_CPU], n_file = 0;
 	uint32_t dev_id = 0, rst;
-	char *file = NULL, c;
+	char *file = NULL, *files[TRTL_MAX_CPU], c;
 	struct trtl_dev *trtl;
 
 	atexit(trtl_exit);
@@ -47,6 +119,10 @@ int main(int argc, char *argv[])
 			break;
 		case 'f':
 			file = optarg;
+			if (n_file >= TRTL_MAX_CPU)
+				break;
+			index[n_file] = cpu_index;
+			files[n_file++] = optarg;
 			break;
 		case 'D':
 			sscanf(optarg, "0x%x", &dev_id);
@@ -81,6 +157,11 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
+	if (n_file > 1 && !dump) {
+		err = gang_load(trtl, index, files, n_file);
+		goto out;
+	}
+
 	err = trtl_cpu_reset_get(trtl, &rst);
 	if (err) {
 		fprintf(stderr, "Cannot get current reset line status: %s\n",
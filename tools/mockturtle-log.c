@@ -0,0 +1,119 @@
+/*
+ * Copyright (C) 2016 CERN (www.cern.ch)
+ * Author: Federico Vaga <federico.vaga@cern.ch>
+ * License: GPL v3
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <libmockturtle.h>
+#include <getopt.h>
+
+#define LOG_BATCH 32
+
+static void help()
+{
+	fprintf(stderr, "\n");
+	fprintf(stderr, "mockturtle-log -D 0x<hex-number> -f <path> [options]\n\n");
+	fprintf(stderr, "It prints the binary log of a real-time application. The application must be built with RT_USE_LOG\n\n");
+	fprintf(stderr, "-D   device identificator in hexadecimal format\n");
+	fprintf(stderr, "-c   CPU index. The default is 0\n");
+	fprintf(stderr, "-f   path to the ELF of the running application\n");
+	fprintf(stderr, "-p   polling period in milliseconds. The default is 100\n");
+	fprintf(stderr, "-h   show this help\n");
+	fprintf(stderr, "\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	struct trtl_log_record rec[LOG_BATCH];
+	unsigned int period = 100, cpu = 0;
+	uint32_t dev_id = 0;
+	struct trtl_dev *trtl;
+	struct trtl_log *log;
+	char *file = NULL, c, buf[256];
+	int n, i;
+
+	atexit(trtl_exit);
+
+	while ((c = getopt (argc, argv, "hD:c:f:p:")) != -1) {
+		switch (c) {
+		default:
+			help();
+			break;
+		case 'D':
+			sscanf(optarg, "0x%x", &dev_id);
+			break;
+		case 'c':
+			sscanf(optarg, "%u", &cpu);
+			break;
+		case 'f':
+			file = optarg;
+			break;
+		case 'p':
+			sscanf(optarg, "%u", &period);
+			break;
+		}
+	}
+
+	if (!file) {
+		fprintf(stderr, "Missing application ELF\n");
+		exit(1);
+	}
+
+	if (!dev_id) {
+		fprintf(stderr, "Invalid Mock Turtle device\n");
+		exit(1);
+	}
+
+	if (trtl_init()) {
+		fprintf(stderr, "Cannot init Mock Turtle lib: %s\n",
+			trtl_strerror(errno));
+		exit(1);
+	}
+
+	trtl = trtl_open_by_fmc(dev_id);
+	if (!trtl) {
+		fprintf(stderr, "Cannot open Mock Turtle device: %s\n",
+			trtl_strerror(errno));
+		exit(1);
+	}
+
+	log = trtl_log_open(trtl, cpu, file);
+	if (!log) {
+		fprintf(stderr, "Cannot open the binary log: %s\n",
+			trtl_strerror(errno));
+		trtl_close(trtl);
+		exit(1);
+	}
+
+	while (1) {
+		n = trtl_log_read(log, rec, LOG_BATCH);
+		if (n < 0) {
+			fprintf(stderr, "Cannot read the binary log: %s\n",
+				trtl_strerror(errno));
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			if (trtl_log_format(log, &rec[i], buf, sizeof(buf)) < 0)
+				snprintf(buf, sizeof(buf), "invalid record: %s",
+					 trtl_strerror(errno));
+			/* cycles are 8ns long */
+			fprintf(stdout, "[%u.%09u] %s\n",
+				rec[i].sec, rec[i].cycles * 8, buf);
+		}
+
+		if (n < LOG_BATCH)
+			usleep(period * 1000);
+	}
+
+	trtl_log_close(log);
+	trtl_close(trtl);
+
+	exit(1);
+}
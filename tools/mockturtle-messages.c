@@ -82,7 +82,7 @@ static int dump_message(struct trtl_dev *trtl, struct trtl_hmq *hmq)
 		fprintf(stdout, "[%s] ", stime);
 	}
 	fprintf(stdout, "%s :", basename(hmq->syspath));
-	wmsg = trtl_hmq_receive(hmq);
+	wmsg = trtl_hmq_receive_pool(hmq);
 	if (!wmsg) {
 		fprintf(stdout, " error : %s\n", trtl_strerror(errno));
 		return -1;
@@ -109,7 +109,7 @@ static int dump_message(struct trtl_dev *trtl, struct trtl_hmq *hmq)
 		fprintf(stdout, "\n");
 	}
 
-	free(wmsg);
+	trtl_hmq_msg_release(hmq, wmsg);
 
 	return 0;
 }